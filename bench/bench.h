@@ -0,0 +1,61 @@
+#pragma once
+
+// Minimal host-side benchmark harness for the native env.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+// heap counters, maintained by the malloc interposer in main.cpp
+extern size_t bench_alloc_count;
+extern size_t bench_alloc_bytes;
+
+// keeps the optimiser from discarding a computed value
+template <typename T>
+inline void bench_keep(const T& value)
+{
+  asm volatile("" : : "g"(&value) : "memory");
+}
+
+struct BenchResult {
+  double nsPerOp;
+  double allocsPerOp;
+  double bytesPerOp;
+};
+
+template <typename Fn>
+BenchResult bench_run(const char* name, uint32_t iterations, Fn fn)
+{
+  for (uint32_t i = 0; i < iterations / 10 + 1; i++) fn(); // warm up
+  size_t allocCount = bench_alloc_count;
+  size_t allocBytes = bench_alloc_bytes;
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < iterations; i++) fn();
+  auto end = std::chrono::steady_clock::now();
+  BenchResult result;
+  result.nsPerOp = std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+  result.allocsPerOp = (double)(bench_alloc_count - allocCount) / iterations;
+  result.bytesPerOp = (double)(bench_alloc_bytes - allocBytes) / iterations;
+  printf("%-36s %10.1f ns/op %12.0f ops/s %6.2f allocs/op %8.1f B/op\n",
+         name, result.nsPerOp, 1e9 / result.nsPerOp, result.allocsPerOp, result.bytesPerOp);
+  return result;
+}
+
+// compares a buffer against a lowercase hex string, printing a diff on mismatch
+bool bench_expect_hex(const char* name, const uint8_t* data, size_t length, const char* expected);
+
+// suites, each returns false if a correctness check failed
+bool bench_fastcon();
+bool bench_decoder();
+bool bench_dispatch();
+bool bench_scan();
+bool bench_pairing();
+bool bench_state();
+bool bench_log();
+bool bench_metrics();
+bool bench_scene();
+bool bench_transition();
+bool bench_tx();
+bool bench_bridges();
@@ -0,0 +1,281 @@
+// Multiple bridges: three simulated bridges along a 20 m house share their
+// RSSI tables through an in-memory broker, and every command is sent by the
+// owners of its light and decoded by the simulated lights in range. Checks
+// that exactly one bridge sends for each light, that it reaches the light,
+// and that the lights of a bridge that goes silent fail over to the others.
+// Then a light is carried down the house with the broker delaying every
+// heartbeat, checking that at every handover some bridge keeps sending for
+// it, and two only for the transit and handover time. Simulated clock and radios.
+
+#include <math.h>
+
+#include "bench.h"
+#include "bridge_coordinator.h"
+#include "fastcon.h"
+
+#define SIM_BRIDGES 3
+#define SIM_LIGHTS 12
+#define SIM_UNHEARD_LIGHT 99  // registered, but out of every bridge's range
+#define SIM_RANGE_DBM -80     // the weakest signal a light or bridge decodes
+#define SIM_STEP_MS 100
+#define SIM_HEARTBEAT_MS 5000
+#define SIM_TIMEOUT_MS 15000
+#define SIM_WALKER SIM_LIGHTS      // the light carried down the house
+#define SIM_BROKER_DELAY_MS 400    // heartbeat transit in the walk
+#define SIM_HANDOVER_MS 1000
+
+typedef BridgeCoordinator<4, 256> Coordinator;
+
+static Coordinator coordinators[SIM_BRIDGES] = {
+  Coordinator(SIM_TIMEOUT_MS, 30000, 6, SIM_HANDOVER_MS), Coordinator(SIM_TIMEOUT_MS, 30000, 6, SIM_HANDOVER_MS),
+  Coordinator(SIM_TIMEOUT_MS, 30000, 6, SIM_HANDOVER_MS),
+};
+static const char* const ids[SIM_BRIDGES] = { "a4cf12000001", "a4cf12000002", "a4cf12000003" };
+static const float bridgeAt[SIM_BRIDGES] = { 0, 10, 20 };
+static bool online[SIM_BRIDGES];
+static const uint8_t mesh_key[4] = { 0x5e, 0x1f, 0x2d, 0x77 };
+static bool walking;  // SIM_WALKER is in the house
+static float walkerAt;
+static uint32_t brokerDelayMs;
+
+// heartbeats on their way through the broker, one per bridge at most
+struct InFlight {
+  bool pending;
+  uint32_t deliverAt;
+  uint8_t lights[256];
+  int8_t rssi[256];
+  size_t n;
+};
+static InFlight inFlight[SIM_BRIDGES];
+
+static float lightAt(int light)
+{
+  if (light == SIM_WALKER) return walkerAt;
+  return light * 20.0f / (SIM_LIGHTS - 1);
+}
+
+// -45 dBm at a metre, 2.5 dB a metre after that, and a few dB of noise
+static int8_t signal(int bridge, int light, bool noisy)
+{
+  static uint32_t seed = 1;
+  seed = seed * 1103515245 + 12345;
+  int noise = noisy ? (int)((seed >> 16) % 7) - 3 : 0;
+  return (int8_t)(-45 - 2.5f * fabsf(bridgeAt[bridge] - lightAt(light)) + noise);
+}
+
+static bool inRange(int bridge, int light)
+{
+  return (light < SIM_LIGHTS || (walking && light == SIM_WALKER)) && signal(bridge, light, false) >= SIM_RANGE_DBM;
+}
+
+// the broker: a heartbeat goes to every other bridge that's online, after
+// the broker's delay
+static void deliverHeartbeat(int from, uint32_t now)
+{
+  InFlight& heartbeat = inFlight[from];
+  heartbeat.pending = false;
+  for (int b = 0; b < SIM_BRIDGES; b++) {
+    if (b != from && online[b]) coordinators[b].receive(ids[from], heartbeat.lights, heartbeat.rssi, heartbeat.n, now);
+  }
+}
+
+static void publishHeartbeat(int from, uint32_t now)
+{
+  InFlight& heartbeat = inFlight[from];
+  heartbeat.n = coordinators[from].snapshot(now, heartbeat.lights, heartbeat.rssi, 256);
+  heartbeat.deliverAt = now + brokerDelayMs;
+  heartbeat.pending = true;
+  if (!brokerDelayMs) deliverHeartbeat(from, now);
+}
+
+static void step(uint32_t now)
+{
+  for (int b = 0; b < SIM_BRIDGES; b++) {
+    if (!online[b]) continue;
+    // each light's status advert, once a second
+    for (int light = 0; light <= SIM_WALKER; light++) {
+      if ((now / SIM_STEP_MS) % 10 == (uint32_t)light % 10 && inRange(b, light)) {
+        coordinators[b].hear(light, signal(b, light, true), now);
+      }
+    }
+    if (inFlight[b].pending && now >= inFlight[b].deliverAt) deliverHeartbeat(b, now);
+    if ((now + b * 1700) % SIM_HEARTBEAT_MS == 0) publishHeartbeat(b, now);
+    coordinators[b].expire(now);
+  }
+}
+
+// every online bridge that owns the light sends it an "on" frame; returns
+// the number of bridges that sent it, and counts the frames the light decoded
+static int command(int light, int& decoded)
+{
+  uint8_t data[8] = { 0x20 | FASTCON_SINGLE_CONTROL, (uint8_t)light, 0x7f };
+  int senders = 0;
+  decoded = 0;
+  for (int b = 0; b < SIM_BRIDGES; b++) {
+    if (!online[b] || !coordinators[b].owns(light)) continue;
+    senders++;
+    FastconFrame frame;
+    generate_frame(5, data, 8, mesh_key, 1, frame);
+    if (!inRange(b, light)) continue;
+    const uint8_t* mData;
+    uint8_t mLength = fastcon_manufacturer_data(frame.data, frame.length, mData);
+    FastconCommand received;
+    if (fastcon_decode_frame(mData, mLength, mesh_key, received) == FASTCON_DECODE_OK && received.data[1] == light) decoded++;
+  }
+  return senders;
+}
+
+// commands every light, checking one bridge sends it and the light gets it
+static bool commandAll(const char* phase)
+{
+  bool ok = true;
+  for (int light = 0; light < SIM_LIGHTS; light++) {
+    int decoded;
+    int senders = command(light, decoded);
+    if (senders != 1 || decoded != 1) {
+      printf("BRIDGES MISMATCH %s: light %d sent by %d bridges, decoded %d times\n", phase, light, senders, decoded);
+      ok = false;
+    }
+  }
+  int decoded;
+  int senders = command(SIM_UNHEARD_LIGHT, decoded);
+  if (senders != 1) {
+    printf("BRIDGES MISMATCH %s: the light nobody hears is sent by %d bridges\n", phase, senders);
+    ok = false;
+  }
+  return ok;
+}
+
+// A light carried from one end of the house to the other at 0.5 m/s while
+// each heartbeat takes SIM_BROKER_DELAY_MS through the broker, so the
+// bridges' tables disagree for a while after each one. Every bridge that
+// transmits() for the light would send it a command every step.
+static bool walk()
+{
+  for (int b = 0; b < SIM_BRIDGES; b++) {
+    coordinators[b].begin(ids[b]);
+    online[b] = true;
+    inFlight[b].pending = false;
+  }
+  walking = true;
+  walkerAt = 0;
+  brokerDelayMs = SIM_BROKER_DELAY_MS;
+  bool ok = true;
+  uint32_t now = 0;
+  for (; now < 10000; now += SIM_STEP_MS) step(now);
+  const char* owner = coordinators[0].owner(SIM_WALKER);
+  int handovers = 0;
+  uint32_t unsentMs = 0;
+  uint32_t doubledMs = 0;
+  for (uint32_t start = now; now - start <= 40000; now += SIM_STEP_MS) {
+    walkerAt = (now - start) * 0.0005f;
+    step(now);
+    if (strcmp(coordinators[0].owner(SIM_WALKER), owner) != 0) {
+      owner = coordinators[0].owner(SIM_WALKER);
+      handovers++;
+    }
+    int senders = 0;
+    for (int b = 0; b < SIM_BRIDGES; b++) senders += coordinators[b].transmits(SIM_WALKER, now);
+    if (senders == 0) unsentMs += SIM_STEP_MS;
+    if (senders > 1) doubledMs += SIM_STEP_MS;
+  }
+  printf("light carried 20 m, heartbeats %u ms late: %d handovers, sent twice for %u ms, unsent for %u ms\n",
+         SIM_BROKER_DELAY_MS, handovers, (unsigned)doubledMs, (unsigned)unsentMs);
+  if (handovers == 0) {
+    printf("BRIDGES MISMATCH the carried light never changed owner\n");
+    ok = false;
+  }
+  if (unsentMs != 0) {
+    printf("BRIDGES MISMATCH no bridge sent for the carried light during a handover\n");
+    ok = false;
+  }
+  if (doubledMs > (uint32_t)handovers * (SIM_BROKER_DELAY_MS + SIM_HANDOVER_MS)) {
+    printf("BRIDGES MISMATCH the carried light was sent twice for longer than the transit and handover time\n");
+    ok = false;
+  }
+  walking = false;
+  brokerDelayMs = 0;
+  return ok;
+}
+
+bool bench_bridges()
+{
+  printf("\n== multiple bridges (simulated)\n");
+  bool ok = true;
+  for (int b = 0; b < SIM_BRIDGES; b++) {
+    coordinators[b].begin(ids[b]);
+    online[b] = true;
+  }
+
+  // settle, then count how often a light changes owner while nothing moves
+  const char* owners[SIM_LIGHTS] = {};
+  uint32_t handoffs = 0;
+  uint32_t now = 0;
+  for (; now <= 30000; now += SIM_STEP_MS) {
+    step(now);
+    if (now < 10000) continue;
+    for (int light = 0; light < SIM_LIGHTS; light++) {
+      const char* owner = coordinators[0].owner(light);
+      if (owners[light] && strcmp(owners[light], owner) != 0) handoffs++;
+      owners[light] = owner;
+    }
+  }
+  ok &= commandAll("all bridges");
+  int owned[SIM_BRIDGES] = {};
+  for (int light = 0; light < SIM_LIGHTS; light++) {
+    for (int b = 0; b < SIM_BRIDGES; b++) owned[b] += coordinators[b].owns(light);
+  }
+  printf("3 bridges, %d lights: %d, %d and %d owned, %u handoffs in 20 s\n",
+         SIM_LIGHTS, owned[0], owned[1], owned[2], (unsigned)handoffs);
+  if (handoffs != 0) {
+    printf("BRIDGES MISMATCH lights changed owner with nothing moving\n");
+    ok = false;
+  }
+  if (strcmp(coordinators[2].leader(), ids[0]) != 0) {
+    printf("BRIDGES MISMATCH the leader should be the lowest id\n");
+    ok = false;
+  }
+
+  // the middle bridge goes silent: its lights go unsent until the others
+  // time it out, then every light is reached again
+  online[1] = false;
+  uint32_t failedAt = now;
+  uint32_t recoveredAt = 0;
+  for (; now <= failedAt + 30000; now += SIM_STEP_MS) {
+    step(now);
+    if (!recoveredAt && coordinators[0].bridges() == 2 && coordinators[2].bridges() == 2) recoveredAt = now;
+  }
+  printf("middle bridge silent: lights failed over after %u ms\n", (unsigned)(recoveredAt - failedAt));
+  if (!recoveredAt || recoveredAt - failedAt > SIM_TIMEOUT_MS + SIM_HEARTBEAT_MS) {
+    printf("BRIDGES MISMATCH failover took longer than the timeout and a heartbeat\n");
+    ok = false;
+  }
+  ok &= commandAll("middle bridge silent");
+
+  // the leader goes silent too: the last bridge takes every light
+  online[0] = false;
+  for (uint32_t until = now + 30000; now <= until; now += SIM_STEP_MS) step(now);
+  if (!coordinators[2].isLeader()) {
+    printf("BRIDGES MISMATCH the last bridge didn't take over as leader\n");
+    ok = false;
+  }
+  for (int light = 0; light <= SIM_UNHEARD_LIGHT; light++) {
+    if (!coordinators[2].owns(light)) {
+      printf("BRIDGES MISMATCH the last bridge doesn't own light %d\n", light);
+      ok = false;
+      break;
+    }
+  }
+
+  ok &= walk();
+
+  BenchResult owner = bench_run("owner of a light, 3 bridges", 1000000, [&] {
+    static uint8_t light = 0;
+    bench_keep(coordinators[0].owns(light++ % SIM_LIGHTS));
+  });
+  if (owner.allocsPerOp != 0) {
+    printf("ownership allocates\n");
+    ok = false;
+  }
+  return ok;
+}
@@ -0,0 +1,121 @@
+// Round trips encoder output through the FastCon decoder, checks that
+// corrupted and foreign frames are rejected, and times both paths.
+
+#include "bench.h"
+#include "fastcon.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const uint8_t mesh_key[] = { 0x12, 0x34, 0x56, 0x78 };
+static const uint8_t other_key[] = { 0x9a, 0xbc, 0xde, 0x78 }; // same safe key byte as mesh_key
+
+// the manufacturer data of a frame, as a scan callback would see it
+static const uint8_t* frame_mdata(const FastconFrame& frame, uint8_t& length)
+{
+  const uint8_t* mData;
+  length = fastcon_manufacturer_data(frame.data, frame.length, mData);
+  return mData;
+}
+
+static bool check_round_trip()
+{
+  bool ok = true;
+  int failures = 0;
+  srand(14);
+  for (int n = 0; n < 10000; n++) {
+    uint8_t key[4];
+    for (uint8_t& b : key) b = rand();
+    uint8_t data[FASTCON_MAX_DATA_LENGTH];
+    uint8_t length = 1 + rand() % FASTCON_MAX_DATA_LENGTH;
+    for (int j = 0; j < length; j++) data[j] = rand();
+    int i = rand() % 8;
+    int forward = rand() % 2;
+    FastconFrame frame;
+    generate_frame(i, data, length, key, forward, frame);
+    uint8_t mLength;
+    const uint8_t* mData = frame_mdata(frame, mLength);
+
+    FastconCommand command;
+    FastconDecodeResult result = fastcon_decode_frame(mData, mLength, key, command);
+    bool match = result == FASTCON_DECODE_OK && command.type == i && command.forward == forward
+      && command.i2 == 0 && command.sequence == SEND_SEQ && memcmp(command.data, data, length) == 0;
+    for (int j = length; j < FASTCON_MAX_DATA_LENGTH; j++) match &= command.data[j] == 0;
+    if (!match && failures++ < 5) printf("round trip %d failed (result %d)\n", n, result);
+
+    // every single bit error is caught, by the header checks or the CRC
+    uint8_t corrupted[FASTCON_COMMAND_DATA_LENGTH];
+    memcpy(corrupted, mData, mLength);
+    int bit = rand() % (mLength * 8);
+    corrupted[bit / 8] ^= 1 << (bit % 8);
+    if (fastcon_decode_frame(corrupted, mLength, key, command) == FASTCON_DECODE_OK && failures++ < 5) {
+      printf("bit %d flipped, frame still decoded\n", bit);
+    }
+  }
+  if (failures) {
+    printf("%d round trip failures\n", failures);
+    ok = false;
+  }
+
+  // a frame for another mesh whose key shares the safe key byte still fails the checksum
+  FastconFrame frame;
+  uint8_t data[] = { 0x22, 0x01, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00 };
+  generate_frame(5, data, 8, other_key, 1, frame);
+  uint8_t mLength;
+  const uint8_t* mData = frame_mdata(frame, mLength);
+  FastconCommand command;
+  FastconDecodeResult result = fastcon_decode_frame(mData, mLength, mesh_key, command);
+  if (result != FASTCON_DECODE_CHECKSUM) {
+    printf("frame for another key: expected a checksum failure, got %d\n", result);
+    ok = false;
+  }
+
+  // light adverts: default key in the clear, then encrypted with the mesh key
+  uint8_t advertData[FASTCON_ADVERT_DATA_LENGTH] = { 0xf0, 0xff, 0x00, 0x00, 0x00, 0x00,
+    0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff, 0xa1, 0xa8, 0x5e, 0x36, 0x7b, 0xc4 };
+  FastconLightAdvert advert;
+  if (fastcon_decode_light_advert(advertData, sizeof(advertData), mesh_key, advert) != FASTCON_DECODE_OK
+      || !advert.defaultKey || advert.mac[0] != 0xaa || advert.type[0] != 0xa1) {
+    printf("unpaired light advert not decoded\n");
+    ok = false;
+  }
+  const uint8_t status[12] = { 0x00, 0x07, 0x40, 0x10, 0x20, 0x30 };
+  for (int j = 0; j < 12; j++) advertData[6 + j] = status[j] ^ mesh_key[j & 3];
+  if (fastcon_decode_light_advert(advertData, sizeof(advertData), mesh_key, advert) != FASTCON_DECODE_OK
+      || advert.defaultKey || advert.number != 7 || memcmp(advert.status, status, 12) != 0) {
+    printf("paired light advert not decoded\n");
+    ok = false;
+  }
+  return ok;
+}
+
+bool bench_decoder()
+{
+  printf("\n== fastcon decoder\n");
+  bool ok = check_round_trip();
+
+  uint8_t data[] = { 0x22, 0x01, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00 };
+  FastconFrame frame;
+  generate_frame(5, data, 8, mesh_key, 1, frame);
+  uint8_t mLength;
+  const uint8_t* mData = frame_mdata(frame, mLength);
+  uint8_t foreign[FASTCON_COMMAND_DATA_LENGTH];
+  for (uint8_t& b : foreign) b = rand();
+  foreign[0] = 0xf0;
+  foreign[1] = 0xff;
+
+  const uint32_t n = 1000000;
+  BenchResult valid = bench_run("fastcon_decode_frame (valid)", n, [&] {
+    FastconCommand command;
+    bench_keep(fastcon_decode_frame(mData, mLength, mesh_key, command));
+    bench_keep(command);
+  });
+  bench_run("fastcon_decode_frame (foreign)", n, [&] {
+    FastconCommand command;
+    bench_keep(fastcon_decode_frame(foreign, sizeof(foreign), mesh_key, command));
+  });
+  if (valid.allocsPerOp != 0) {
+    printf("fastcon_decode_frame allocated, expected no heap use\n");
+    ok = false;
+  }
+  return ok;
+}
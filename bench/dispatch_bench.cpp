@@ -0,0 +1,179 @@
+// Cost of getting from an HA command callback to the light it addresses.
+//
+// A model, not the firmware: the light record and HA entity need the
+// Arduino BLE and HA libraries, so stand-ins with the same members time the
+// two registry layouts the firmware has used: a linear scan
+// comparing unique ids that returns the LightDevice by value (copying the
+// BLE advert it embeds), and the MeshLight entity that carries a pointer to
+// its registry entry. Then the type dispatch: the old runtime table of type
+// names compared as strings, against the constexpr traits in light_types.h,
+// checking the commands encoded from the traits match the hand-coded ones.
+
+#include "bench.h"
+#include "light_types.h"
+#include <deque>
+#include <string.h>
+#include <stdexcept>
+#include <vector>
+
+// stand-in for BLEAdvertisedDevice: address, name, payload, service lists
+struct AdvertModel {
+  std::string address;
+  std::string name;
+  std::string manufacturerData;
+  std::vector<std::string> serviceUuids;
+  uint8_t payload[62];
+};
+
+struct LightModel {
+  AdvertModel device;
+  uint8_t type[2];
+  bool isRegistered;
+  std::string id;
+  void* light;
+  std::string name;
+  uint8_t number;
+};
+
+struct EntityModel {
+  std::string uniqueId;
+  LightModel* device;
+};
+
+static LightModel getLightByScan(std::deque<LightModel>& lights, const std::string& id)
+{
+  for (size_t i = 0; i < lights.size(); i++) {
+    if (lights[i].id == id) return lights[i];
+  }
+  throw std::runtime_error("Light not found");
+}
+
+static void bench_dispatch_with(int count)
+{
+  std::deque<LightModel> lights;
+  std::deque<EntityModel> entities;
+  for (int i = 0; i < count; i++) {
+    char id[8];
+    snprintf(id, sizeof(id), "%04X", i * 7919 & 0xffff);
+    LightModel light = {};
+    light.device.address = "aa:bb:cc:dd:ee:ff";
+    light.device.name = "BRmesh light";
+    light.device.manufacturerData = std::string(18, 'x');
+    light.device.serviceUuids.push_back("0000fff0-0000-1000-8000-00805f9b34fb");
+    light.id = id;
+    light.name = std::string("Light_") + id;
+    light.number = i + 1;
+    lights.push_back(light);
+    entities.push_back({ id, &lights.back() });
+  }
+  // worst case for the scan: the last light registered
+  EntityModel* sender = &entities.back();
+
+  char name[64];
+  snprintf(name, sizeof(name), "dispatch by id scan + copy (%d)", count);
+  bench_run(name, 20000, [&] {
+    uint8_t data[8] = { 0x22 };
+    data[1] = getLightByScan(lights, sender->uniqueId.c_str()).number;
+    bench_keep(data);
+  });
+  snprintf(name, sizeof(name), "dispatch by entity pointer (%d)", count);
+  bench_run(name, 20000, [&] {
+    uint8_t data[8] = { 0x22 };
+    data[1] = sender->device->number;
+    bench_keep(data);
+  });
+}
+
+// the table as it was: looked up by code, then compared by name
+struct LegacyType {
+  std::string name;
+  uint8_t code[2];
+};
+static std::vector<LegacyType> legacyTypes = {
+  {"Smart", {0x39, 0xae}},
+  {"RGBW" , {0xa1, 0xa8}},
+  {"RGB"  , {0xa0, 0xa8}},
+};
+
+static std::string legacyTypeName(const uint8_t* type)
+{
+  for (size_t j = 0; j < legacyTypes.size(); j++) {
+    if (type[0] == legacyTypes[j].code[0] && type[1] == legacyTypes[j].code[1]) return legacyTypes[j].name;
+  }
+  return "";
+}
+
+static uint8_t legacyFeatures(const uint8_t* type)
+{
+  std::string typeName = legacyTypeName(type);
+  if (typeName == "RGBW") return LIGHT_BRIGHTNESS | LIGHT_COLOR_TEMPERATURE | LIGHT_RGB;
+  if (typeName == "RGB") return LIGHT_BRIGHTNESS | LIGHT_RGB;
+  return LIGHT_ON_OFF;
+}
+
+static constexpr uint8_t RGBW_CODE[] = { 0xa1, 0xa8 };
+static_assert(light_type_index(RGBW_CODE) == 1, "RGBW is resolved at compile time");
+static_assert(light_traits(light_type_index(RGBW_CODE)).features == (LIGHT_BRIGHTNESS | LIGHT_COLOR_TEMPERATURE | LIGHT_RGB),
+              "RGBW has every feature");
+
+static bool expect_command(const char* name, const uint8_t* actual, const uint8_t* expected)
+{
+  if (memcmp(actual, expected, 8) == 0) return true;
+  printf("COMMAND MISMATCH %s\n", name);
+  return false;
+}
+
+static bool bench_types()
+{
+  bool ok = true;
+  // features and commands from the traits, against the code they replace
+  for (const LegacyType& type : legacyTypes) {
+    if (light_traits(light_type_index(type.code)).features != legacyFeatures(type.code)) {
+      printf("FEATURE MISMATCH %s\n", type.name.c_str());
+      ok = false;
+    }
+  }
+  const uint8_t unknown[] = { 0x12, 0x34 };
+  ok &= light_type_index(unknown) == LIGHT_TYPE_UNKNOWN && light_traits(LIGHT_TYPE_UNKNOWN).features == LIGHT_ON_OFF;
+  const LightCommandLayout& layout = light_traits(1).layout;
+  uint8_t data[8];
+  const uint8_t on[8] = { 0x20, 0, 0x80 };
+  memset(data, 0, 8);
+  light_encode_state(layout, true, data);
+  ok &= expect_command("on", data, on);
+  const uint8_t off[8] = { 0x20 };
+  memset(data, 0, 8);
+  light_encode_state(layout, false, data);
+  ok &= expect_command("off", data, off);
+  const uint8_t brightness[8] = { 0x20, 0, 200 & 127 };
+  memset(data, 0, 8);
+  light_encode_brightness(layout, 200, data);
+  ok &= expect_command("brightness", data, brightness);
+  // blue, red, green
+  const uint8_t rgb[8] = { 0x70, 0, 100, 30, 10, 20 };
+  memset(data, 0, 8);
+  light_encode_rgb(layout, 100, 10, 20, 30, data);
+  ok &= expect_command("rgb", data, rgb);
+  const uint8_t temperature[8] = { 0x70, 0, 100, 0, 0, 0, 400 & 127, (400 >> 8) & 127 };
+  memset(data, 0, 8);
+  light_encode_temperature(layout, 100, 400, data);
+  ok &= expect_command("color temperature", data, temperature);
+
+  uint32_t n = 0;
+  bench_run("type -> features by name compare", 1000000, [&] {
+    bench_keep(legacyFeatures(legacyTypes[n++ % 3].code));
+  });
+  bench_run("type -> features by traits table", 1000000, [&] {
+    bench_keep(light_traits(light_type_index(legacyTypes[n++ % 3].code)).features);
+  });
+  return ok;
+}
+
+bool bench_dispatch()
+{
+  printf("\n== command dispatch (model)\n");
+  bench_dispatch_with(1);
+  bench_dispatch_with(32);
+  bench_dispatch_with(255);
+  return bench_types();
+}
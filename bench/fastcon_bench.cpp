@@ -0,0 +1,300 @@
+// Golden vectors and per-stage timing for the FastCon encoder.
+
+#include "bench.h"
+#include "fastcon.h"
+#include "frame_cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const uint8_t test_key[] = { 0x12, 0x34, 0x56, 0x78 };
+static const uint8_t zero_key[] = { 0x00, 0x00, 0x00, 0x00 };
+static const uint8_t on_data[] = { 0x22, 0x01, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00 };
+static const uint8_t brightness_data[] = { 0x22, 0x02, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00 };
+static const uint8_t rgb_data[] = { 0x72, 0x03, 0x7f, 0x10, 0x20, 0x30, 0x00, 0x00 };
+static const uint8_t wake_data[] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+static const uint8_t add_data[] = { 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff, 0x04, 0x01, 0x12, 0x34, 0x56, 0x78 };
+
+struct GoldenFrame {
+  const char* name;
+  int i;
+  const uint8_t* data;
+  uint8_t length;
+  const uint8_t* key;
+  int forward;
+  uint8_t sequence;
+  const char* frame;
+};
+
+// advertisement data as sent by single_control(), scan() and addLight(),
+// pinned to the output of the original firmware encoder
+static const GoldenFrame golden_frames[] = {
+  { "on", 5, on_data, 8, test_key, 1, 0x02, "0201041bfff0ff6db64368931ddd07db93a83df2b329c827dbe6613eb7959f" },
+  { "brightness", 5, brightness_data, 8, test_key, 1, 0x03, "0201041bfff0ff6db64368931ddd06dbd1a83e32b329c827dbe6613eb78ab2" },
+  { "rgb", 5, rgb_data, 8, test_key, 1, 0xff, "0201041bfff0ff6db64368931dddfadbe5f83f0da309f827dbe6613eb74322" },
+  { "wake", 0, wake_data, 6, zero_key, 0, 0x02, "0201041bfff0ff6db64368931d0d075c7fc63e5f0f65ca0a67aa63130bae81" },
+  { "add light", 2, add_data, 12, default_key, 0, 0x07, "0201041bfff0ff6db64368931d2d0267816c8593d28b350e66b85745737f21" },
+  { "on seq 0x80", 5, on_data, 8, test_key, 1, 0x80, "0201041bfff0ff6db64368931ddd85db15a83df2b329c827dbe6613eb7f8eb" },
+};
+
+// the original bit-at-a-time crc16, kept as the reference for the table version
+static uint8_t reference_reverse_8(uint8_t d)
+{
+  uint8_t result = 0;
+  for (uint8_t k = 0; k < 8; k++) {
+    result |= ((d >> k) & 1) << (7 - k);
+  }
+  return result;
+}
+
+static uint16_t reference_reverse_16(uint16_t d) {
+  uint16_t result = 0;
+  for (uint8_t k = 0; k < 16; k++) {
+    result |= ((d >> k) & 1) << (15 - k);
+  }
+  return result;
+}
+
+static uint16_t reference_crc16(const uint8_t* addr, const uint8_t* data, uint8_t dataLength)
+{
+  uint16_t crc = 0xffff;
+  for (int8_t i = addrLength - 1; i >= 0; i--)
+  {
+    crc ^= addr[i] << 8;
+    for (uint8_t ii = 0; ii < 4; ii++) {
+      uint16_t tmp = crc << 1;
+      if ((crc & 0x8000) != 0) tmp ^= 0x1021;
+      crc = tmp << 1;
+      if ((tmp & 0x8000) != 0) crc ^= 0x1021;
+    }
+  }
+  for (uint8_t i = 0; i < dataLength; i++) {
+    crc ^= reference_reverse_8(data[i]) << 8;
+    for (uint8_t ii = 0; ii < 4; ii++) {
+      uint16_t tmp = crc << 1;
+      if ((crc & 0x8000) != 0) tmp ^= 0x1021;
+      crc = tmp << 1;
+      if ((tmp & 0x8000) != 0) crc ^= 0x1021;
+    }
+  }
+  crc = ~reference_reverse_16(crc) & 0xffff;
+  return crc;
+}
+
+static bool check_crc16()
+{
+  bool ok = true;
+  for (int v = 0; v < 256; v++) {
+    if (reverse_8(v) != reference_reverse_8(v)) {
+      printf("reverse_8 mismatch for %02x\n", v);
+      ok = false;
+    }
+  }
+  srand(1);
+  uint8_t addr[3];
+  uint8_t data[32];
+  for (int n = 0; n < 10000; n++) {
+    for (uint8_t& b : addr) b = rand();
+    for (uint8_t& b : data) b = rand();
+    const uint8_t* a = (n & 1) ? DEFAULT_BLE_FASTCON_ADDRESS : addr;
+    uint8_t length = n % (sizeof(data) + 1);
+    if (crc16(a, data, length) != reference_crc16(a, data, length)) {
+      printf("crc16 mismatch on case %d\n", n);
+      ok = false;
+      break;
+    }
+  }
+  return ok;
+}
+
+static bool check_whitening()
+{
+  bool ok = true;
+  srand(2);
+  uint8_t data[FASTCON_WHITENING_KEYSTREAM_LENGTH + 16];
+  uint8_t expected[sizeof(data)];
+  uint8_t actual[sizeof(data)];
+  for (int n = 0; n < 2000; n++) {
+    for (uint8_t& b : data) b = rand();
+    uint8_t seed = (n & 1) ? FASTCON_WHITENING_SEED : rand() & 0x7f;
+    int length = n % (sizeof(data) + 1);
+    uint8_t ctx[7];
+    whiteningInit(seed, ctx);
+    whiteningEncode(data, length, ctx, expected);
+    whiteningEncodeSeed(seed, data, length, actual);
+    if (memcmp(expected, actual, length) != 0) {
+      printf("whitening mismatch on case %d (seed %02x, length %d)\n", n, seed, length);
+      ok = false;
+      break;
+    }
+  }
+  return ok;
+}
+
+static bool check_golden()
+{
+  bool ok = true;
+  for (const GoldenFrame& golden : golden_frames) {
+    SEND_COUNT = golden.sequence - 1; // the encoder pre-increments
+    FastconFrame frame;
+    generate_frame(golden.i, golden.data, golden.length, golden.key, golden.forward, frame);
+    ok &= bench_expect_hex(golden.name, frame.data, frame.length, golden.frame);
+  }
+  const uint8_t crcData[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+  uint16_t crc = crc16(DEFAULT_BLE_FASTCON_ADDRESS, crcData, sizeof(crcData));
+  ok &= bench_expect_hex("crc16", (const uint8_t*)&crc, sizeof(crc), "a122");
+  ok &= check_crc16();
+  ok &= check_whitening();
+  return ok;
+}
+
+// a template patched to any sequence number gives the frame a full encode
+// would, across commands, keys (the wake frame's zero key too) and the
+// sequence counter wrapping
+static bool check_templates()
+{
+  struct Case { int i; const uint8_t* data; uint8_t length; const uint8_t* key; int forward; };
+  const Case cases[] = {
+    { 5, on_data, 8, test_key, 1 },
+    { 5, brightness_data, 8, test_key, 1 },
+    { 5, rgb_data, 8, default_key, 1 },
+    { 0, wake_data, 6, zero_key, 0 },
+    { 2, add_data, 12, default_key, 0 },
+  };
+  srand(3);
+  for (const Case& c : cases) {
+    SEND_COUNT = rand();
+    FastconFrameTemplate tmpl;
+    if (!fastcon_make_template(c.i, c.data, c.length, c.key, c.forward, tmpl)) {
+      printf("TEMPLATE FAILED for i=%d\n", c.i);
+      return false;
+    }
+    for (int n = 0; n < 600; n++) {
+      // in order past the wrap, then jumping around
+      uint8_t sequence = n < 300 ? SEND_COUNT + 1 : rand();
+      SEND_COUNT = sequence - 1;
+      FastconFrame expected;
+      generate_frame(c.i, c.data, c.length, c.key, c.forward, expected);
+      SEND_COUNT = sequence - 1;
+      const FastconFrame& patched = fastcon_next_frame(tmpl);
+      if (patched.length != expected.length || memcmp(patched.data, expected.data, expected.length) != 0) {
+        printf("TEMPLATE MISMATCH i=%d sequence %02x\n", c.i, sequence);
+        bench_expect_hex("patched", patched.data, patched.length, "");
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// the cache hands out the frames generate_frame() would, hit or miss, and a
+// colliding command evicts rather than aliases
+static bool check_cache()
+{
+  FrameCache<4> cache;
+  const uint8_t* commands[] = { on_data, brightness_data, rgb_data, on_data, on_data, rgb_data };
+  for (int round = 0; round < 3; round++) {
+    for (const uint8_t* data : commands) {
+      for (const uint8_t* key : { test_key, default_key }) {
+        uint8_t sequence = SEND_COUNT;
+        FastconFrame expected;
+        generate_frame(5, data, 8, key, 1, expected);
+        SEND_COUNT = sequence;
+        const FastconFrame* frame = cache.frame(key, data);
+        if (!frame || frame->length != expected.length || memcmp(frame->data, expected.data, expected.length) != 0) {
+          printf("CACHE MISMATCH at sequence %02x\n", (uint8_t)(sequence + 1));
+          return false;
+        }
+      }
+    }
+  }
+  if (cache.hits() == 0 || cache.hits() + cache.misses() != 3 * 6 * 2) {
+    printf("CACHE COUNTS %u hits, %u misses\n", (unsigned)cache.hits(), (unsigned)cache.misses());
+    return false;
+  }
+  return true;
+}
+
+bool bench_fastcon()
+{
+  printf("== fastcon encoder\n");
+  bool ok = check_golden();
+  ok &= check_templates();
+  ok &= check_cache();
+
+  const uint32_t n = 200000;
+  bench_run("get_payload_with_inner_retry", n, [] {
+    uint8_t payload[FASTCON_PAYLOAD_LENGTH];
+    get_payload_with_inner_retry(5, on_data, 8, 0, test_key, 1, payload);
+    bench_keep(payload);
+  });
+
+  uint8_t payload[FASTCON_PAYLOAD_LENGTH];
+  uint8_t payloadLength = get_payload_with_inner_retry(5, on_data, 8, 0, test_key, 1, payload);
+  bench_run("crc16 (bitwise reference)", n, [&] {
+    uint16_t crc = reference_crc16(DEFAULT_BLE_FASTCON_ADDRESS, payload, payloadLength);
+    bench_keep(crc);
+  });
+  bench_run("crc16", n, [&] {
+    uint16_t crc = crc16(DEFAULT_BLE_FASTCON_ADDRESS, payload, payloadLength);
+    bench_keep(crc);
+  });
+  bench_run("get_rf_payload", n, [&] {
+    uint8_t rfPayload[FASTCON_RF_BUFFER_LENGTH];
+    get_rf_payload(DEFAULT_BLE_FASTCON_ADDRESS, payload, payloadLength, rfPayload);
+    bench_keep(rfPayload);
+  });
+
+  uint8_t rfPayload[FASTCON_RF_BUFFER_LENGTH];
+  uint8_t rfPayloadLength = get_rf_payload(DEFAULT_BLE_FASTCON_ADDRESS, payload, payloadLength, rfPayload);
+  bench_run("whiteningEncode", n, [&] {
+    uint8_t ctx[7];
+    uint8_t result[FASTCON_RF_BUFFER_LENGTH];
+    whiteningInit(FASTCON_WHITENING_SEED, ctx);
+    whiteningEncode(rfPayload, rfPayloadLength, ctx, result);
+    bench_keep(result);
+  });
+  bench_run("whiteningEncodeSeed (keystream)", n, [&] {
+    uint8_t result[FASTCON_RF_BUFFER_LENGTH];
+    whiteningEncodeSeed(FASTCON_WHITENING_SEED, rfPayload, rfPayloadLength, result);
+    bench_keep(result);
+  });
+
+  uint8_t command[FASTCON_RF_PAYLOAD_LENGTH];
+  uint8_t commandLength = do_generate_command(5, on_data, 8, test_key, 1, true, 0, command);
+  bench_run("getServiceData", n, [&] {
+    uint8_t serviceData[FASTCON_SERVICE_DATA_LENGTH];
+    getServiceData(commandLength, command, serviceData);
+    bench_keep(serviceData);
+  });
+
+  BenchResult full = bench_run("generate_frame (full frame)", n, [] {
+    FastconFrame frame;
+    generate_frame(5, on_data, 8, test_key, 1, frame);
+    bench_keep(frame);
+  });
+  if (full.allocsPerOp != 0) {
+    printf("generate_frame allocated %.2f times per frame, expected none\n", full.allocsPerOp);
+    ok = false;
+  }
+  FastconFrameTemplate tmpl;
+  fastcon_make_template(5, on_data, 8, test_key, 1, tmpl);
+  BenchResult patch = bench_run("fastcon_next_frame (patched template)", n, [&] {
+    bench_keep(fastcon_next_frame(tmpl));
+  });
+  printf("patching a template is %.1fx faster than a full encode\n", full.nsPerOp / patch.nsPerOp);
+  FrameCache<16> cache;
+  BenchResult hit = bench_run("FrameCache::frame (hit)", n, [&] {
+    bench_keep(*cache.frame(test_key, on_data));
+  });
+  if (hit.allocsPerOp != 0) {
+    printf("a cache hit allocated %.2f times per frame, expected none\n", hit.allocsPerOp);
+    ok = false;
+  }
+  uint8_t varying[8];
+  memcpy(varying, brightness_data, 8);
+  bench_run("FrameCache::frame (miss)", n, [&] {
+    varying[2] = (varying[2] + 1) & 0x7f;
+    bench_keep(*cache.frame(test_key, varying));
+  });
+  return ok;
+}
@@ -0,0 +1,127 @@
+// Cost of logging one light command on the caller's side: the old direct
+// hex dumps against records pushed into the binary log ring.
+//
+// On the ESP32 the old dumps also block on the UART, which drains 11520
+// characters a second at 115200 baud; that is modelled from the number of
+// characters each command wrote.
+
+#include "bench.h"
+#include "binary_log.h"
+#include "fastcon.h"
+#include <string.h>
+
+LogRing<LOG_RING_LENGTH> logRing;
+
+uint32_t log_clock()
+{
+  return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static const uint8_t command_key[] = { 0x12, 0x34, 0x56, 0x78 };
+static const uint8_t command_data[] = { 0x22, 0x01, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+// what Serial.printf wrote before: the callback's field by field prints and
+// every frame stage dumped one byte at a time
+static char serial_buffer[1024];
+static size_t serial_length;
+
+template <typename T>
+static void serial_printf(const char* format, T value)
+{
+  if (serial_length >= sizeof(serial_buffer) - 64) serial_length = 0;
+  serial_length += snprintf(serial_buffer + serial_length, sizeof(serial_buffer) - serial_length, format, value);
+}
+
+static size_t serial_chars;
+
+static void direct_dump(const char* label, const uint8_t* data, int length)
+{
+  serial_chars += strlen(label) + 3 + 2 * length;
+  serial_printf("%s: ", label);
+  for (int i = 0; i < length; i++) serial_printf("%2.2X", data[i]);
+  serial_printf("%s", "\n");
+}
+
+static void direct_callback()
+{
+  const char* lines[] = { "Light: ", "Light_A1B2\n", "ID: ", "A1B2\n", "State: ", "1\n" };
+  for (const char* line : lines) {
+    serial_chars += strlen(line);
+    serial_printf("%s", line);
+  }
+}
+
+static void deferred_dump(const char* label, const uint8_t* data, int length)
+{
+  log_emit(LOG_LEVEL_DEBUG, data, length, "%s: ", label);
+}
+
+static void drain()
+{
+  LogRecord record;
+  while (logRing.pop(record)) bench_keep(record);
+}
+
+bool bench_log()
+{
+  printf("\n== logging per command\n");
+  bool ok = true;
+  const uint32_t n = 100000;
+
+  fastcon_set_trace(direct_dump);
+  serial_chars = 0;
+  BenchResult direct = bench_run("direct Serial.printf dumps", n, [] {
+    direct_callback();
+    FastconFrame frame;
+    generate_frame(5, command_data, 8, command_key, 1, frame);
+    bench_keep(frame);
+  });
+  size_t chars = serial_chars / (n + n / 10 + 1);
+
+  fastcon_set_trace(deferred_dump);
+  BenchResult debug = bench_run("deferred, LOG_LEVEL_DEBUG", n, [] {
+    log_emit(LOG_LEVEL_INFO, NULL, 0, "Light %s: state %d", "A1B2", 1);
+    FastconFrame frame;
+    generate_frame(5, command_data, 8, command_key, 1, frame);
+    bench_keep(frame);
+    drain();
+  });
+
+  fastcon_set_trace(0);
+  BenchResult info = bench_run("deferred, LOG_LEVEL_INFO", n, [] {
+    LOG_INFO("Light %s: state %d", "A1B2", 1);
+    FastconFrame frame;
+    generate_frame(5, command_data, 8, command_key, 1, frame);
+    bench_keep(frame);
+    drain();
+  });
+  if (info.allocsPerOp != 0 || debug.allocsPerOp != 0) {
+    printf("deferred logging allocated, expected no heap use\n");
+    ok = false;
+  }
+
+  printf("direct dumps wrote %zu chars per command: %.1f ms of UART time at 115200 baud\n",
+         chars, chars * 1000.0 / 11520);
+  printf("caller side saved per command: %.0f ns (debug), %.0f ns (info) on this host, plus the UART wait\n",
+         direct.nsPerOp - debug.nsPerOp, direct.nsPerOp - info.nsPerOp);
+
+  // the ring keeps records in order and counts what it can't take
+  drain();
+  for (int i = 0; i < LOG_RING_LENGTH + 5; i++) log_emit(LOG_LEVEL_INFO, NULL, 0, "record %d", i);
+  LogRecord record = {};
+  char line[128];
+  for (int i = 0; i < LOG_RING_LENGTH; i++) {
+    if (!logRing.pop(record) || record.args[0] != (uintptr_t)i) {
+      printf("log ring lost record %d\n", i);
+      ok = false;
+      break;
+    }
+  }
+  log_format(record, line, sizeof(line));
+  if (logRing.pop(record) || logRing.dropped() != 5 || strstr(line, "I record 63") == NULL) {
+    printf("log ring overflow not handled: %u dropped, last line \"%s\"\n", logRing.dropped(), line);
+    ok = false;
+  }
+  return ok;
+}
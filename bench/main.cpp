@@ -0,0 +1,78 @@
+// Host benchmark runner: pio run -e native -t exec
+//
+// Each suite first checks its golden vectors, then times the stages. The
+// process exits non-zero if any golden vector no longer matches.
+
+#include "bench.h"
+#include <stdlib.h>
+#include <string.h>
+
+size_t bench_alloc_count = 0;
+size_t bench_alloc_bytes = 0;
+
+// glibc's allocator entry points, so every heap allocation made by the code
+// under test (malloc or operator new) is counted
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void __libc_free(void* ptr);
+
+void* malloc(size_t size)
+{
+  bench_alloc_count++;
+  bench_alloc_bytes += size;
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+  bench_alloc_count++;
+  bench_alloc_bytes += count * size;
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+  bench_alloc_count++;
+  bench_alloc_bytes += size;
+  return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr)
+{
+  __libc_free(ptr);
+}
+}
+
+bool bench_expect_hex(const char* name, const uint8_t* data, size_t length, const char* expected)
+{
+  std::string actual;
+  char byte[3];
+  for (size_t i = 0; i < length; i++) {
+    snprintf(byte, sizeof(byte), "%02x", data[i]);
+    actual += byte;
+  }
+  if (actual == expected) return true;
+  printf("GOLDEN MISMATCH %s\n  expected %s\n  actual   %s\n", name, expected, actual.c_str());
+  return false;
+}
+
+int main()
+{
+  bool ok = true;
+  ok &= bench_fastcon();
+  ok &= bench_decoder();
+  ok &= bench_dispatch();
+  ok &= bench_scan();
+  ok &= bench_pairing();
+  ok &= bench_state();
+  ok &= bench_log();
+  ok &= bench_metrics();
+  ok &= bench_scene();
+  ok &= bench_transition();
+  ok &= bench_tx();
+  ok &= bench_bridges();
+  printf(ok ? "\nall golden vectors match\n" : "\ngolden vector check FAILED\n");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,97 @@
+// Metrics: what observing a sample costs on the hot paths (radio task, scan
+// callbacks), and the bucket, quantile and Prometheus text output.
+
+#include "bench.h"
+#include "metrics.h"
+
+static const uint32_t bounds[] = { 1, 2, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000 };
+static Histogram<12> histogram(bounds);
+
+static bool expect(const char* name, uint32_t actual, uint32_t expected)
+{
+  if (actual == expected) return true;
+  printf("METRICS MISMATCH %s: expected %u, actual %u\n", name, (unsigned)expected, (unsigned)actual);
+  return false;
+}
+
+bool bench_metrics()
+{
+  printf("\n== metrics\n");
+  bool ok = true;
+
+  // bounds are inclusive; beyond the last one is +Inf
+  Histogram<12> check(bounds);
+  const uint32_t values[] = { 0, 1, 2, 3, 10, 11, 5000, 5001, 60000, 40, 40, 40, 40, 40, 40, 40, 40, 40, 40, 40 };
+  for (uint32_t value : values) check.observe(value);
+  ok &= expect("count", check.count(), 20);
+  ok &= expect("sum", check.sum(), 0 + 1 + 2 + 3 + 10 + 11 + 5000 + 5001 + 60000 + 11 * 40);
+  ok &= expect("bucket le=1", check.bucket(0), 2);
+  ok &= expect("bucket le=2", check.bucket(1), 1);
+  ok &= expect("bucket le=5", check.bucket(2), 1);
+  ok &= expect("bucket le=10", check.bucket(3), 1);
+  ok &= expect("bucket le=25", check.bucket(4), 1);
+  ok &= expect("bucket le=50", check.bucket(5), 11);
+  ok &= expect("bucket le=5000", check.bucket(11), 1);
+  ok &= expect("bucket +Inf", check.bucket(12), 2);
+  ok &= expect("p50", check.quantile(0.5f), 50);
+  ok &= expect("p95", check.quantile(0.95f), 5000);
+  ok &= expect("p0", check.quantile(0.0f), 1);
+  Histogram<12> empty(bounds);
+  ok &= expect("empty p95", empty.quantile(0.95f), 0);
+
+  const uint32_t smallBounds[] = { 10, 20, 30 };
+  Histogram<3> small(smallBounds);
+  small.observe(5);
+  small.observe(25);
+  small.observe(99);
+  std::string page;
+  MetricsWriter out(page);
+  out.histogram("t_ms", "Test", small);
+  out.counter("t_total", "Things", 7);
+  out.header("t_light", "counter", "Per light");
+  out.sample("t_light", "light", "ab12", 3);
+  const char* expected =
+      "# HELP t_ms Test\n# TYPE t_ms histogram\n"
+      "t_ms_bucket{le=\"10\"} 1\nt_ms_bucket{le=\"20\"} 1\nt_ms_bucket{le=\"30\"} 2\n"
+      "t_ms_bucket{le=\"+Inf\"} 3\nt_ms_sum 129\nt_ms_count 3\n"
+      "# HELP t_total Things\n# TYPE t_total counter\nt_total 7\n"
+      "# HELP t_light Per light\n# TYPE t_light counter\nt_light{light=\"ab12\"} 3\n";
+  if (page != expected) {
+    printf("METRICS MISMATCH page\n--- expected\n%s--- actual\n%s", expected, page.c_str());
+    ok = false;
+  }
+
+  std::string labelled;
+  MetricsWriter split(labelled);
+  split.header("t_wait_ms", "histogram", "Split");
+  split.series("t_wait_ms", "class", "on_off", small);
+  const char* expectedLabelled =
+      "# HELP t_wait_ms Split\n# TYPE t_wait_ms histogram\n"
+      "t_wait_ms_bucket{class=\"on_off\",le=\"10\"} 1\nt_wait_ms_bucket{class=\"on_off\",le=\"20\"} 1\n"
+      "t_wait_ms_bucket{class=\"on_off\",le=\"30\"} 2\nt_wait_ms_bucket{class=\"on_off\",le=\"+Inf\"} 3\n"
+      "t_wait_ms_sum{class=\"on_off\"} 129\nt_wait_ms_count{class=\"on_off\"} 3\n";
+  if (labelled != expectedLabelled) {
+    printf("METRICS MISMATCH labelled\n--- expected\n%s--- actual\n%s", expectedLabelled, labelled.c_str());
+    ok = false;
+  }
+
+  uint32_t n = 0;
+  BenchResult observe = bench_run("histogram observe", 10000000, [&] {
+    histogram.observe((n++ * 37) % 6000);
+  });
+  if (observe.allocsPerOp != 0) {
+    printf("histogram observe allocates\n");
+    ok = false;
+  }
+  bench_run("histogram quantile p95", 1000000, [&] {
+    bench_keep(histogram.quantile(0.95f));
+  });
+  bench_run("render histogram", 100000, [&] {
+    std::string text;
+    text.reserve(1024);
+    MetricsWriter writer(text);
+    writer.histogram("latency_ms", "Latency", histogram);
+    bench_keep(text);
+  });
+  return ok;
+}
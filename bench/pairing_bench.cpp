@@ -0,0 +1,95 @@
+// Pairing schedule on a simulated clock: how long re-keying a batch of lights
+// takes one blocking scan per light, against the pipelined engine.
+//
+// Each light answers a re-key frame with some probability, a little while
+// after hearing it. The numbers are wall-clock milliseconds of the simulated
+// radio, not host time.
+
+#include "bench.h"
+#include "pairing_engine.h"
+#include <stdlib.h>
+
+#define SIM_ADVERTISE_MS 150
+#define SIM_CONFIRM_TIMEOUT_MS 1000
+#define SIM_MAX_ATTEMPTS 3
+#define SIM_SERIAL_SCAN_MS 1000
+
+struct SimLight {
+  bool keyed;
+  uint32_t confirmsAt;
+};
+
+// a light hears a frame with 80% probability and answers 100-500 ms later
+static void sim_deliver(SimLight& light, uint32_t now)
+{
+  if (light.keyed || rand() % 10 >= 8) return;
+  light.keyed = true;
+  light.confirmsAt = now + 100 + rand() % 400;
+}
+
+static uint32_t sim_serial(int lights, int& paired)
+{
+  uint32_t now = 0;
+  paired = 0;
+  for (int i = 0; i < lights; i++) {
+    SimLight light = {};
+    sim_deliver(light, now);
+    now += SIM_SERIAL_SCAN_MS;
+    if (light.keyed && light.confirmsAt <= now) paired++;
+  }
+  return now;
+}
+
+static PairingEngine<64> engine;
+
+static bool sim_pipelined(int lights, uint32_t& elapsed)
+{
+  SimLight sim[64] = {};
+  uint32_t now = 0;
+  engine.begin(SIM_MAX_ATTEMPTS, SIM_CONFIRM_TIMEOUT_MS, now);
+  for (int i = 0; i < lights; i++) engine.add(i);
+  while (!engine.done()) {
+    for (int i = 0; i < lights; i++) {
+      if (sim[i].keyed && sim[i].confirmsAt <= now) engine.confirm(i, i + 1);
+    }
+    while (engine.takeConfirmed(now) >= 0) {}
+    int i = engine.next(now);
+    if (i < 0) {
+      now += 10;
+      continue;
+    }
+    now += SIM_ADVERTISE_MS;
+    sim_deliver(sim[engine[i].id], now);
+    engine.sent(i, now);
+  }
+  elapsed = now;
+
+  bool ok = true;
+  uint32_t attempts = 0;
+  for (size_t i = 0; i < engine.size(); i++) {
+    attempts += engine[i].attempts;
+    if (engine[i].attempts > SIM_MAX_ATTEMPTS) ok = false;
+    if (engine[i].state == PAIRING_CONFIRMED && engine[i].number != engine[i].id + 1) ok = false;
+    if (engine[i].state == PAIRING_FAILED && sim[engine[i].id].keyed && sim[engine[i].id].confirmsAt <= now) ok = false;
+  }
+  if (attempts != engine.frames()) ok = false;
+  if (!ok) printf("pairing engine: inconsistent state after %d lights\n", lights);
+  return ok;
+}
+
+bool bench_pairing()
+{
+  printf("\n== pairing schedule (simulated)\n");
+  bool ok = true;
+  srand(11);
+  for (int lights : { 1, 7, 30, 64 }) {
+    int serialPaired;
+    uint32_t serial = sim_serial(lights, serialPaired);
+    uint32_t pipelined;
+    ok &= sim_pipelined(lights, pipelined);
+    printf("%2d lights: one scan each %6u ms, %2d paired | pipelined %6u ms, %2u paired, %3u frames\n",
+           lights, serial, serialPaired, pipelined, (unsigned)engine.count(PAIRING_CONFIRMED),
+           engine.frames());
+  }
+  return ok;
+}
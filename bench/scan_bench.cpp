@@ -0,0 +1,114 @@
+// Throughput of the scan callback's first checks on a busy air: a mix of
+// phone, beacon and BRmesh adverts, most of them from devices that aren't
+// lights.
+
+#include "bench.h"
+#include "fastcon.h"
+#include "mac_table.h"
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+struct Advert {
+  uint8_t address[6];
+  uint8_t payload[31];
+  uint8_t length;
+};
+
+static Advert make_advert(int kind)
+{
+  Advert advert = {};
+  for (uint8_t& b : advert.address) b = rand();
+  uint8_t* p = advert.payload;
+  p[0] = 0x02; p[1] = 0x01; p[2] = 0x06; // flags
+  if (kind == 0) {
+    // iBeacon
+    const uint8_t beacon[] = { 0x1a, 0xff, 0x4c, 0x00, 0x02, 0x15 };
+    memcpy(p + 3, beacon, sizeof(beacon));
+    for (int i = 9; i < 30; i++) p[i] = rand();
+    advert.length = 30;
+  } else if (kind == 1) {
+    // phone: name and service list, no manufacturer data
+    const uint8_t phone[] = { 0x08, 0x09, 'P', 'h', 'o', 'n', 'e', ' ', 'X', 0x03, 0x03, 0x0f, 0x18 };
+    memcpy(p + 3, phone, sizeof(phone));
+    advert.length = 3 + sizeof(phone);
+  } else {
+    // BRmesh light: 18 bytes of manufacturer data
+    p[3] = FASTCON_ADVERT_DATA_LENGTH + 1;
+    p[4] = 0xff;
+    p[5] = 0xf0;
+    p[6] = 0xff;
+    for (int i = 7; i < 4 + 1 + FASTCON_ADVERT_DATA_LENGTH; i++) p[i] = rand();
+    advert.length = 4 + 1 + FASTCON_ADVERT_DATA_LENGTH;
+  }
+  return advert;
+}
+
+static std::string address_string(const uint8_t* address)
+{
+  char buffer[18];
+  snprintf(buffer, sizeof(buffer), "%02x:%02x:%02x:%02x:%02x:%02x",
+           address[0], address[1], address[2], address[3], address[4], address[5]);
+  return buffer;
+}
+
+bool bench_scan()
+{
+  printf("\n== scan callback filter\n");
+  bool ok = true;
+  srand(3);
+  std::vector<Advert> adverts;
+  for (int i = 0; i < 1000; i++) adverts.push_back(make_advert(i % 10 == 0 ? 2 : i % 2));
+
+  // 32 known lights, among them some of the BRmesh adverts above
+  MacTable<512> known;
+  std::vector<std::string> knownStrings;
+  for (int i = 0; i < 32; i++) {
+    const uint8_t* address = adverts[i * 10].address;
+    known.insert(MacTable<512>::key(address), i);
+    knownStrings.push_back(address_string(address));
+  }
+  for (int i = 0; i < 1000; i++) {
+    uint8_t address[6];
+    for (uint8_t& b : address) b = rand();
+    if (known.contains(MacTable<512>::key(address))) {
+      printf("MacTable false positive\n");
+      ok = false;
+    }
+  }
+
+  size_t next = 0;
+  size_t dropped = 0;
+  size_t handled = 0;
+  // what the callbacks did before: strings for the address and manufacturer
+  // data of every advert, then a string compare per known light
+  bench_run("advert strings + linear dedup (32)", 200000, [&] {
+    const Advert& advert = adverts[next++ % adverts.size()];
+    std::string address = address_string(advert.address);
+    const uint8_t* data;
+    uint8_t length = fastcon_manufacturer_data(advert.payload, advert.length, data);
+    std::string mData(data ? (const char*)data : "", length);
+    bool isKnown = false;
+    for (const std::string& knownAddress : knownStrings) {
+      if (knownAddress == address) {
+        isKnown = true;
+        break;
+      }
+    }
+    bench_keep(isKnown);
+  });
+  BenchResult result = bench_run("raw filter + MacTable dedup (32)", 200000, [&] {
+    const Advert& advert = adverts[next++ % adverts.size()];
+    handled++;
+    const uint8_t* data;
+    if (fastcon_manufacturer_data(advert.payload, advert.length, data) != FASTCON_ADVERT_DATA_LENGTH) {
+      dropped++;
+      return;
+    }
+    bool isKnown = known.contains(MacTable<512>::key(advert.address));
+    bench_keep(isKnown);
+  });
+  printf("%-36s %10.0f adverts/s, %.1f%% dropped by the raw filter\n", "", 1e9 / result.nsPerOp,
+         100.0 * dropped / handled);
+  return ok;
+}
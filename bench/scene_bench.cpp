@@ -0,0 +1,101 @@
+// Scenes: the frames the planner compiles a scene into, against one frame per
+// light on the per-entity path, and what planning costs.
+
+#include "bench.h"
+#include "light_types.h"
+#include "scene_planner.h"
+
+#define SIM_ADVERTISE_MS 250
+
+static ScenePlanner<64> planner;
+
+static void body_off(uint8_t* data)
+{
+  memset(data, 0, 8);
+  light_encode_state(FASTCON_LIGHT_LAYOUT, false, data);
+}
+
+static void body_rgb(uint8_t* data, uint8_t red, uint8_t green, uint8_t blue)
+{
+  memset(data, 0, 8);
+  light_encode_rgb(FASTCON_LIGHT_LAYOUT, 127, red, green, blue, data);
+}
+
+static bool expect_plan(const char* name, const uint16_t* members, const char* expected)
+{
+  planner.plan(members);
+  uint8_t frames[64 * 8];
+  for (size_t i = 0; i < planner.frames(); i++) memcpy(frames + i * 8, planner.frame(i), 8);
+  return bench_expect_hex(name, frames, planner.frames() * 8, expected);
+}
+
+bool bench_scene()
+{
+  printf("\n== scenes\n");
+  bool ok = true;
+  uint16_t members[SCENE_GROUPS] = {};
+  uint8_t off[8], red[8], blue[8];
+  body_off(off);
+  body_rgb(red, 255, 0, 0);
+  body_rgb(blue, 0, 0, 255);
+
+  // a whole group sharing a target is one frame
+  members[1] = 3;
+  planner.clear();
+  for (uint8_t light = 1; light <= 3; light++) planner.add(light, 1, off);
+  ok &= expect_plan("whole group", members, "2401000000000000");
+
+  // the odd one out follows the group frame; a repeat keeps the last target
+  planner.clear();
+  planner.add(1, 1, red);
+  planner.add(2, 1, off);
+  planner.add(3, 1, red);
+  planner.add(2, 1, blue);
+  ok &= expect_plan("group and exception", members, "74017f00ff000000" "72027fff00000000");
+
+  // a bridge sending only some of the frames keeps their order
+  planner.clear();
+  planner.add(1, 1, red);
+  planner.add(2, 1, off);
+  planner.add(3, 1, red);
+  planner.plan(members);
+  planner.keep([](const uint8_t* frame) { return frame[1] != 1 || (frame[0] & 0x0f) != FASTCON_GROUP_CONTROL; });
+  uint8_t kept[8];
+  memcpy(kept, planner.frame(0), 8);
+  ok &= bench_expect_hex("kept frames", kept, planner.frames() * 8, "2202000000000000");
+
+  // a group with a member outside the scene can't take a group frame
+  members[2] = 3;
+  planner.clear();
+  planner.add(4, 2, off);
+  planner.add(5, 2, off);
+  ok &= expect_plan("part of a group", members, "2204000000000000" "2205000000000000");
+
+  // simulated evening scene: 30 lights in three rooms of 10, one room off,
+  // one warm but for two lamps, one split across two colours
+  members[1] = members[2] = members[3] = 10;
+  planner.clear();
+  for (uint8_t light = 0; light < 30; light++) {
+    uint8_t group = 1 + light / 10;
+    if (group == 1) planner.add(light, group, off);
+    else if (group == 2) planner.add(light, group, light % 10 < 8 ? red : blue);
+    else planner.add(light, group, light % 2 ? red : blue);
+  }
+  size_t frames = planner.plan(members);
+  printf("30 light scene: %u frames (%u ms on air) against 30 per-entity frames (%u ms)\n",
+         (unsigned)frames, (unsigned)(frames * SIM_ADVERTISE_MS), 30 * SIM_ADVERTISE_MS);
+  // room 1: 1 frame; room 2: 1 + 2; room 3: 1 + 5
+  if (frames != 10) {
+    printf("SCENE MISMATCH expected 10 frames, planned %u\n", (unsigned)frames);
+    ok = false;
+  }
+
+  BenchResult plan = bench_run("plan 30 light scene", 100000, [&] {
+    bench_keep(planner.plan(members));
+  });
+  if (plan.allocsPerOp != 0) {
+    printf("planning allocates\n");
+    ok = false;
+  }
+  return ok;
+}
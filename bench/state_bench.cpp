@@ -0,0 +1,64 @@
+// Publishing light states heard in status adverts: how many HA updates a
+// chatty mesh causes when every advert is published, when only changes are,
+// and with the per-light debounce. Simulated clock.
+
+#include "bench.h"
+#include "state_tracker.h"
+#include <stdlib.h>
+
+#define SIM_LIGHTS 30
+#define SIM_ADVERTS_PER_SECOND 10
+#define SIM_SECONDS 60
+#define SIM_DEBOUNCE_MS 1000
+
+static StateTracker<256> tracker;
+
+bool bench_state()
+{
+  printf("\n== status advert tracking (simulated)\n");
+  bool ok = true;
+  srand(13);
+  LightState actual[SIM_LIGHTS] = {};
+  LightState published[SIM_LIGHTS] = {};
+  uint32_t adverts = 0;
+  uint32_t changes = 0;
+  uint32_t publishes = 0;
+  tracker.clear();
+  const uint32_t step = 1000 / SIM_ADVERTS_PER_SECOND;
+  for (uint32_t now = 0; now < SIM_SECONDS * 1000 + 2 * SIM_DEBOUNCE_MS; now += step) {
+    if (now < SIM_SECONDS * 1000) {
+      // light 0 is dimmed in a slow ramp for the first 5 s, and every so
+      // often some light is switched from the app
+      if (now < 5000) actual[0].level = now / 40;
+      if (rand() % 20 == 0) actual[rand() % SIM_LIGHTS].level = rand() % 128;
+      for (int i = 0; i < SIM_LIGHTS; i++) {
+        adverts++;
+        if (tracker.update(i, actual[i])) changes++;
+      }
+    }
+    LightState state;
+    int i;
+    while ((i = tracker.takeChanged(now, SIM_DEBOUNCE_MS, state)) >= 0) {
+      published[i] = state;
+      publishes++;
+    }
+  }
+  for (int i = 0; i < SIM_LIGHTS; i++) {
+    if (published[i] != actual[i]) {
+      printf("light %d: last published state isn't the final one\n", i);
+      ok = false;
+    }
+  }
+  printf("%u adverts: %u publishes every advert, %u on change only, %u with %d ms debounce\n",
+         adverts, adverts, changes, publishes, SIM_DEBOUNCE_MS);
+
+  LightState state = {};
+  uint32_t n = 0;
+  bench_run("status advert -> tracker", 1000000, [&] {
+    state.level = (n++ >> 6) & 127;
+    tracker.update(n % SIM_LIGHTS, state);
+    LightState changed;
+    bench_keep(tracker.takeChanged(n, SIM_DEBOUNCE_MS, changed));
+  });
+  return ok;
+}
@@ -0,0 +1,144 @@
+// Transitions: the frames a fade sends at the bridge's frame rate, retargeting
+// and cancelling mid-fade, and what one tick over many fading lights costs.
+// Simulated clock.
+
+#include "bench.h"
+#include "transition_engine.h"
+
+#define SIM_FRAME_MS 500
+
+static TransitionEngine<32, int> engine(SIM_FRAME_MS);
+
+struct Frame {
+  int target;
+  uint8_t kind;
+  uint16_t values[TRANSITION_CHANNELS];
+  bool last;
+};
+
+static bool expect(const char* name, uint32_t actual, uint32_t expected)
+{
+  if (actual == expected) return true;
+  printf("TRANSITION MISMATCH %s: expected %u, actual %u\n", name, (unsigned)expected, (unsigned)actual);
+  return false;
+}
+
+// an emit callback that adds each frame to frames, up to max
+static auto collect(Frame* frames, size_t max, size_t& n)
+{
+  return [frames, max, &n](const int& target, uint8_t kind, const uint16_t* values, bool last) {
+    if (n == max) return;
+    frames[n].target = target;
+    frames[n].kind = kind;
+    for (int c = 0; c < TRANSITION_CHANNELS; c++) frames[n].values[c] = values[c];
+    frames[n].last = last;
+    n++;
+  };
+}
+
+// for starts that replace nothing
+static void none(const int&, uint8_t, const uint16_t*, bool) {}
+
+// runs the clock from start to end a millisecond at a time, collecting frames
+static size_t run(uint32_t start, uint32_t end, Frame* frames, size_t max)
+{
+  size_t n = 0;
+  for (uint32_t now = start; now <= end; now++) engine.tick(now, collect(frames, max, n));
+  return n;
+}
+
+bool bench_transition()
+{
+  printf("\n== transitions (simulated)\n");
+  bool ok = true;
+
+  ok &= expect("interpolate start", TransitionEngine<1, int>::interpolate(10, 127, 0), 10);
+  ok &= expect("interpolate end", TransitionEngine<1, int>::interpolate(10, 127, 1 << 15), 127);
+  ok &= expect("interpolate half up", TransitionEngine<1, int>::interpolate(0, 127, 1 << 14), 64);
+  ok &= expect("interpolate half down", TransitionEngine<1, int>::interpolate(127, 0, 1 << 14), 63);
+  ok &= expect("interpolate mireds", TransitionEngine<1, int>::interpolate(500, 153, 1 << 14), 326);
+  ok &= expect("interpolate widest", TransitionEngine<1, int>::interpolate(0, 65535, 1 << 15), 65535);
+
+  // a 2 s brightness fade at 2 frames a second: 4 frames, the last exact and
+  // each step moving the same way
+  Frame frames[64];
+  engine.clear();
+  const uint16_t dark[] = { 0 };
+  const uint16_t bright[] = { 127 };
+  engine.start(1, 0, dark, bright, 1, 1000, 2000, none);
+  size_t n = run(1000, 4000, frames, 64);
+  ok &= expect("fade frames", n, 4);
+  ok &= expect("fade end", frames[n - 1].values[0], 127);
+  ok &= expect("fade last flag", frames[n - 1].last, 1);
+  for (size_t i = 1; i < n; i++) {
+    if (frames[i].values[0] <= frames[i - 1].values[0]) {
+      printf("TRANSITION MISMATCH fade isn't monotonic at frame %u\n", (unsigned)i);
+      ok = false;
+    }
+  }
+  ok &= expect("fades left", engine.active(), 0);
+
+  // retargeting halfway down starts from where the fade got to, not from the
+  // stale from value
+  engine.clear();
+  engine.start(2, 0, bright, dark, 1, 10000, 2000, none);
+  n = run(10000, 11000, frames, 64);
+  uint16_t reached = frames[n - 1].values[0];
+  const uint16_t middle[] = { 100 };
+  engine.start(2, 0, bright, middle, 1, 11000, 1000, none);
+  size_t m = run(11001, 11500, frames, 64);
+  ok &= expect("retarget frames", m, 1);
+  ok &= expect("retarget midpoint", frames[0].values[0], TransitionEngine<1, int>::interpolate(reached, 100, 1 << 14));
+  engine.cancel(2);
+  ok &= expect("cancelled", engine.active(), 0);
+
+  // lights sharing a tick: three fades of different lengths, every frame on a
+  // tick boundary
+  engine.clear();
+  for (int light = 0; light < 3; light++) engine.start(10 + light, 0, dark, bright, 1, 20000, 1000 * (light + 1), none);
+  n = run(20000, 24000, frames, 64);
+  ok &= expect("shared tick frames", n, 2 + 4 + 6);
+
+  // an RGB fade: four channels, level held
+  engine.clear();
+  const uint16_t red[] = { 100, 255, 0, 0 };
+  const uint16_t blue[] = { 100, 0, 0, 255 };
+  engine.start(4, 1, red, blue, 4, 30000, 1000, none);
+  n = run(30000, 31000, frames, 64);
+  ok &= expect("rgb frames", n, 2);
+  ok &= expect("rgb level", frames[0].values[0], 100);
+  ok &= expect("rgb red half", frames[0].values[1], 127);
+  ok &= expect("rgb blue end", frames[1].values[3], 255);
+
+  // a colour change halfway through a brightness fade: the brightness fade
+  // is finished with its target before the colour fade takes its slot
+  engine.clear();
+  engine.start(5, 0, dark, bright, 1, 40000, 2000, none);
+  run(40000, 41000, frames, 64);
+  n = 0;
+  engine.start(5, 1, red, blue, 4, 41000, 1000, collect(frames, 64, n));
+  ok &= expect("kind change frames", n, 1);
+  ok &= expect("kind change kind", frames[0].kind, 0);
+  ok &= expect("kind change value", frames[0].values[0], 127);
+  ok &= expect("kind change last flag", frames[0].last, 1);
+  n = run(41001, 42000, frames, 64);
+  ok &= expect("kind change then colour", n > 0 && frames[n - 1].kind == 1 && frames[n - 1].values[3] == 255, 1);
+
+  // a tick over 32 fading lights
+  engine.clear();
+  uint32_t now = 0;
+  BenchResult tick = bench_run("tick, 32 fading lights", 100000, [&] {
+    if (engine.active() == 0) {
+      for (int light = 0; light < 32; light++) engine.start(light, 1, red, blue, 4, now, TRANSITION_MAX_MS, none);
+    }
+    now += SIM_FRAME_MS;
+    uint32_t sent = 0;
+    engine.tick(now, [&](const int&, uint8_t, const uint16_t*, bool) { sent++; });
+    bench_keep(sent);
+  });
+  if (tick.allocsPerOp != 0) {
+    printf("a tick allocates\n");
+    ok = false;
+  }
+  return ok;
+}
@@ -0,0 +1,190 @@
+// Transmit scheduling: class order, per-light order across classes, the
+// latency bound and the airtime budget, then a simulated slider drag followed
+// by an "all off" for the room's group, against the plain queue it replaces,
+// checking the lights end up off. Simulated clock and radio.
+
+#include "bench.h"
+#include "tx_scheduler.h"
+
+#define SIM_FRAME_MS 250
+
+#define SIM_ROOM_GROUP 255 // the key of the group holding lights 0-7
+#define SIM_ROOM_LIGHTS 8
+
+struct SimFrame {
+  int id;
+  uint32_t queuedAt;
+  int light = 0; // for the slider's frames
+};
+
+static bool expect(const char* name, uint32_t actual, uint32_t expected)
+{
+  if (actual == expected) return true;
+  printf("TX MISMATCH %s: expected %u, actual %u\n", name, (unsigned)expected, (unsigned)actual);
+  return false;
+}
+
+// pops everything queued at now, returning the ids in order
+template <typename Scheduler>
+static size_t drain(Scheduler& scheduler, uint32_t now, int* ids, size_t max)
+{
+  size_t n = 0;
+  SimFrame frame;
+  TxClass cls;
+  uint32_t waited, wait;
+  while (n < max && scheduler.pop(now, frame, cls, waited, wait)) ids[n++] = frame.id;
+  return n;
+}
+
+bool bench_tx()
+{
+  printf("\n== transmit scheduling (simulated)\n");
+  bool ok = true;
+  int ids[32];
+
+  // classes in order; a light's brightness queued before its "off" goes first
+  TxScheduler<SimFrame, 8> order(1000, 60000);
+  order.push(TX_BACKGROUND, 9, { 1, 0 }, 0);
+  order.push(TX_LEVEL, 1, { 2, 0 }, 0);
+  order.push(TX_LEVEL, 2, { 3, 0 }, 0);
+  order.push(TX_SCENE, 3, { 4, 0 }, 0);
+  order.push(TX_ON_OFF, 2, { 5, 0 }, 0);
+  size_t n = drain(order, 1, ids, 32);
+  const int expected[] = { 3, 5, 4, 2, 1 };
+  ok &= expect("order count", n, 5);
+  for (size_t i = 0; i < n && i < 5; i++) ok &= expect("order", ids[i], expected[i]);
+
+  // a pairing frame stuck behind a stream of level frames goes once overdue
+  TxScheduler<SimFrame, 8> aging(1000, 1000);
+  aging.push(TX_BACKGROUND, 1, { 1, 0 }, 0);
+  uint32_t sentAt = 0;
+  for (uint32_t now = 0; now < 3000 && !sentAt; now += SIM_FRAME_MS) {
+    aging.push(TX_LEVEL, 2, { 2, now }, now);
+    SimFrame frame;
+    TxClass cls;
+    uint32_t waited, wait;
+    if (aging.pop(now, frame, cls, waited, wait) && frame.id == 1) sentAt = now;
+  }
+  ok &= expect("overdue sent at", sentAt, 1000);
+  ok &= expect("overdue count", aging.stats().overdue, 1);
+
+  // an overdue level frame doesn't take an on/off's turn, so with the budget
+  // spent the on/off still goes and the level frame waits
+  TxScheduler<SimFrame, 8> spent(100, 1000);
+  spent.push(TX_LEVEL, 1, { 1, 0 }, 0);
+  spent.charge(TX_LEVEL, 1500, 1000);
+  spent.push(TX_ON_OFF, 2, { 2, 1500 }, 1500);
+  n = drain(spent, 1500, ids, 32);
+  ok &= expect("spent budget sends", n, 1);
+  ok &= expect("spent budget on/off first", n ? ids[0] : 0, 2);
+
+  // a 500 ms/s budget sends two 250 ms frames a second after the first
+  // second's burst, and never holds back an on/off
+  TxScheduler<SimFrame, 64> budget(500, 60000);
+  for (int i = 0; i < 40; i++) budget.push(TX_LEVEL, i, { i, 0 }, 0);
+  uint32_t busyUntil = 0;
+  uint32_t levelSent = 0;
+  uint32_t offLatency = 0;
+  for (uint32_t now = 1; now <= 10000; now++) {
+    if (now == 5000) budget.push(TX_ON_OFF, 99, { 99, now }, now);
+    if (now < busyUntil) continue;
+    SimFrame frame;
+    TxClass cls;
+    uint32_t waited, wait;
+    if (!budget.pop(now, frame, cls, waited, wait)) continue;
+    budget.charge(cls, now, SIM_FRAME_MS);
+    busyUntil = now + SIM_FRAME_MS;
+    if (frame.id == 99) offLatency = waited;
+    else levelSent++;
+  }
+  printf("500 ms/s budget: %u level frames in 10 s, off waited %u ms\n", (unsigned)levelSent, (unsigned)offLatency);
+  ok &= expect("budget frames", levelSent, 2 + 2 * 10 - 1);
+  if (offLatency > SIM_FRAME_MS) {
+    printf("TX MISMATCH the budget held back an on/off for %u ms\n", (unsigned)offLatency);
+    ok = false;
+  }
+
+  // a colour slider dragged for 2 s (a command every 100 ms, across the 8
+  // lights of a room), then "all off" for the room's group while the drag's
+  // frames are still queued: the scheduler, where the off supersedes them as
+  // the firmware has it, against first come, first served. Either way every
+  // light has to end up off.
+  TxScheduler<SimFrame, 64> scheduled(1000, 2000);
+  TxScheduler<SimFrame, 64> fifo(1000, 60000);
+  uint32_t offWaited[2] = {};
+  for (int run = 0; run < 2; run++) {
+    TxScheduler<SimFrame, 64>& scheduler = run == 0 ? scheduled : fifo;
+    bool lit[SIM_ROOM_LIGHTS] = {};
+    busyUntil = 0;
+    for (uint32_t now = 0; now < 60000; now++) {
+      if (now < 2000 && now % 100 == 0) {
+        int light = (now / 100) % SIM_ROOM_LIGHTS;
+        scheduler.push(TX_LEVEL, light, { 1, now, light }, now);
+      }
+      if (now == 2000 && run == 0) {
+        scheduler.push(
+            TX_ON_OFF, SIM_ROOM_GROUP, { 99, now }, now,
+            [](uint16_t key, const SimFrame&) { return key < SIM_ROOM_LIGHTS ? TX_SUPERSEDED : TX_APART; },
+            [](const SimFrame&) {});
+      }
+      // the plain queue had one class
+      if (now == 2000 && run == 1) scheduler.push(TX_LEVEL, SIM_ROOM_GROUP, { 99, now }, now);
+      if (now < busyUntil) continue;
+      SimFrame frame;
+      TxClass cls;
+      uint32_t waited, wait;
+      if (!scheduler.pop(now, frame, cls, waited, wait)) continue;
+      busyUntil = now + SIM_FRAME_MS;
+      if (frame.id == 99) {
+        offWaited[run] = waited;
+        for (bool& on : lit) on = false;
+      } else {
+        lit[frame.light] = true;
+      }
+    }
+    for (int light = 0; light < SIM_ROOM_LIGHTS; light++) {
+      if (lit[light]) {
+        printf("TX MISMATCH light %d is on after all off (%s)\n", light, run == 0 ? "scheduler" : "first come first served");
+        ok = false;
+      }
+    }
+  }
+  printf("all off after a slider drag waited %u ms, %u ms first come first served\n",
+         (unsigned)offWaited[0], (unsigned)offWaited[1]);
+  ok &= expect("superseded by all off", scheduled.stats().superseded, 2000 / 100 - 2000 / SIM_FRAME_MS);
+  if (offWaited[0] > SIM_FRAME_MS) {
+    printf("TX MISMATCH all off waited behind the slider\n");
+    ok = false;
+  }
+
+  // promoting instead: a group "on" queued behind its lights' brightness
+  // changes takes them along, ahead of it
+  TxScheduler<SimFrame, 8> group(1000, 60000);
+  group.push(TX_LEVEL, 1, { 1, 0 }, 0);
+  group.push(TX_LEVEL, 7, { 2, 0 }, 0);
+  group.push(TX_LEVEL, 2, { 3, 0 }, 0);
+  group.push(TX_ON_OFF, SIM_ROOM_GROUP, { 4, 0 }, 0,
+             [](uint16_t key, const SimFrame&) { return key == 1 || key == 2 ? TX_BEFORE : TX_APART; },
+             [](const SimFrame&) {});
+  n = drain(group, 1, ids, 32);
+  const int promoted[] = { 1, 3, 4, 2 };
+  ok &= expect("group order count", n, 4);
+  for (size_t i = 0; i < n && i < 4; i++) ok &= expect("group order", ids[i], promoted[i]);
+
+  TxScheduler<SimFrame, 32> timed(800, 2000);
+  uint32_t now = 0;
+  BenchResult cycle = bench_run("push and pop", 1000000, [&] {
+    now++;
+    timed.push((TxClass)(now % TX_CLASSES), now % 16, { (int)now, now }, now);
+    SimFrame frame;
+    TxClass cls;
+    uint32_t waited, wait;
+    if (timed.pop(now, frame, cls, waited, wait)) timed.charge(cls, now, 1);
+    bench_keep(frame);
+  });
+  if (cycle.allocsPerOp != 0) {
+    printf("scheduling allocates\n");
+    ok = false;
+  }
+  return ok;
+}
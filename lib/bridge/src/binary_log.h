@@ -0,0 +1,183 @@
+#pragma once
+
+// Deferred logging.
+//
+// A log statement stores its format string pointer, up to LOG_MAX_ARGS
+// integer or string arguments and an optional block of bytes (dumped as hex)
+// in a fixed-size record, and pushes it into a lock-free ring. Formatting and
+// the slow serial write happen later, in whichever task drains the ring. The
+// ring takes records from any number of tasks and has one consumer.
+//
+// Levels are selected at compile time with LOG_LEVEL: statements above it
+// expand to nothing, arguments included. Formats and %s arguments must
+// outlive the record (string literals, entity ids), and integer arguments
+// are formatted as 32-bit values (%d, %u, %x).
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <type_traits>
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#ifndef LOG_RING_LENGTH
+#define LOG_RING_LENGTH 64
+#endif
+
+#define LOG_MAX_ARGS 8
+#define LOG_MAX_DATA 32
+
+struct LogRecord {
+  uint32_t timestamp; // log_clock() when logged
+  const char* format;
+  uintptr_t args[LOG_MAX_ARGS];
+  uint8_t level;
+  uint8_t length;     // bytes in data
+  uint8_t data[LOG_MAX_DATA];
+};
+
+template <size_t Capacity>
+class LogRing {
+  static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+public:
+  LogRing()
+  {
+    for (size_t i = 0; i < Capacity; i++) cells_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  // any task; returns false (and counts the record as dropped) if the ring
+  // is full, so a slow drain never blocks the caller
+  bool push(const LogRecord& record)
+  {
+    size_t head = head_.load(std::memory_order_relaxed);
+    Cell* cell;
+    for (;;) {
+      cell = &cells_[head & (Capacity - 1)];
+      size_t sequence = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)sequence - (intptr_t)head;
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(head, head + 1, std::memory_order_relaxed)) break;
+      } else if (diff < 0) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      } else {
+        head = head_.load(std::memory_order_relaxed);
+      }
+    }
+    cell->record = record;
+    cell->sequence.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // the draining task only
+  bool pop(LogRecord& record)
+  {
+    Cell& cell = cells_[tail_ & (Capacity - 1)];
+    if (cell.sequence.load(std::memory_order_acquire) != tail_ + 1) return false;
+    record = cell.record;
+    cell.sequence.store(tail_ + Capacity, std::memory_order_release);
+    tail_++;
+    return true;
+  }
+
+  uint32_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    LogRecord record;
+  };
+
+  Cell cells_[Capacity];
+  std::atomic<size_t> head_{0};
+  size_t tail_ = 0;
+  std::atomic<uint32_t> dropped_{0};
+};
+
+// provided by the program: the ring every statement logs to, and its clock
+extern LogRing<LOG_RING_LENGTH> logRing;
+uint32_t log_clock();
+
+template <typename T>
+inline uintptr_t log_arg(T value)
+{
+  static_assert(std::is_integral<T>::value || std::is_enum<T>::value || std::is_pointer<T>::value,
+                "log arguments are integers or strings that outlive the record");
+  return (uintptr_t)value;
+}
+
+template <typename... Args>
+inline void log_emit(uint8_t level, const void* data, size_t length, const char* format, Args... args)
+{
+  static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many log arguments");
+  LogRecord record;
+  record.timestamp = log_clock();
+  record.format = format;
+  const uintptr_t values[] = { log_arg(args)..., 0 };
+  for (size_t i = 0; i < LOG_MAX_ARGS; i++) record.args[i] = i < sizeof...(Args) ? values[i] : 0;
+  record.level = level;
+  record.length = length < LOG_MAX_DATA ? length : LOG_MAX_DATA;
+  if (record.length) memcpy(record.data, data, record.length);
+  logRing.push(record);
+}
+
+// formats a record as one line, without the newline; returns its length
+inline size_t log_format(const LogRecord& record, char* line, size_t size)
+{
+  static const char levels[] = "-EWID";
+  int n = snprintf(line, size, "%6u.%03u %c ", (unsigned)(record.timestamp / 1000000),
+                   (unsigned)(record.timestamp / 1000 % 1000), levels[record.level]);
+  const uintptr_t* a = record.args;
+  if (n >= 0 && (size_t)n < size) {
+    // unused arguments are never read by the format
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+#pragma GCC diagnostic ignored "-Wformat-security"
+    n += snprintf(line + n, size - n, record.format, a[0], a[1], a[2], a[3], a[4], a[5], a[6], a[7]);
+#pragma GCC diagnostic pop
+  }
+  for (uint8_t i = 0; i < record.length && n >= 0 && (size_t)n + 2 < size; i++) {
+    n += snprintf(line + n, size - n, "%02X", record.data[i]);
+  }
+  if (n < 0) return 0;
+  return (size_t)n < size ? n : size - 1;
+}
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) log_emit(LOG_LEVEL_ERROR, NULL, 0, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) log_emit(LOG_LEVEL_WARN, NULL, 0, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) log_emit(LOG_LEVEL_INFO, NULL, 0, __VA_ARGS__)
+#define LOG_INFO_HEX(data, length, ...) log_emit(LOG_LEVEL_INFO, data, length, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while (0)
+#define LOG_INFO_HEX(data, length, ...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) log_emit(LOG_LEVEL_DEBUG, NULL, 0, __VA_ARGS__)
+#define LOG_DEBUG_HEX(data, length, ...) log_emit(LOG_LEVEL_DEBUG, data, length, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#define LOG_DEBUG_HEX(data, length, ...) do {} while (0)
+#endif
@@ -0,0 +1,258 @@
+#pragma once
+
+// Decides which of several bridges on one mesh transmits for each light.
+//
+// Every bridge hears the lights' status adverts and keeps a smoothed RSSI
+// per light (an exponential moving average, dropped once the light hasn't
+// been heard for a while). A heartbeat publishes that table to the other
+// bridges; a bridge not heard from within the timeout is taken to be gone.
+//
+// A light's owner is the live bridge that hears it loudest, ties going to
+// the lowest bridge id; a light nobody hears goes to the leader, the live
+// bridge with the lowest id. Each bridge decides from the table it last
+// published rather than its latest readings, so all of them decide from the
+// same data and agree without a vote. A reading is only published again once
+// it has moved by the margin, so noise doesn't hand lights back and forth;
+// a reading that stopped moving stays as published, and an equal one still
+// goes to the lowest id, so old readings never leave a tie open.
+//
+// There is no agreement step, so the tables only match once a heartbeat has
+// reached every bridge. Until then, after a light changes owner, the bridge
+// that takes it starts sending when it publishes, or when the loser's
+// heartbeat arrives, and the one that gives it up stops when it publishes,
+// or when the winner's heartbeat arrives: for the broker's transit time,
+// both or neither would send. So a bridge keeps sending for a light it lost
+// for the handover time (transmits()), which should cover the transit:
+// around a handover a light may get a command twice, for up to the transit
+// and the handover time, but never not at all. A
+// bridge that goes silent is different: its lights go unsent until the
+// others time it out.
+//
+// Bridge ids are the bridges' MACs as hex. Light numbers index the tables
+// directly. Not thread safe; the firmware uses it from the loop task only.
+// Times are in ms.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define BRIDGE_ID_LENGTH 13 // 12 hex digits and a NUL
+#define BRIDGE_RSSI_NONE -128
+
+template <size_t MaxBridges, size_t MaxLights>
+class BridgeCoordinator {
+public:
+  BridgeCoordinator(uint32_t timeoutMs, uint32_t rssiTtlMs, uint8_t marginDb, uint32_t handoverMs = 0)
+    : timeoutMs_(timeoutMs), rssiTtlMs_(rssiTtlMs), marginDb_(marginDb ? marginDb : 1), handoverMs_(handoverMs)
+  {
+    clear();
+  }
+
+  // forgets every peer and reading; self is this bridge's id
+  void begin(const char* self)
+  {
+    clear();
+    copyId(bridges_[0].id, self);
+    bridges_[0].live = true;
+    for (size_t light = 0; light < MaxLights; light++) owned_[light] = true; // alone, it owns every light
+  }
+
+  // a status advert from light, heard by this bridge
+  void hear(uint8_t light, int8_t rssi, uint32_t now)
+  {
+    if (light >= MaxLights) return;
+    Reading& reading = readings_[light];
+    int16_t sample = (int16_t)(rssi * 16);
+    if (!fresh(reading, now)) reading.smoothed = sample;
+    else reading.smoothed += (sample - reading.smoothed) / 4;
+    reading.heardAt = now;
+    reading.heard = true;
+  }
+
+  // this bridge's smoothed RSSI for light, or BRIDGE_RSSI_NONE
+  int8_t rssi(uint8_t light, uint32_t now) const
+  {
+    if (light >= MaxLights || !fresh(readings_[light], now)) return BRIDGE_RSSI_NONE;
+    int16_t smoothed = readings_[light].smoothed;
+    return (int8_t)(smoothed >= 0 ? (smoothed + 8) / 16 : -((-smoothed + 8) / 16));
+  }
+
+  // fills this bridge's heartbeat, the lights it hears and their RSSI, and
+  // decides from it from now on; returns the number of lights
+  size_t snapshot(uint32_t now, uint8_t* lights, int8_t* rssi, size_t max)
+  {
+    size_t n = 0;
+    for (size_t light = 0; light < MaxLights; light++) {
+      int8_t value = this->rssi((uint8_t)light, now);
+      int8_t& published = bridges_[0].rssi[light];
+      int moved = value - published;
+      if (value == BRIDGE_RSSI_NONE || published == BRIDGE_RSSI_NONE || moved >= marginDb_ || -moved >= marginDb_) {
+        published = value;
+      }
+      value = published;
+      if (value == BRIDGE_RSSI_NONE || n == max) continue;
+      lights[n] = (uint8_t)light;
+      rssi[n] = value;
+      n++;
+    }
+    bridges_[0].seenAt = now;
+    track(now);
+    return n;
+  }
+
+  // a peer's heartbeat, replacing its last table; false if it's a new peer
+  // and the table is full
+  bool receive(const char* id, const uint8_t* lights, const int8_t* rssi, size_t n, uint32_t now)
+  {
+    if (strncmp(id, bridges_[0].id, BRIDGE_ID_LENGTH - 1) == 0) return true; // our own, echoed back
+    Bridge* bridge = find(id);
+    if (!bridge) bridge = idle();
+    if (!bridge) return false;
+    if (!bridge->live) copyId(bridge->id, id);
+    bridge->live = true;
+    bridge->seenAt = now;
+    for (size_t light = 0; light < MaxLights; light++) bridge->rssi[light] = BRIDGE_RSSI_NONE;
+    for (size_t i = 0; i < n; i++) {
+      if (lights[i] < MaxLights) bridge->rssi[lights[i]] = rssi[i];
+    }
+    track(now);
+    return true;
+  }
+
+  // drops the peers not heard from within the timeout; returns how many
+  size_t expire(uint32_t now)
+  {
+    size_t dropped = 0;
+    for (size_t b = 1; b < MaxBridges; b++) {
+      if (bridges_[b].live && now - bridges_[b].seenAt >= timeoutMs_) {
+        bridges_[b].live = false;
+        dropped++;
+      }
+    }
+    if (dropped) track(now);
+    return dropped;
+  }
+
+  // the id of the bridge that transmits for light
+  const char* owner(uint8_t light) const
+  {
+    const Bridge* best = NULL;
+    for (size_t b = 0; b < MaxBridges; b++) {
+      const Bridge& bridge = bridges_[b];
+      if (!bridge.live || light >= MaxLights || bridge.rssi[light] == BRIDGE_RSSI_NONE) continue;
+      if (!best || bridge.rssi[light] > best->rssi[light]
+          || (bridge.rssi[light] == best->rssi[light] && strcmp(bridge.id, best->id) < 0)) {
+        best = &bridge;
+      }
+    }
+    return best ? best->id : leader();
+  }
+
+  bool owns(uint8_t light) const { return owner(light) == bridges_[0].id; }
+
+  // whether this bridge sends commands for light: it owns it, or lost it
+  // less than the handover time ago
+  bool transmits(uint8_t light, uint32_t now) const
+  {
+    if (owns(light)) return true;
+    return light < MaxLights && lost_[light] && now - lostAt_[light] < handoverMs_;
+  }
+
+  // the live bridge with the lowest id, which pairs lights and shares the
+  // registry
+  const char* leader() const
+  {
+    const char* lowest = bridges_[0].id;
+    for (size_t b = 1; b < MaxBridges; b++) {
+      if (bridges_[b].live && strcmp(bridges_[b].id, lowest) < 0) lowest = bridges_[b].id;
+    }
+    return lowest;
+  }
+
+  bool isLeader() const { return leader() == bridges_[0].id; }
+
+  // live bridges, this one included
+  size_t bridges() const
+  {
+    size_t n = 0;
+    for (size_t b = 0; b < MaxBridges; b++) n += bridges_[b].live;
+    return n;
+  }
+
+  const char* self() const { return bridges_[0].id; }
+
+private:
+  struct Bridge {
+    char id[BRIDGE_ID_LENGTH];
+    bool live;
+    uint32_t seenAt;
+    int8_t rssi[MaxLights]; // as last published; BRIDGE_RSSI_NONE if not heard
+  };
+
+  struct Reading {
+    bool heard;
+    int16_t smoothed; // dBm in 1/16ths
+    uint32_t heardAt;
+  };
+
+  void clear()
+  {
+    for (size_t b = 0; b < MaxBridges; b++) {
+      bridges_[b].id[0] = 0;
+      bridges_[b].live = false;
+      for (size_t light = 0; light < MaxLights; light++) bridges_[b].rssi[light] = BRIDGE_RSSI_NONE;
+    }
+    for (size_t light = 0; light < MaxLights; light++) {
+      readings_[light].heard = false;
+      owned_[light] = false;
+      lost_[light] = false;
+    }
+  }
+
+  // notes when this bridge stops owning a light, for transmits()
+  void track(uint32_t now)
+  {
+    for (size_t light = 0; light < MaxLights; light++) {
+      bool owned = owns((uint8_t)light);
+      if (owned_[light] && !owned) {
+        lost_[light] = true;
+        lostAt_[light] = now;
+      }
+      owned_[light] = owned;
+    }
+  }
+
+  bool fresh(const Reading& reading, uint32_t now) const { return reading.heard && now - reading.heardAt < rssiTtlMs_; }
+
+  static void copyId(char* to, const char* from)
+  {
+    strncpy(to, from, BRIDGE_ID_LENGTH - 1);
+    to[BRIDGE_ID_LENGTH - 1] = 0;
+  }
+
+  Bridge* find(const char* id)
+  {
+    for (size_t b = 1; b < MaxBridges; b++) {
+      if (bridges_[b].live && strncmp(bridges_[b].id, id, BRIDGE_ID_LENGTH - 1) == 0) return &bridges_[b];
+    }
+    return NULL;
+  }
+
+  Bridge* idle()
+  {
+    for (size_t b = 1; b < MaxBridges; b++) {
+      if (!bridges_[b].live) return &bridges_[b];
+    }
+    return NULL;
+  }
+
+  Bridge bridges_[MaxBridges];
+  Reading readings_[MaxLights];
+  bool owned_[MaxLights];      // as of the last track()
+  bool lost_[MaxLights];       // owned once, and lost since
+  uint32_t lostAt_[MaxLights]; // when this bridge last stopped owning it
+  uint32_t timeoutMs_;
+  uint32_t rssiTtlMs_;
+  int marginDb_;
+  uint32_t handoverMs_;
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+// Encoded command frames, kept for the next time the same command goes out.
+//
+// Most commands repeat: toggling a light, a dashboard button, an automation
+// setting the same brightness every evening. A frame only differs from the
+// last one sent for the same command in its sequence number, so a hit patches
+// the cached frame (fastcon_next_frame) instead of encoding it again. The
+// cache is direct-mapped on the command and key bytes, so a light's commands
+// share its entries with the others' and a collision just costs a full
+// encode. Single threaded: only the radio task sends; the counters may be
+// read from any task.
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fastcon.h"
+
+#define FRAME_CACHE_DATA_LENGTH 8
+#define FRAME_CACHE_KEY_LENGTH 4
+
+template <size_t Entries>
+class FrameCache {
+  static_assert((Entries & (Entries - 1)) == 0, "entries must be a power of two");
+
+public:
+  FrameCache() { clear(); }
+
+  void clear()
+  {
+    for (size_t i = 0; i < Entries; i++) entries_[i].valid = false;
+  }
+
+  // the frame for an 8 byte control command, with the next sequence number
+  // as generate_frame() would give it; NULL if it can't be encoded. Valid
+  // until the next call.
+  const FastconFrame* frame(const uint8_t* key, const uint8_t* data)
+  {
+    Entry& entry = entries_[slot(key, data)];
+    if (entry.valid && memcmp(entry.data, data, sizeof(entry.data)) == 0 &&
+        memcmp(entry.key, key, sizeof(entry.key)) == 0) {
+      hits_.fetch_add(1, std::memory_order_relaxed);
+      return &fastcon_next_frame(entry.tmpl);
+    }
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    entry.valid = fastcon_make_template(5, data, FRAME_CACHE_DATA_LENGTH, key, true /* forward */, entry.tmpl);
+    if (!entry.valid) return NULL;
+    memcpy(entry.data, data, sizeof(entry.data));
+    memcpy(entry.key, key, sizeof(entry.key));
+    return &entry.tmpl.frame;
+  }
+
+  uint32_t hits() const { return hits_.load(std::memory_order_relaxed); }
+  uint32_t misses() const { return misses_.load(std::memory_order_relaxed); }
+  static constexpr size_t entries() { return Entries; }
+
+private:
+  struct Entry {
+    FastconFrameTemplate tmpl;
+    uint8_t data[FRAME_CACHE_DATA_LENGTH];
+    uint8_t key[FRAME_CACHE_KEY_LENGTH];
+    bool valid;
+  };
+
+  // FNV-1a over the command and key
+  static size_t slot(const uint8_t* key, const uint8_t* data)
+  {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < FRAME_CACHE_DATA_LENGTH; i++) hash = (hash ^ data[i]) * 16777619u;
+    for (int i = 0; i < FRAME_CACHE_KEY_LENGTH; i++) hash = (hash ^ key[i]) * 16777619u;
+    return (hash ^ hash >> 16) & (Entries - 1);
+  }
+
+  Entry entries_[Entries];
+  std::atomic<uint32_t> hits_{0};
+  std::atomic<uint32_t> misses_{0};
+};
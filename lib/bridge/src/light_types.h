@@ -0,0 +1,100 @@
+#pragma once
+
+// The light models the bridge knows, and how their commands are laid out.
+//
+// Each model is one constexpr table entry: the type code its adverts carry,
+// the HA features it gets, and where each field goes in its 8 byte command.
+// Adding a model is adding an entry; the firmware builds the HA entity and
+// encodes the commands from it, so dispatch is a table index, not a string
+// compare.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// same bits as HALight::Features
+enum LightFeature : uint8_t {
+  LIGHT_ON_OFF = 0,
+  LIGHT_BRIGHTNESS = 1,
+  LIGHT_COLOR_TEMPERATURE = 2,
+  LIGHT_RGB = 4,
+};
+
+// Command opcodes (the high nibble of byte 0; the low nibble and byte 1 are
+// the addressing) and the byte offsets of each field.
+struct LightCommandLayout {
+  uint8_t levelOpcode; // on/off and brightness
+  uint8_t colorOpcode; // RGB and color temperature, carrying the brightness too
+  uint8_t on;          // on/off: the level byte for on (0 is off)
+  uint8_t levelMask;   // brightness: the bits of the level byte it takes
+  uint8_t level;
+  uint8_t red;
+  uint8_t green;
+  uint8_t blue;
+  uint8_t temperature; // two bytes, 7 bits each, low first
+};
+
+struct LightTraits {
+  uint8_t code[2]; // type code, as in the light's advert
+  const char* name;
+  uint8_t features;
+  LightCommandLayout layout;
+};
+
+// the layout of every model seen so far
+constexpr LightCommandLayout FASTCON_LIGHT_LAYOUT = { 0x20, 0x70, 0x80, 0x7f, 2, 4, 5, 3, 6 };
+
+// the first entry doubles as the fallback for an unknown code
+constexpr LightTraits LIGHT_TYPES[] = {
+  { { 0x39, 0xae }, "Smart", LIGHT_ON_OFF, FASTCON_LIGHT_LAYOUT },                                        // 44601 - AE39
+  { { 0xa1, 0xa8 }, "RGBW", LIGHT_BRIGHTNESS | LIGHT_COLOR_TEMPERATURE | LIGHT_RGB, FASTCON_LIGHT_LAYOUT }, // 43169 - A8A1
+  { { 0xa0, 0xa8 }, "RGB", LIGHT_BRIGHTNESS | LIGHT_RGB, FASTCON_LIGHT_LAYOUT },                          // 43168 - A8A0
+};
+constexpr size_t LIGHT_TYPE_COUNT = sizeof(LIGHT_TYPES) / sizeof(LIGHT_TYPES[0]);
+constexpr uint8_t LIGHT_TYPE_UNKNOWN = 0xff;
+
+// index into LIGHT_TYPES of a type code, or LIGHT_TYPE_UNKNOWN
+constexpr uint8_t light_type_index(const uint8_t* code)
+{
+  for (size_t i = 0; i < LIGHT_TYPE_COUNT; i++) {
+    if (LIGHT_TYPES[i].code[0] == code[0] && LIGHT_TYPES[i].code[1] == code[1]) return i;
+  }
+  return LIGHT_TYPE_UNKNOWN;
+}
+
+constexpr const LightTraits& light_traits(uint8_t index)
+{
+  return LIGHT_TYPES[index < LIGHT_TYPE_COUNT ? index : 0];
+}
+
+// Command bodies: each sets the opcode in data[0] and its fields, leaving the
+// addressing to the caller. data is the 8 byte command, zeroed.
+inline void light_encode_state(const LightCommandLayout& layout, bool on, uint8_t* data)
+{
+  data[0] = layout.levelOpcode;
+  data[layout.level] = on ? layout.on : 0;
+}
+
+inline void light_encode_brightness(const LightCommandLayout& layout, uint8_t brightness, uint8_t* data)
+{
+  data[0] = layout.levelOpcode;
+  data[layout.level] = brightness & layout.levelMask;
+}
+
+inline void light_encode_rgb(const LightCommandLayout& layout, uint8_t brightness, uint8_t red, uint8_t green,
+                             uint8_t blue, uint8_t* data)
+{
+  data[0] = layout.colorOpcode;
+  data[layout.level] = brightness & layout.levelMask;
+  data[layout.red] = red;
+  data[layout.green] = green;
+  data[layout.blue] = blue;
+}
+
+inline void light_encode_temperature(const LightCommandLayout& layout, uint8_t brightness, uint16_t temperature,
+                                     uint8_t* data)
+{
+  data[0] = layout.colorOpcode;
+  data[layout.level] = brightness & layout.levelMask;
+  data[layout.temperature] = temperature & 127;
+  data[layout.temperature + 1] = (temperature >> 8) & 127;
+}
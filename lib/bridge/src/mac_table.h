@@ -0,0 +1,81 @@
+#pragma once
+
+// Fixed-capacity hash map from 48-bit BLE addresses to a small value (an
+// index into the light registry). Open addressing with linear probing, no
+// heap use and no removal, which is all the scan callbacks need.
+
+#include <stddef.h>
+#include <stdint.h>
+
+template <size_t Capacity>
+class MacTable {
+  static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+public:
+  MacTable() { clear(); }
+
+  static uint64_t key(const uint8_t* mac)
+  {
+    uint64_t key = 0;
+    for (int i = 0; i < 6; i++) key = key << 8 | mac[i];
+    return key;
+  }
+
+  void clear()
+  {
+    for (size_t i = 0; i < Capacity; i++) keys_[i] = empty;
+    size_ = 0;
+  }
+
+  // inserts or updates; returns false if the table is full
+  bool insert(uint64_t mac, uint16_t value)
+  {
+    for (size_t i = slot(mac), n = 0; n < Capacity; i = (i + 1) & (Capacity - 1), n++) {
+      if (keys_[i] == mac) {
+        values_[i] = value;
+        return true;
+      }
+      if (keys_[i] == empty) {
+        // keep at least one empty slot, so lookups of unknown keys terminate
+        if (size_ + 1 >= Capacity) return false;
+        keys_[i] = mac;
+        values_[i] = value;
+        size_++;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool find(uint64_t mac, uint16_t& value) const
+  {
+    for (size_t i = slot(mac);; i = (i + 1) & (Capacity - 1)) {
+      if (keys_[i] == mac) {
+        value = values_[i];
+        return true;
+      }
+      if (keys_[i] == empty) return false;
+    }
+  }
+
+  bool contains(uint64_t mac) const
+  {
+    uint16_t value;
+    return find(mac, value);
+  }
+
+  size_t size() const { return size_; }
+
+private:
+  // not a valid 48-bit address
+  static constexpr uint64_t empty = ~(uint64_t)0;
+
+  static size_t slot(uint64_t mac)
+  {
+    return (size_t)((mac * 0x9E3779B97F4A7C15ull) >> 40) & (Capacity - 1);
+  }
+
+  uint64_t keys_[Capacity];
+  uint16_t values_[Capacity];
+  size_t size_;
+};
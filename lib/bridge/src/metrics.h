@@ -0,0 +1,139 @@
+#pragma once
+
+// Counters and fixed-bucket histograms for the /metrics page.
+//
+// Observing is one relaxed atomic increment per field, so it is safe from any
+// task and cheap enough for the radio task and the scan callbacks; the web
+// server task reads the fields while they're being updated, which at worst
+// shows a sample in the count but not yet in its bucket.
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+template <size_t Buckets>
+class Histogram {
+public:
+  // bounds are the inclusive upper bounds of the buckets, ascending; values
+  // above the last one land in the +Inf bucket
+  explicit Histogram(const uint32_t (&bounds)[Buckets])
+  {
+    for (size_t i = 0; i < Buckets; i++) bounds_[i] = bounds[i];
+  }
+
+  void observe(uint32_t value)
+  {
+    size_t i = 0;
+    while (i < Buckets && value > bounds_[i]) i++;
+    counts_[i].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  uint32_t count() const { return count_.load(std::memory_order_relaxed); }
+  uint32_t sum() const { return sum_.load(std::memory_order_relaxed); }
+  uint32_t bucket(size_t i) const { return counts_[i].load(std::memory_order_relaxed); }
+  uint32_t bound(size_t i) const { return bounds_[i]; }
+  static constexpr size_t buckets() { return Buckets; }
+
+  // upper bound of the bucket holding the q quantile (0-1), or the last bound
+  // if it is in the +Inf bucket; 0 when nothing has been observed
+  uint32_t quantile(float q) const
+  {
+    uint32_t total = count();
+    if (total == 0) return 0;
+    uint32_t rank = (uint32_t)(q * total + 0.5f);
+    if (rank == 0) rank = 1;
+    uint32_t seen = 0;
+    for (size_t i = 0; i < Buckets; i++) {
+      seen += bucket(i);
+      if (seen >= rank) return bounds_[i];
+    }
+    return bounds_[Buckets - 1];
+  }
+
+private:
+  uint32_t bounds_[Buckets];
+  std::atomic<uint32_t> counts_[Buckets + 1] = {};
+  std::atomic<uint32_t> count_{0};
+  std::atomic<uint32_t> sum_{0};
+};
+
+// Appends metrics to a Prometheus text exposition page.
+class MetricsWriter {
+public:
+  explicit MetricsWriter(std::string& out) : out_(out) {}
+
+  // the HELP and TYPE lines, once per metric name
+  void header(const char* name, const char* type, const char* help)
+  {
+    append("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+  }
+
+  void sample(const char* name, uint32_t value)
+  {
+    append("%s %u\n", name, (unsigned)value);
+  }
+
+  void sample(const char* name, const char* label, const char* labelValue, uint32_t value)
+  {
+    append("%s{%s=\"%s\"} %u\n", name, label, labelValue, (unsigned)value);
+  }
+
+  void counter(const char* name, const char* help, uint32_t value)
+  {
+    header(name, "counter", help);
+    sample(name, value);
+  }
+
+  void gauge(const char* name, const char* help, uint32_t value)
+  {
+    header(name, "gauge", help);
+    sample(name, value);
+  }
+
+  template <size_t Buckets>
+  void histogram(const char* name, const char* help, const Histogram<Buckets>& histogram)
+  {
+    header(name, "histogram", help);
+    series(name, NULL, NULL, histogram);
+  }
+
+  // one labelled series of a histogram split by a label; the header goes
+  // first, once
+  template <size_t Buckets>
+  void series(const char* name, const char* label, const char* labelValue, const Histogram<Buckets>& histogram)
+  {
+    char labels[64] = "";
+    if (label) snprintf(labels, sizeof(labels), "%s=\"%s\"", label, labelValue);
+    const char* separator = label ? "," : "";
+    uint32_t cumulative = 0;
+    for (size_t i = 0; i < Buckets; i++) {
+      cumulative += histogram.bucket(i);
+      append("%s_bucket{%s%sle=\"%u\"} %u\n", name, labels, separator, (unsigned)histogram.bound(i),
+             (unsigned)cumulative);
+    }
+    cumulative += histogram.bucket(Buckets);
+    append("%s_bucket{%s%sle=\"+Inf\"} %u\n", name, labels, separator, (unsigned)cumulative);
+    if (label) {
+      append("%s_sum{%s} %u\n", name, labels, (unsigned)histogram.sum());
+      append("%s_count{%s} %u\n", name, labels, (unsigned)cumulative);
+    } else {
+      append("%s_sum %u\n", name, (unsigned)histogram.sum());
+      append("%s_count %u\n", name, (unsigned)cumulative);
+    }
+  }
+
+private:
+  template <typename... Args>
+  void append(const char* format, Args... args)
+  {
+    char line[160];
+    int n = snprintf(line, sizeof(line), format, args...);
+    if (n > 0) out_.append(line, (size_t)n < sizeof(line) ? n : sizeof(line) - 1);
+  }
+
+  std::string& out_;
+};
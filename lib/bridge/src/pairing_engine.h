@@ -0,0 +1,154 @@
+#pragma once
+
+// Schedules the re-key frames for a batch of lights being paired.
+//
+// The caller advertises one light's frame at a time, round robin, while a
+// single scan runs for the whole batch. A light that hasn't confirmed its new
+// key within the timeout is sent its frame again, up to maxAttempts times,
+// then given up on. Confirmations come from the scan callback, which may run
+// on another task: confirm() only touches the light's atomic flag, and
+// everything else is called from the pairing task.
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+enum PairingState : uint8_t {
+  PAIRING_WAITING,   // frame not sent yet
+  PAIRING_SENT,      // waiting for the light to confirm
+  PAIRING_CONFIRMED,
+  PAIRING_FAILED,    // no confirmation after the last attempt
+};
+
+template <size_t Capacity>
+class PairingEngine {
+public:
+  struct Light {
+    uint16_t id;         // caller's handle for the light
+    PairingState state;
+    uint8_t attempts;
+    uint8_t number;      // light number reported in the confirmation
+    uint32_t sentAt;     // end of the latest attempt
+    uint32_t finishedAt; // confirmed or failed
+    std::atomic<bool> confirmed;
+  };
+
+  void begin(uint8_t maxAttempts, uint32_t confirmTimeout, uint32_t now)
+  {
+    maxAttempts_ = maxAttempts;
+    confirmTimeout_ = confirmTimeout;
+    startedAt_ = now;
+    size_ = 0;
+    cursor_ = 0;
+    frames_ = 0;
+  }
+
+  // returns false if the batch is full
+  bool add(uint16_t id)
+  {
+    if (size_ == Capacity) return false;
+    Light& light = lights_[size_];
+    light.id = id;
+    light.state = PAIRING_WAITING;
+    light.attempts = 0;
+    light.number = 0;
+    light.sentAt = 0;
+    light.finishedAt = 0;
+    light.confirmed.store(false, std::memory_order_relaxed);
+    size_++;
+    return true;
+  }
+
+  // called by the scan callback when a light answers with the new key;
+  // returns false if the light isn't in this batch
+  bool confirm(uint16_t id, uint8_t number)
+  {
+    for (size_t i = 0; i < size_; i++) {
+      if (lights_[i].id != id) continue;
+      if (!lights_[i].confirmed.load(std::memory_order_relaxed)) {
+        lights_[i].number = number;
+        lights_[i].confirmed.store(true, std::memory_order_release);
+      }
+      return true;
+    }
+    return false;
+  }
+
+  // returns a light that confirmed since the last call, or -1. A light that
+  // was given up on still counts if its confirmation turns up late.
+  int takeConfirmed(uint32_t now)
+  {
+    for (size_t i = 0; i < size_; i++) {
+      Light& light = lights_[i];
+      if (light.state == PAIRING_CONFIRMED || !light.confirmed.load(std::memory_order_acquire)) continue;
+      light.state = PAIRING_CONFIRMED;
+      light.finishedAt = now;
+      return i;
+    }
+    return -1;
+  }
+
+  // returns the light whose frame should go out next, or -1 if every
+  // outstanding light is still within its timeout
+  int next(uint32_t now)
+  {
+    int due = -1;
+    for (size_t n = 0; n < size_; n++) {
+      size_t i = (cursor_ + n) % size_;
+      Light& light = lights_[i];
+      if (light.state == PAIRING_WAITING) {
+        if (due < 0) due = i;
+      } else if (light.state == PAIRING_SENT && now - light.sentAt >= confirmTimeout_) {
+        if (light.attempts >= maxAttempts_) {
+          light.state = PAIRING_FAILED;
+          light.finishedAt = now;
+        } else if (due < 0) {
+          due = i;
+        }
+      }
+    }
+    if (due >= 0) cursor_ = (due + 1) % size_;
+    return due;
+  }
+
+  // the frame for a light returned by next() has been advertised
+  void sent(int i, uint32_t now)
+  {
+    lights_[i].state = PAIRING_SENT;
+    lights_[i].attempts++;
+    lights_[i].sentAt = now;
+    frames_++;
+  }
+
+  bool done() const
+  {
+    for (size_t i = 0; i < size_; i++) {
+      if (lights_[i].state == PAIRING_WAITING || lights_[i].state == PAIRING_SENT) return false;
+    }
+    return true;
+  }
+
+  size_t count(PairingState state) const
+  {
+    size_t n = 0;
+    for (size_t i = 0; i < size_; i++) {
+      if (lights_[i].state == state) n++;
+    }
+    return n;
+  }
+
+  const Light& operator[](size_t i) const { return lights_[i]; }
+  size_t size() const { return size_; }
+  uint32_t frames() const { return frames_; }
+  uint32_t startedAt() const { return startedAt_; }
+  static constexpr size_t capacity() { return Capacity; }
+
+private:
+  Light lights_[Capacity];
+  size_t size_ = 0;
+  size_t cursor_ = 0;
+  uint8_t maxAttempts_ = 1;
+  uint32_t confirmTimeout_ = 0;
+  uint32_t startedAt_ = 0;
+  uint32_t frames_ = 0;
+};
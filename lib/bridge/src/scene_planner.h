@@ -0,0 +1,136 @@
+#pragma once
+
+// Compiles a scene (a target command for each of several lights) into the
+// fewest command frames.
+//
+// A group frame reaches every light in the group, so it can stand in for the
+// targets of a group that's entirely in the scene. It goes out with the
+// group's most common target, and the members that want something else get
+// a single light frame after it, which the lights apply last. A group frame
+// is only worth it for two or more lights sharing a target, and never for a
+// group with members outside the scene, which it would change too.
+// Single threaded, no heap use.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fastcon.h"
+
+#define SCENE_COMMAND_LENGTH 8
+#define SCENE_GROUPS 256
+
+template <size_t Capacity>
+class ScenePlanner {
+public:
+  ScenePlanner() { clear(); }
+
+  void clear()
+  {
+    targetCount_ = 0;
+    frameCount_ = 0;
+  }
+
+  // a light's target: an encoded command body (opcode and fields, no
+  // addressing) and the group the light is paired into. A light given twice
+  // keeps the last target. Returns false if the scene is full.
+  bool add(uint8_t light, uint8_t group, const uint8_t* body)
+  {
+    size_t i = 0;
+    while (i < targetCount_ && targets_[i].light != light) i++;
+    if (i == targetCount_) {
+      if (targetCount_ == Capacity) return false;
+      targetCount_++;
+    }
+    targets_[i].light = light;
+    targets_[i].group = group;
+    memcpy(targets_[i].data, body, SCENE_COMMAND_LENGTH);
+    targets_[i].data[0] &= 0xf0;
+    targets_[i].data[1] = 0;
+    return true;
+  }
+
+  // plans the frames, given how many registered lights each group has;
+  // returns how many there are, group frames first
+  size_t plan(const uint16_t* groupMembers)
+  {
+    frameCount_ = 0;
+    bool covered[Capacity] = {};
+    bool groupDone[SCENE_GROUPS] = {};
+    for (size_t i = 0; i < targetCount_; i++) {
+      uint8_t group = targets_[i].group;
+      if (groupDone[group]) continue;
+      groupDone[group] = true;
+      size_t inScene = 0;
+      for (size_t j = i; j < targetCount_; j++) inScene += targets_[j].group == group;
+      if (inScene < 2 || inScene != groupMembers[group]) continue;
+      // the group's most common target
+      size_t best = i;
+      size_t bestCount = 0;
+      for (size_t j = i; j < targetCount_; j++) {
+        if (targets_[j].group != group) continue;
+        size_t count = 0;
+        for (size_t k = j; k < targetCount_; k++) count += targets_[k].group == group && sameBody(targets_[j], targets_[k]);
+        if (count > bestCount) {
+          best = j;
+          bestCount = count;
+        }
+      }
+      if (bestCount < 2) continue;
+      addFrame(targets_[best].data, FASTCON_GROUP_CONTROL, group);
+      for (size_t j = i; j < targetCount_; j++) {
+        if (targets_[j].group == group && sameBody(targets_[best], targets_[j])) covered[j] = true;
+      }
+    }
+    for (size_t i = 0; i < targetCount_; i++) {
+      if (!covered[i]) addFrame(targets_[i].data, FASTCON_SINGLE_CONTROL, targets_[i].light);
+    }
+    return frameCount_;
+  }
+
+  // drops the frames keep(frame) is false for, leaving the rest in order;
+  // returns how many are left
+  template <typename Keep>
+  size_t keep(Keep keep)
+  {
+    size_t kept = 0;
+    for (size_t i = 0; i < frameCount_; i++) {
+      if (keep(frames_[i].data)) frames_[kept++] = frames_[i];
+    }
+    frameCount_ = kept;
+    return frameCount_;
+  }
+
+  size_t targets() const { return targetCount_; }
+  size_t frames() const { return frameCount_; }
+  // an 8 byte command, addressed
+  const uint8_t* frame(size_t i) const { return frames_[i].data; }
+
+private:
+  struct Target {
+    uint8_t light;
+    uint8_t group;
+    uint8_t data[SCENE_COMMAND_LENGTH];
+  };
+  struct Frame {
+    uint8_t data[SCENE_COMMAND_LENGTH];
+  };
+
+  static bool sameBody(const Target& a, const Target& b)
+  {
+    return memcmp(a.data, b.data, SCENE_COMMAND_LENGTH) == 0;
+  }
+
+  void addFrame(const uint8_t* body, uint8_t addressing, uint8_t address)
+  {
+    Frame& frame = frames_[frameCount_++];
+    memcpy(frame.data, body, SCENE_COMMAND_LENGTH);
+    frame.data[0] |= addressing;
+    frame.data[1] = address;
+  }
+
+  Target targets_[Capacity];
+  size_t targetCount_;
+  Frame frames_[Capacity];
+  size_t frameCount_;
+};
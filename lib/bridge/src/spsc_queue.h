@@ -0,0 +1,49 @@
+#pragma once
+
+// Bounded single-producer/single-consumer ring buffer.
+//
+// Lock free: the producer only writes head, the consumer only writes tail,
+// and each publishes its index with release ordering after touching the
+// slot. Safe between two FreeRTOS tasks on different cores as long as each
+// side has exactly one task.
+
+#include <atomic>
+#include <stddef.h>
+
+template <typename T, size_t Capacity>
+class SpscQueue {
+  static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+
+public:
+  // returns false if the queue is full
+  bool push(const T& item)
+  {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == Capacity) return false;
+    items_[head & (Capacity - 1)] = item;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // returns false if the queue is empty
+  bool pop(T& item)
+  {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) return false;
+    item = items_[tail & (Capacity - 1)];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  size_t size() const
+  {
+    return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+  }
+
+  static constexpr size_t capacity() { return Capacity; }
+
+private:
+  std::atomic<size_t> head_{0};
+  std::atomic<size_t> tail_{0};
+  T items_[Capacity];
+};
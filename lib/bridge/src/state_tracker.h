@@ -0,0 +1,86 @@
+#pragma once
+
+// Last known state of each light, as heard in its status adverts, and which
+// lights have a change that hasn't been published yet.
+//
+// Status adverts repeat the same state many times a second across a mesh, so
+// only a change marks a light for publishing, and a light is published at
+// most once per debounce period; changes in between are folded into the
+// latest state. Lights are indexed by their number on the mesh. Single
+// threaded: the firmware feeds it from the loop task.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+struct LightState {
+  uint8_t level;          // brightness 0-127, 0 when off
+  uint8_t color[3];       // blue, red, green, as in commands
+  uint8_t temperature[2]; // as in commands
+
+  bool operator==(const LightState& other) const { return memcmp(this, &other, sizeof(*this)) == 0; }
+  bool operator!=(const LightState& other) const { return !(*this == other); }
+};
+
+template <size_t Capacity>
+class StateTracker {
+public:
+  StateTracker() { clear(); }
+
+  void clear()
+  {
+    memset(entries_, 0, sizeof(entries_));
+    cursor_ = 0;
+    pending_ = 0;
+  }
+
+  // a status advert from a light; returns true if it changed the known state
+  bool update(size_t light, const LightState& state)
+  {
+    if (light >= Capacity) return false;
+    Entry& entry = entries_[light];
+    if (entry.known && entry.state == state) return false;
+    entry.state = state;
+    entry.known = true;
+    if (!entry.changed) pending_++;
+    entry.changed = true;
+    return true;
+  }
+
+  // returns a light with an unpublished change that hasn't been published
+  // within the debounce period, or -1, and marks it published
+  int takeChanged(uint32_t now, uint32_t debounce, LightState& state)
+  {
+    if (pending_ == 0) return -1;
+    for (size_t n = 0; n < Capacity; n++) {
+      size_t i = (cursor_ + n) % Capacity;
+      Entry& entry = entries_[i];
+      if (!entry.changed) continue;
+      if (entry.published && now - entry.publishedAt < debounce) continue;
+      entry.changed = false;
+      pending_--;
+      entry.published = true;
+      entry.publishedAt = now;
+      state = entry.state;
+      cursor_ = (i + 1) % Capacity;
+      return i;
+    }
+    return -1;
+  }
+
+  bool known(size_t light) const { return light < Capacity && entries_[light].known; }
+  const LightState& state(size_t light) const { return entries_[light].state; }
+
+private:
+  struct Entry {
+    LightState state;
+    bool known;
+    bool changed;   // not published since the last change
+    bool published; // publishedAt is valid
+    uint32_t publishedAt;
+  };
+
+  Entry entries_[Capacity];
+  size_t cursor_;
+  size_t pending_; // entries with changed set
+};
@@ -0,0 +1,147 @@
+#pragma once
+
+// Fades run on the bridge: brightness, colour and colour temperature moved
+// from their current to their target values over a transition time.
+//
+// One tick, at a fixed frame rate, advances every running fade together and
+// emits a frame for each whose values changed (and always the last one, with
+// the exact target). Interpolation is 15-bit fixed point. A new fade for a
+// target that's still fading starts from where that one got to, or if it
+// fades something else, first finishes that one with its last frame. Single
+// threaded: the firmware starts fades from the MQTT callbacks and ticks from
+// the loop task.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRANSITION_CHANNELS 4
+#define TRANSITION_MAX_MS 60000 // keeps the fixed point products in 32 bits
+
+template <size_t Capacity, typename Target>
+class TransitionEngine {
+public:
+  explicit TransitionEngine(uint32_t frameMs) : frameMs_(frameMs) { clear(); }
+
+  void clear()
+  {
+    for (size_t i = 0; i < Capacity; i++) fades_[i].active = false;
+    lastTick_ = 0;
+  }
+
+  // fades target's channels from from to to over duration ms; kind is the
+  // caller's, handed back with each frame. Replaces a fade already running
+  // for target; if that one was of another kind, its last frame goes to
+  // emit(target, kind, values, true) first, as tick() would have sent it.
+  // Returns false if every slot is busy.
+  template <typename Emit>
+  bool start(const Target& target, uint8_t kind, const uint16_t* from, const uint16_t* to, uint8_t channels,
+             uint32_t now, uint32_t duration, Emit emit)
+  {
+    Fade* fade = find(target);
+    uint16_t current[TRANSITION_CHANNELS];
+    bool running = fade && fade->kind == kind;
+    if (running) {
+      for (uint8_t c = 0; c < channels; c++) current[c] = fade->last[c];
+    } else if (fade) {
+      fade->active = false;
+      emit(fade->target, fade->kind, fade->to, true);
+    }
+    if (!fade) fade = idle();
+    if (!fade) return false;
+    fade->target = target;
+    fade->kind = kind;
+    fade->channels = channels < TRANSITION_CHANNELS ? channels : TRANSITION_CHANNELS;
+    for (uint8_t c = 0; c < fade->channels; c++) {
+      fade->from[c] = running ? current[c] : from[c];
+      fade->to[c] = to[c];
+      fade->last[c] = fade->from[c];
+    }
+    fade->startedAt = now;
+    fade->duration = duration < 1 ? 1 : duration < TRANSITION_MAX_MS ? duration : TRANSITION_MAX_MS;
+    fade->active = true;
+    return true;
+  }
+
+  // stops target's fade where it is, for a command that overrides it
+  void cancel(const Target& target)
+  {
+    Fade* fade = find(target);
+    if (fade) fade->active = false;
+  }
+
+  bool fading(const Target& target) { return find(target) != NULL; }
+
+  // advances every fade if a frame period has passed since the last tick;
+  // calls emit(target, kind, values, last) for each frame to send
+  template <typename Emit>
+  void tick(uint32_t now, Emit emit)
+  {
+    if (now - lastTick_ < frameMs_) return;
+    lastTick_ = now;
+    for (size_t i = 0; i < Capacity; i++) {
+      Fade& fade = fades_[i];
+      if (!fade.active) continue;
+      uint32_t elapsed = now - fade.startedAt;
+      bool last = elapsed >= fade.duration;
+      uint32_t progress = last ? 1u << 15 : (elapsed << 15) / fade.duration;
+      bool changed = false;
+      uint16_t values[TRANSITION_CHANNELS];
+      for (uint8_t c = 0; c < fade.channels; c++) {
+        values[c] = interpolate(fade.from[c], fade.to[c], progress);
+        changed |= values[c] != fade.last[c];
+        fade.last[c] = values[c];
+      }
+      if (last) fade.active = false;
+      if (changed || last) emit(fade.target, fade.kind, values, last);
+    }
+  }
+
+  size_t active() const
+  {
+    size_t n = 0;
+    for (size_t i = 0; i < Capacity; i++) n += fades_[i].active;
+    return n;
+  }
+
+  // from + (to - from) * progress, progress in 1/32768ths, rounded to nearest
+  static uint16_t interpolate(uint16_t from, uint16_t to, uint32_t progress)
+  {
+    int32_t delta = (int32_t)to - from;
+    int32_t step = delta * (int32_t)progress;
+    step = step >= 0 ? (step + (1 << 14)) >> 15 : -((-step + (1 << 14)) >> 15);
+    return (uint16_t)(from + step);
+  }
+
+private:
+  struct Fade {
+    Target target;
+    uint8_t kind;
+    uint8_t channels;
+    bool active;
+    uint16_t from[TRANSITION_CHANNELS];
+    uint16_t to[TRANSITION_CHANNELS];
+    uint16_t last[TRANSITION_CHANNELS]; // the values last emitted
+    uint32_t startedAt;
+    uint32_t duration;
+  };
+
+  Fade* find(const Target& target)
+  {
+    for (size_t i = 0; i < Capacity; i++) {
+      if (fades_[i].active && fades_[i].target == target) return &fades_[i];
+    }
+    return NULL;
+  }
+
+  Fade* idle()
+  {
+    for (size_t i = 0; i < Capacity; i++) {
+      if (!fades_[i].active) return &fades_[i];
+    }
+    return NULL;
+  }
+
+  Fade fades_[Capacity];
+  uint32_t frameMs_;
+  uint32_t lastTick_;
+};
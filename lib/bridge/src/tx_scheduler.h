@@ -0,0 +1,241 @@
+#pragma once
+
+// Decides which frame the advertiser sends next.
+//
+// Frames wait in one queue per priority class: on/off first, then scenes,
+// then brightness and colour (slider drags, fades), then background work
+// (pairing). A queued on/off always goes next. Otherwise the next frame is
+// the head of the highest class with one, except that a head that has waited
+// longer than the maximum latency goes first, oldest first, so a busy class
+// can't starve the ones below it.
+//
+// An airtime budget (ms on air per second, as a token bucket holding up to
+// one second's worth) holds back everything but on/off once it's spent, so
+// the passive scans get their share of the radio; on/off frames go out
+// regardless, and what they spend is taken from what follows.
+//
+// A frame never overtakes an earlier one for the same key (the light or
+// group it addresses): queuing one moves the key's frames waiting in lower
+// classes up into its class, in the order they were queued. Otherwise a
+// brightness change queued just before an "off" would turn the light back on.
+// A frame can reach more keys than its own (a group frame reaches its
+// lights'); the caller then says for each lower frame whether it moves up
+// too, or is dropped because the new frame undoes it anyway.
+//
+// Not thread safe; the firmware holds a lock around it. Times are in ms.
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum TxClass : uint8_t {
+  TX_ON_OFF,
+  TX_SCENE,
+  TX_LEVEL,
+  TX_BACKGROUND,
+  TX_CLASSES,
+};
+
+struct TxStats {
+  uint32_t queued[TX_CLASSES];
+  uint32_t sent[TX_CLASSES];    // frames charged
+  uint32_t dropped[TX_CLASSES]; // class queue full
+  uint32_t overdue;             // frames sent ahead of their class for waiting too long
+  uint32_t superseded;          // frames dropped for a later one that undoes them
+  uint32_t budgetWaits;         // times a frame was held back by the budget
+  uint32_t airtimeMs;
+};
+
+// what queuing a frame does to one waiting in a lower class
+enum TxReach : uint8_t {
+  TX_APART,      // nothing, it's for a key the frame doesn't reach
+  TX_BEFORE,     // moves it up, to go first
+  TX_SUPERSEDED, // drops it
+};
+
+template <typename Item, size_t Capacity>
+class TxScheduler {
+public:
+  TxScheduler(uint32_t budgetMs, uint32_t maxLatencyMs) { configure(budgetMs, maxLatencyMs); }
+
+  // budgetMs of airtime a second; 1000 or more is no limit
+  void configure(uint32_t budgetMs, uint32_t maxLatencyMs)
+  {
+    budgetMs_ = budgetMs;
+    maxLatencyMs_ = maxLatencyMs;
+    tokensUs_ = (int32_t)capUs();
+  }
+
+  bool push(TxClass cls, uint16_t key, const Item& item, uint32_t now)
+  {
+    return push(
+        cls, key, item, now, [key](uint16_t other, const Item&) { return other == key ? TX_BEFORE : TX_APART; },
+        [](const Item&) {});
+  }
+
+  // as above, for a frame that reaches more than its own key: reach(key,
+  // item) says what happens to each frame waiting in a lower class, and
+  // dropped(item) gets those it supersedes
+  template <typename Reach, typename Dropped>
+  bool push(TxClass cls, uint16_t key, const Item& item, uint32_t now, Reach reach, Dropped dropped)
+  {
+    TxReach actions[TX_CLASSES][Capacity];
+    size_t moving = 0;
+    for (int c = cls + 1; c < TX_CLASSES; c++) {
+      for (size_t i = 0; i < counts_[c]; i++) {
+        actions[c][i] = reach(queues_[c][i].key, queues_[c][i].item);
+        moving += actions[c][i] == TX_BEFORE;
+      }
+    }
+    if (counts_[cls] + moving + 1 > Capacity) {
+      stats_.dropped[cls]++;
+      return false;
+    }
+    for (int c = cls + 1; c < TX_CLASSES; c++) {
+      for (size_t i = 0, kept = 0; kept < counts_[c];) {
+        TxReach action = actions[c][i++];
+        if (action == TX_APART) {
+          kept++;
+          continue;
+        }
+        if (action == TX_BEFORE) {
+          insert(cls, queues_[c][kept]);
+        } else {
+          dropped(queues_[c][kept].item);
+          stats_.superseded++;
+        }
+        remove((TxClass)c, kept);
+      }
+    }
+    insert(cls, Entry{ item, key, now });
+    stats_.queued[cls]++;
+    return true;
+  }
+
+  // takes the frame to send now. Returns false if there's none or the budget
+  // holds it back; then wait is the ms until one could go, or 0 if nothing
+  // is queued.
+  bool pop(uint32_t now, Item& item, TxClass& cls, uint32_t& waited, uint32_t& wait)
+  {
+    refill(now);
+    wait = 0;
+    int next = counts_[TX_ON_OFF] ? TX_ON_OFF : -1;
+    bool overdue = false;
+    for (int c = TX_ON_OFF + 1; c < TX_CLASSES && next != TX_ON_OFF; c++) {
+      if (counts_[c] == 0) continue;
+      uint32_t age = now - queues_[c][0].enqueuedAt;
+      if (age >= maxLatencyMs_ && (!overdue || older(queues_[c][0], queues_[next][0]))) {
+        next = c;
+        overdue = true;
+      } else if (next < 0) {
+        next = c;
+      }
+    }
+    if (next < 0) return false;
+    // the budget only holds back the classes below on/off
+    if (next != TX_ON_OFF && limited() && tokensUs_ <= 0) {
+      stats_.budgetWaits++;
+      wait = (uint32_t)(-tokensUs_) / budgetMs_ + 1;
+      return false;
+    }
+    cls = (TxClass)next;
+    item = queues_[cls][0].item;
+    waited = now - queues_[cls][0].enqueuedAt;
+    remove(cls, 0);
+    if (overdue && next != firstNonEmpty()) stats_.overdue++;
+    return true;
+  }
+
+  // whether a frame of class cls may go out now without a queued one: for
+  // work that transmits on its own (pairing)
+  bool admit(TxClass cls, uint32_t now)
+  {
+    refill(now);
+    for (int c = 0; c < cls; c++) {
+      if (counts_[c]) return false;
+    }
+    return cls == TX_ON_OFF || !limited() || tokensUs_ > 0;
+  }
+
+  // the airtime a frame took, once it's off air
+  void charge(TxClass cls, uint32_t now, uint32_t airtimeMs)
+  {
+    refill(now);
+    stats_.sent[cls]++;
+    stats_.airtimeMs += airtimeMs;
+    if (!limited()) return;
+    int32_t floor = -(int32_t)capUs();
+    int32_t cost = (int32_t)(airtimeMs * 1000);
+    tokensUs_ = tokensUs_ - cost < floor ? floor : tokensUs_ - cost;
+  }
+
+  size_t size() const
+  {
+    size_t n = 0;
+    for (int c = 0; c < TX_CLASSES; c++) n += counts_[c];
+    return n;
+  }
+  size_t size(TxClass cls) const { return counts_[cls]; }
+  static constexpr size_t capacity() { return Capacity; }
+  const TxStats& stats() const { return stats_; }
+  // airtime left in the bucket, ms (negative once on/off frames overspend)
+  int32_t budgetLeftMs() const { return tokensUs_ / 1000; }
+  uint32_t budgetMs() const { return budgetMs_; }
+  uint32_t maxLatencyMs() const { return maxLatencyMs_; }
+
+private:
+  struct Entry {
+    Item item;
+    uint16_t key;
+    uint32_t enqueuedAt;
+  };
+
+  bool limited() const { return budgetMs_ < 1000; }
+  uint32_t capUs() const { return budgetMs_ * 1000; }
+
+  static bool older(const Entry& a, const Entry& b) { return (int32_t)(a.enqueuedAt - b.enqueuedAt) < 0; }
+
+  int firstNonEmpty() const
+  {
+    for (int c = 0; c < TX_CLASSES; c++) {
+      if (counts_[c]) return c;
+    }
+    return -1;
+  }
+
+  void refill(uint32_t now)
+  {
+    uint32_t elapsed = now - refilledAt_;
+    refilledAt_ = now;
+    if (!limited()) return;
+    // budgetMs per 1000 ms is budgetMs us of airtime per ms
+    uint32_t cap = capUs();
+    uint32_t gain = elapsed < 1000 ? elapsed * budgetMs_ : cap * 2;
+    tokensUs_ = (int64_t)tokensUs_ + gain > (int64_t)cap ? (int32_t)cap : tokensUs_ + (int32_t)gain;
+  }
+
+  // keeps each class in the order its frames were first queued
+  void insert(TxClass cls, const Entry& entry)
+  {
+    size_t i = counts_[cls];
+    while (i > 0 && older(entry, queues_[cls][i - 1])) {
+      queues_[cls][i] = queues_[cls][i - 1];
+      i--;
+    }
+    queues_[cls][i] = entry;
+    counts_[cls]++;
+  }
+
+  void remove(TxClass cls, size_t i)
+  {
+    for (; i + 1 < counts_[cls]; i++) queues_[cls][i] = queues_[cls][i + 1];
+    counts_[cls]--;
+  }
+
+  Entry queues_[TX_CLASSES][Capacity];
+  size_t counts_[TX_CLASSES] = {};
+  uint32_t budgetMs_;
+  uint32_t maxLatencyMs_;
+  int32_t tokensUs_;
+  uint32_t refilledAt_ = 0;
+  TxStats stats_ = {};
+};
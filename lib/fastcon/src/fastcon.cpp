@@ -0,0 +1,457 @@
+#include "fastcon.h"
+#include <string.h>
+
+const uint8_t default_key[] = { 0x5e, 0x36, 0x7b, 0xc4 };
+const uint8_t DEFAULT_BLE_FASTCON_ADDRESS[] = { 0xC1, 0xC2, 0xC3 };
+std::atomic<uint8_t> SEND_SEQ{0};
+std::atomic<uint8_t> SEND_COUNT{1};
+
+static fastcon_trace_fn trace_fn = 0;
+
+void fastcon_set_trace(fastcon_trace_fn trace)
+{
+  trace_fn = trace;
+}
+
+static void trace(const char* label, const uint8_t* data, int length)
+{
+  if (trace_fn) trace_fn(label, data, length);
+}
+
+uint8_t package_ble_fastcon_body(int i, int i2, uint8_t sequence, uint8_t safe_key, int forward, const uint8_t* data, int length, const uint8_t* key, uint8_t* payload)
+{
+  if (length > FASTCON_MAX_DATA_LENGTH)
+  {
+    trace("data too long", data, length);
+    return 0;
+  }
+  uint8_t payloadLength = FASTCON_PAYLOAD_LENGTH;
+  payload[0] = (i2 & 0b1111) << 0 | (i & 0b111) << 4 | (forward & 0xff) << 7;
+  payload[1] = sequence & 0xff;
+  payload[2] = safe_key;
+  payload[3] = 0; // checksum
+  // fill payload with zeros
+  for (int j = 4; j < payloadLength; j++) payload[j]=0;
+  memcpy(payload + 4, data, length);
+
+  uint8_t checksum = 0;
+  for (int j = 0; j < length + 4; j++)
+  {
+    if (j == 3) continue;
+    checksum = (checksum + payload[j]) & 0xff;
+  }
+  payload[3] = checksum;
+  for (int j = 0; j < 4; j++) {
+    payload[j] = default_key[j & 3] ^ payload[j];
+  }
+  for (int j = 0; j < 12; j++) {
+    payload[4 + j] = key[j & 3] ^ payload[4 + j];
+  }
+  return payloadLength;
+}
+
+uint8_t get_payload_with_inner_retry(int i, const uint8_t* data, int length, int i2, const uint8_t* key, int forward, uint8_t* payload) {
+  uint8_t sequence = ++SEND_COUNT;
+  SEND_SEQ = sequence;
+  trace("data", data, length);
+  trace("key", key, 4);
+  trace("sequence", &sequence, 1);
+  uint8_t safe_key = 0xff;
+  bool hasKey = false;
+  for (int i = 0; i < 4; i++) {
+    if (key[i] != 0) {
+      hasKey = true;
+      break;
+    }
+  }
+  if (hasKey) safe_key = key[3];
+  uint8_t result = package_ble_fastcon_body(i, i2, sequence, safe_key, forward, data, length, key, payload);
+  if (result && !hasKey) {
+    // set the data content to the default key
+    for (int i = 4; i < 16; i++) {
+      payload[i] = default_key[i & 3];
+    }
+  }
+  return result;
+}
+
+void whiteningInit(uint8_t val, uint8_t* ctx)
+{
+  ctx[0] = 1;
+  ctx[1] = (val >> 5) & 1;
+  ctx[2] = (val >> 4) & 1;
+  ctx[3] = (val >> 3) & 1;
+  ctx[4] = (val >> 2) & 1;
+  ctx[5] = (val >> 1) & 1;
+  ctx[6] = val & 1;
+}
+
+void whiteningEncode(const uint8_t* data, int len, uint8_t* ctx, uint8_t* result)
+{
+  if (result != data) memcpy(result, data, len);
+  for (int i = 0; i < len; i++) {
+    int ctx3 = ctx[3];
+    int ctx5 = ctx[5];
+    int ctx6 = ctx[6];
+    int ctx4 = ctx[4];
+    int ctx52 = ctx5 ^ ctx[2];
+    int ctx41 = ctx4 ^ ctx[1];
+    int ctx63 = ctx6 ^ ctx3;
+    int ctx630 = ctx63 ^ ctx[0];
+
+    int c = result[i];
+    result[i] = ((c & 0x80) ^ ((ctx52 ^ ctx6) << 7))
+      + ((c & 0x40) ^ (ctx630 << 6))
+      + ((c & 0x20) ^ (ctx41 << 5))
+      + ((c & 0x10) ^ (ctx52 << 4))
+      + ((c & 0x08) ^ (ctx63 << 3))
+      + ((c & 0x04) ^ (ctx4 << 2))
+      + ((c & 0x02) ^ (ctx5 << 1))
+      + ((c & 0x01) ^ (ctx6 << 0));
+
+    ctx[2] = ctx41;
+    ctx[3] = ctx52;
+    ctx[4] = ctx52 ^ ctx3;
+    ctx[5] = ctx630 ^ ctx4;
+    ctx[6] = ctx41 ^ ctx5;
+    ctx[0] = ctx52 ^ ctx6;
+    ctx[1] = ctx630;
+  }
+}
+
+// The whitening LFSR never looks at the data, so for a fixed seed it just
+// produces a constant keystream. FastCon always whitens with seed 0x25, so
+// that keystream is generated at compile time by running the same LFSR step
+// as whiteningEncode() over zero bytes.
+struct WhiteningKeystream {
+  uint8_t bytes[FASTCON_WHITENING_KEYSTREAM_LENGTH];
+};
+
+static constexpr WhiteningKeystream make_whitening_keystream(uint8_t val)
+{
+  WhiteningKeystream keystream = {};
+  int ctx[7] = { 1, (val >> 5) & 1, (val >> 4) & 1, (val >> 3) & 1, (val >> 2) & 1, (val >> 1) & 1, val & 1 };
+  for (int i = 0; i < FASTCON_WHITENING_KEYSTREAM_LENGTH; i++) {
+    int ctx52 = ctx[5] ^ ctx[2];
+    int ctx41 = ctx[4] ^ ctx[1];
+    int ctx63 = ctx[6] ^ ctx[3];
+    int ctx630 = ctx63 ^ ctx[0];
+    keystream.bytes[i] = (ctx52 ^ ctx[6]) << 7 | ctx630 << 6 | ctx41 << 5 | ctx52 << 4
+      | ctx63 << 3 | ctx[4] << 2 | ctx[5] << 1 | ctx[6];
+    int ctx3 = ctx[3], ctx4 = ctx[4], ctx5 = ctx[5], ctx6 = ctx[6];
+    ctx[2] = ctx41;
+    ctx[3] = ctx52;
+    ctx[4] = ctx52 ^ ctx3;
+    ctx[5] = ctx630 ^ ctx4;
+    ctx[6] = ctx41 ^ ctx5;
+    ctx[0] = ctx52 ^ ctx6;
+    ctx[1] = ctx630;
+  }
+  return keystream;
+}
+
+static constexpr WhiteningKeystream fastcon_whitening_keystream = make_whitening_keystream(FASTCON_WHITENING_SEED);
+
+void whiteningEncodeSeed(uint8_t seed, const uint8_t* data, int len, uint8_t* result)
+{
+  if (seed != FASTCON_WHITENING_SEED || len > FASTCON_WHITENING_KEYSTREAM_LENGTH) {
+    uint8_t ctx[7];
+    whiteningInit(seed, ctx);
+    whiteningEncode(data, len, ctx, result);
+    return;
+  }
+  const uint8_t* keystream = fastcon_whitening_keystream.bytes;
+  int i = 0;
+  for (; i + 4 <= len; i += 4) {
+    uint32_t word, mask;
+    memcpy(&word, data + i, 4);
+    memcpy(&mask, keystream + i, 4);
+    word ^= mask;
+    memcpy(result + i, &word, 4);
+  }
+  for (; i < len; i++) result[i] = data[i] ^ keystream[i];
+}
+
+uint8_t reverse_8(uint8_t d)
+{
+  d = (d & 0xf0) >> 4 | (d & 0x0f) << 4;
+  d = (d & 0xcc) >> 2 | (d & 0x33) << 2;
+  d = (d & 0xaa) >> 1 | (d & 0x55) << 1;
+  return d;
+}
+
+uint16_t reverse_16(uint16_t d) {
+  return reverse_8(d >> 8) | reverse_8(d & 0xff) << 8;
+}
+
+// The frame CRC is CRC-16/CCITT (poly 0x1021, init 0xffff) over the address
+// bytes as-is and the data bytes bit reversed, with the result bit reversed
+// and inverted. Running it bit-reflected (poly 0x8408) instead cancels all of
+// those reversals for the data bytes, so the per-byte step is one table
+// lookup. Only the address bytes need reversing, and the default address
+// prefix is folded into a constant.
+struct Crc16Table {
+  uint16_t entries[256];
+};
+
+static constexpr Crc16Table make_crc16_table()
+{
+  Crc16Table table = {};
+  for (int i = 0; i < 256; i++) {
+    uint16_t crc = i;
+    for (int k = 0; k < 8; k++) crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+    table.entries[i] = crc;
+  }
+  return table;
+}
+
+static constexpr Crc16Table crc16_table = make_crc16_table();
+
+static constexpr uint8_t crc16_reverse_8(uint8_t d)
+{
+  uint8_t result = 0;
+  for (int k = 0; k < 8; k++) result |= ((d >> k) & 1) << (7 - k);
+  return result;
+}
+
+// reflected CRC state after the address prefix
+static constexpr uint16_t crc16_address_state(uint8_t a0, uint8_t a1, uint8_t a2)
+{
+  uint16_t crc = 0xffff;
+  const uint8_t reversed[] = { crc16_reverse_8(a2), crc16_reverse_8(a1), crc16_reverse_8(a0) };
+  for (uint8_t b : reversed) crc = (crc >> 8) ^ crc16_table.entries[(crc ^ b) & 0xff];
+  return crc;
+}
+
+static constexpr uint16_t crc16_default_address_state = crc16_address_state(0xC1, 0xC2, 0xC3);
+
+uint16_t crc16(const uint8_t* addr, const uint8_t* data, uint8_t dataLength)
+{
+  uint16_t crc;
+  if (addr == DEFAULT_BLE_FASTCON_ADDRESS || memcmp(addr, DEFAULT_BLE_FASTCON_ADDRESS, addrLength) == 0) {
+    crc = crc16_default_address_state;
+  } else {
+    crc = crc16_address_state(addr[0], addr[1], addr[2]);
+  }
+  for (uint8_t i = 0; i < dataLength; i++) {
+    crc = (crc >> 8) ^ crc16_table.entries[(crc ^ data[i]) & 0xff];
+  }
+  return ~crc & 0xffff;
+}
+
+uint8_t get_rf_payload(const uint8_t* addr, const uint8_t* data, uint8_t dataLength, uint8_t* rfPayload)
+{
+  uint8_t data_offset = 0x12;
+  uint8_t inverse_offset = 0x0f;
+  uint8_t result_data_size = data_offset + addrLength + dataLength+2;
+  uint8_t* resultbuf = rfPayload;
+  memset(resultbuf, 0, result_data_size);
+
+  resultbuf[0x0f] = 0x71;
+  resultbuf[0x10] = 0x0f;
+  resultbuf[0x11] = 0x55;
+
+  for (uint8_t j = 0; j < addrLength; j++) {
+    resultbuf[data_offset + addrLength - j - 1] = addr[j];
+  }
+
+  for (int j = 0; j < dataLength; j++) {
+    resultbuf[data_offset + addrLength + j] = data[j];
+  }
+
+  for (int i = inverse_offset; i < inverse_offset + addrLength + 3; i++) {
+    resultbuf[i] = reverse_8(resultbuf[i]);
+  }
+
+  int crc = crc16(addr, data, dataLength);
+  resultbuf[result_data_size-2] = crc & 0xff;
+  resultbuf[result_data_size-1] = (crc >> 8) & 0xff;
+  return result_data_size;
+}
+
+uint8_t do_generate_command(int i, const uint8_t* data, uint8_t length, const uint8_t* key, int forward, int use_default_adapter, int i2, uint8_t* rfPayload)
+{
+  (void)use_default_adapter; // kept for the reference implementation's signature; always the default address
+  if (i2 < 0) i2 = 0;
+  uint8_t payload[FASTCON_PAYLOAD_LENGTH];
+  uint8_t payloadLength = get_payload_with_inner_retry(i, data, length, i2, key, forward, payload);
+  if (payloadLength == 0) return 0;
+  trace("payload", payload, payloadLength);
+  uint8_t result[FASTCON_RF_BUFFER_LENGTH];
+  uint8_t rfPayloadLength = get_rf_payload(DEFAULT_BLE_FASTCON_ADDRESS, payload, payloadLength, result);
+  whiteningEncodeSeed(FASTCON_WHITENING_SEED, result, rfPayloadLength, result);
+  memcpy(rfPayload, result + FASTCON_RF_PAYLOAD_OFFSET, rfPayloadLength - FASTCON_RF_PAYLOAD_OFFSET);
+  trace("rf payload", rfPayload, rfPayloadLength - FASTCON_RF_PAYLOAD_OFFSET);
+  return rfPayloadLength - FASTCON_RF_PAYLOAD_OFFSET;
+}
+
+uint8_t getServiceData(uint8_t rfPayloadLength, const uint8_t* rfPayload, uint8_t* serviceData)
+{
+  // manufacturer specific AD structure: length, type 0xFF, then 0xF0 0xFF
+  const uint8_t header[] = { 0xFF, 0xF0, 0xFF };
+  serviceData[0] = sizeof(header) + rfPayloadLength;
+  memcpy(serviceData + 1, header, sizeof(header));
+  memcpy(serviceData + 1 + sizeof(header), rfPayload, rfPayloadLength);
+  return 1 + sizeof(header) + rfPayloadLength;
+}
+
+bool generate_frame(int i, const uint8_t* data, uint8_t length, const uint8_t* key, int forward, FastconFrame& frame)
+{
+  // flags AD structure: BR_EDR_NOT_SUPPORTED
+  frame.data[0] = 0x02;
+  frame.data[1] = 0x01;
+  frame.data[2] = 0x04;
+  uint8_t rfPayload[FASTCON_RF_PAYLOAD_LENGTH];
+  uint8_t rfPayloadLength = do_generate_command(i, data, length, key, forward, true, 0, rfPayload);
+  if (rfPayloadLength == 0) {
+    frame.length = 0;
+    return false;
+  }
+  frame.length = 3 + getServiceData(rfPayloadLength, rfPayload, frame.data + 3);
+  trace("send", frame.data, frame.length);
+  return true;
+}
+
+// The CRC register is linear in the data, so flipping bits of one payload
+// byte flips a fixed pattern of CRC bits, whatever the rest of the payload
+// is: the CRC of the flip alone, from a zero register, run through the bytes
+// after it. One table per byte that changes with the sequence number.
+struct Crc16DeltaTable {
+  uint16_t entries[256];
+};
+
+static constexpr Crc16DeltaTable make_crc16_delta_table(int position, int length)
+{
+  Crc16DeltaTable table = {};
+  for (int v = 0; v < 256; v++) {
+    uint16_t crc = 0;
+    for (int j = 0; j < length; j++) {
+      uint8_t b = j == position ? v : 0;
+      crc = (crc >> 8) ^ crc16_table.entries[(crc ^ b) & 0xff];
+    }
+    table.entries[v] = crc;
+  }
+  return table;
+}
+
+// payload byte 1 is the sequence number, byte 3 the checksum
+static constexpr Crc16DeltaTable crc16_sequence_delta = make_crc16_delta_table(1, FASTCON_PAYLOAD_LENGTH);
+static constexpr Crc16DeltaTable crc16_checksum_delta = make_crc16_delta_table(3, FASTCON_PAYLOAD_LENGTH);
+
+bool fastcon_make_template(int i, const uint8_t* data, uint8_t length, const uint8_t* key, int forward, FastconFrameTemplate& tmpl)
+{
+  if (!generate_frame(i, data, length, key, forward, tmpl.frame)) return false;
+  // recover the plain bytes from the frame: the payload was whitened from
+  // its offset in the buffer get_rf_payload() builds, after the default key
+  // XOR of its header
+  const uint8_t* keystream = fastcon_whitening_keystream.bytes + 0x12 + addrLength;
+  const uint8_t* payload = tmpl.frame.data + FASTCON_FRAME_PAYLOAD_OFFSET;
+  tmpl.sequence = payload[1] ^ keystream[1] ^ default_key[1];
+  tmpl.checksum = payload[3] ^ keystream[3] ^ default_key[3];
+  return true;
+}
+
+void fastcon_patch_template(FastconFrameTemplate& tmpl, uint8_t sequence)
+{
+  // the checksum sums the header bytes, sequence included
+  uint8_t checksum = tmpl.checksum + (uint8_t)(sequence - tmpl.sequence);
+  uint8_t sequenceDelta = sequence ^ tmpl.sequence;
+  uint8_t checksumDelta = checksum ^ tmpl.checksum;
+  // whitening XORs a fixed keystream, so the deltas go straight into the
+  // whitened bytes
+  uint8_t* payload = tmpl.frame.data + FASTCON_FRAME_PAYLOAD_OFFSET;
+  payload[1] ^= sequenceDelta;
+  payload[3] ^= checksumDelta;
+  uint16_t crcDelta = crc16_sequence_delta.entries[sequenceDelta] ^ crc16_checksum_delta.entries[checksumDelta];
+  tmpl.frame.data[FASTCON_FRAME_CRC_OFFSET] ^= crcDelta & 0xff;
+  tmpl.frame.data[FASTCON_FRAME_CRC_OFFSET + 1] ^= crcDelta >> 8;
+  tmpl.sequence = sequence;
+  tmpl.checksum = checksum;
+}
+
+const FastconFrame& fastcon_next_frame(FastconFrameTemplate& tmpl)
+{
+  uint8_t sequence = ++SEND_COUNT;
+  SEND_SEQ = sequence;
+  fastcon_patch_template(tmpl, sequence);
+  trace("send", tmpl.frame.data, tmpl.frame.length);
+  return tmpl.frame;
+}
+
+uint8_t fastcon_manufacturer_data(const uint8_t* payload, size_t length, const uint8_t*& data)
+{
+  // AD structures: length (covering type and data), type, data
+  size_t i = 0;
+  while (i + 1 < length && payload[i] != 0) {
+    uint8_t adLength = payload[i];
+    if (i + 1 + adLength > length) break;
+    if (payload[i + 1] == 0xFF) {
+      data = payload + i + 2;
+      return adLength - 1;
+    }
+    i += 1 + adLength;
+  }
+  data = 0;
+  return 0;
+}
+
+FastconDecodeResult fastcon_decode_payload(const uint8_t* payload, const uint8_t* key, FastconCommand& command)
+{
+  uint8_t header[4];
+  for (int j = 0; j < 4; j++) header[j] = payload[j] ^ default_key[j];
+  // the safe key byte is the last key byte (0xff for the all zero key), so
+  // most frames for another mesh stop here
+  bool hasKey = key[0] != 0 || key[1] != 0 || key[2] != 0 || key[3] != 0;
+  if (header[2] != (hasKey ? key[3] : 0xff)) return FASTCON_DECODE_KEY;
+  uint8_t checksum = header[0] + header[1] + header[2];
+  for (int j = 0; j < FASTCON_MAX_DATA_LENGTH; j++) {
+    command.data[j] = payload[4 + j] ^ key[j & 3];
+    checksum += command.data[j];
+  }
+  if (checksum != header[3]) return FASTCON_DECODE_CHECKSUM;
+  command.i2 = header[0] & 0b1111;
+  command.type = (header[0] >> 4) & 0b111;
+  command.forward = header[0] >> 7;
+  command.sequence = header[1];
+  return FASTCON_DECODE_OK;
+}
+
+FastconDecodeResult fastcon_decode_frame(const uint8_t* mData, uint8_t length, const uint8_t* key, FastconCommand& command)
+{
+  if (length != FASTCON_COMMAND_DATA_LENGTH) return FASTCON_DECODE_LENGTH;
+  if (mData[0] != 0xF0 || mData[1] != 0xFF) return FASTCON_DECODE_HEADER;
+  // the rf payload is the tail of the buffer get_rf_payload() builds, so it
+  // was whitened from that offset into the keystream
+  uint8_t rf[FASTCON_RF_PAYLOAD_LENGTH];
+  const uint8_t* keystream = fastcon_whitening_keystream.bytes + FASTCON_RF_PAYLOAD_OFFSET;
+  for (int j = 0; j < FASTCON_RF_PAYLOAD_LENGTH; j++) rf[j] = mData[2 + j] ^ keystream[j];
+  // rf header 71 0f 55 and the address, both stored bit reversed and the
+  // address in reverse byte order
+  static constexpr uint8_t expected[] = {
+    crc16_reverse_8(0x71), crc16_reverse_8(0x0f), crc16_reverse_8(0x55),
+    crc16_reverse_8(0xC3), crc16_reverse_8(0xC2), crc16_reverse_8(0xC1),
+  };
+  if (memcmp(rf, expected, sizeof(expected)) != 0) return FASTCON_DECODE_HEADER;
+  const uint8_t* payload = rf + sizeof(expected);
+  uint16_t crc = crc16(DEFAULT_BLE_FASTCON_ADDRESS, payload, FASTCON_PAYLOAD_LENGTH);
+  if (rf[FASTCON_RF_PAYLOAD_LENGTH - 2] != (crc & 0xff) || rf[FASTCON_RF_PAYLOAD_LENGTH - 1] != crc >> 8) return FASTCON_DECODE_CRC;
+  return fastcon_decode_payload(payload, key, command);
+}
+
+FastconDecodeResult fastcon_decode_light_advert(const uint8_t* mData, uint8_t length, const uint8_t* key, FastconLightAdvert& advert)
+{
+  if (length != FASTCON_ADVERT_DATA_LENGTH) return FASTCON_DECODE_LENGTH;
+  const uint8_t* body = mData + 6;
+  advert.defaultKey = memcmp(body + 8, default_key, 4) == 0;
+  if (advert.defaultKey) {
+    memcpy(advert.mac, body, 6);
+    memcpy(advert.type, body + 6, 2);
+    advert.number = 0;
+    return FASTCON_DECODE_OK;
+  }
+  for (int j = 0; j < 12; j++) advert.status[j] = body[j] ^ key[j & 3];
+  advert.number = advert.status[1];
+  // no light is numbered 0, so that's a light on another mesh's key
+  if (advert.number == 0) return FASTCON_DECODE_KEY;
+  return FASTCON_DECODE_OK;
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+// FastCon (BRmesh) frame encoder and decoder.
+//
+// Plain C++ with no Arduino or BLE dependencies, so it builds both in the
+// esp32dev firmware and in the native env used by the benchmarks in bench/.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+extern const uint8_t default_key[4];
+extern const uint8_t DEFAULT_BLE_FASTCON_ADDRESS[];
+const uint8_t addrLength = 3;
+
+// Frame sizes. A command carries at most FASTCON_MAX_DATA_LENGTH bytes, so
+// every buffer in the pipeline has a fixed upper bound and lives on the
+// caller's stack; nothing here touches the heap.
+#define FASTCON_MAX_DATA_LENGTH 12
+#define FASTCON_PAYLOAD_LENGTH (4 + FASTCON_MAX_DATA_LENGTH)
+#define FASTCON_RF_BUFFER_LENGTH (0x12 + addrLength + FASTCON_PAYLOAD_LENGTH + 2)
+#define FASTCON_RF_PAYLOAD_OFFSET 0x0f
+#define FASTCON_RF_PAYLOAD_LENGTH (FASTCON_RF_BUFFER_LENGTH - FASTCON_RF_PAYLOAD_OFFSET)
+#define FASTCON_SERVICE_DATA_LENGTH (4 + FASTCON_RF_PAYLOAD_LENGTH)
+#define FASTCON_FRAME_LENGTH (3 + FASTCON_SERVICE_DATA_LENGTH)
+
+// A complete raw BLE advertisement for one command: the flags AD structure
+// followed by the manufacturer specific AD structure carrying the whitened
+// rf payload. Owned by the caller, filled in by generate_frame().
+struct FastconFrame {
+  uint8_t data[FASTCON_FRAME_LENGTH];
+  uint8_t length;
+};
+
+// Control commands start with a byte whose high nibble is the opcode and
+// whose low nibble says what the second byte addresses: a single light
+// number, or a group id that every light paired into that group obeys.
+#define FASTCON_SINGLE_CONTROL 0x02
+#define FASTCON_GROUP_CONTROL 0x04
+
+// Lights advertise 18 bytes of manufacturer specific data: 2 bytes company
+// id, 4 bytes header, then a 12 byte body holding the light's MAC (bytes
+// 6-11), its type code (12-13) and the key it's using (14-17).
+#define FASTCON_ADVERT_DATA_LENGTH 18
+
+// Finds the manufacturer specific data in a raw advert without copying it.
+// Returns its length (0 if there is none) and points data at it. This is the
+// cheap first check scan callbacks use to drop adverts from other devices.
+uint8_t fastcon_manufacturer_data(const uint8_t* payload, size_t length, const uint8_t*& data);
+
+// every FastCon frame is whitened from this seed; the keystream for it is
+// precomputed for frames up to FASTCON_WHITENING_KEYSTREAM_LENGTH bytes
+#define FASTCON_WHITENING_SEED 0x25
+#define FASTCON_WHITENING_KEYSTREAM_LENGTH 64
+
+// sequence counter shared by every generated command. Atomic, as commands
+// are encoded on the radio task while pairing encodes its own frames on the
+// loop task; each frame takes its number with one increment, so no two get
+// the same one. SEND_SEQ is the number last taken.
+extern std::atomic<uint8_t> SEND_SEQ;
+extern std::atomic<uint8_t> SEND_COUNT;
+
+// Optional hook that receives each intermediate buffer (data, key, payload,
+// rf payload, ...) as it's produced. The firmware points it at a hex dump.
+typedef void (*fastcon_trace_fn)(const char* label, const uint8_t* data, int length);
+void fastcon_set_trace(fastcon_trace_fn trace);
+
+// Pipeline stages. Output buffers are caller owned and must hold
+// FASTCON_PAYLOAD_LENGTH, FASTCON_RF_BUFFER_LENGTH, FASTCON_RF_PAYLOAD_LENGTH
+// and FASTCON_SERVICE_DATA_LENGTH bytes respectively. Each returns the number
+// of bytes written, or 0 if data is longer than FASTCON_MAX_DATA_LENGTH.
+uint8_t package_ble_fastcon_body(int i, int i2, uint8_t sequence, uint8_t safe_key, int forward, const uint8_t* data, int length, const uint8_t* key, uint8_t* payload);
+uint8_t get_payload_with_inner_retry(int i, const uint8_t* data, int length, int i2, const uint8_t* key, int forward, uint8_t* payload);
+void whiteningInit(uint8_t val, uint8_t* ctx);
+void whiteningEncode(const uint8_t* data, int len, uint8_t* ctx, uint8_t* result);
+// whitens from a fresh LFSR seeded with seed, using the precomputed keystream
+// for FASTCON_WHITENING_SEED and the bitwise LFSR otherwise
+void whiteningEncodeSeed(uint8_t seed, const uint8_t* data, int len, uint8_t* result);
+uint8_t reverse_8(uint8_t d);
+uint16_t reverse_16(uint16_t d);
+uint16_t crc16(const uint8_t* addr, const uint8_t* data, uint8_t dataLength);
+uint8_t get_rf_payload(const uint8_t* addr, const uint8_t* data, uint8_t dataLength, uint8_t* rfPayload);
+uint8_t do_generate_command(int i, const uint8_t* data, uint8_t length, const uint8_t* key, int forward, int use_default_adapter, int i2, uint8_t* rfPayload);
+uint8_t getServiceData(uint8_t rfPayloadLength, const uint8_t* rfPayload, uint8_t* serviceData);
+
+// Encodes a command straight into the caller's frame. Returns false (with
+// frame.length 0) if the data doesn't fit.
+bool generate_frame(int i, const uint8_t* data, uint8_t length, const uint8_t* key, int forward, FastconFrame& frame);
+
+// Frame templates.
+//
+// Sending the same command again only changes its sequence number, and with
+// it the checksum byte, the CRC and the whitened bytes carrying them. The
+// checksum is a sum, and the CRC and the whitening are linear, so a frame
+// encoded once can be moved to a new sequence number by XORing deltas into
+// those four bytes: no re-encryption, CRC pass or whitening pass.
+struct FastconFrameTemplate {
+  FastconFrame frame;
+  uint8_t sequence; // the sequence number frame currently carries
+  uint8_t checksum; // its plain checksum byte
+};
+
+// where the payload and its CRC sit in a frame
+#define FASTCON_FRAME_PAYLOAD_OFFSET (3 + 4 + 0x12 + addrLength - FASTCON_RF_PAYLOAD_OFFSET)
+#define FASTCON_FRAME_CRC_OFFSET (FASTCON_FRAME_PAYLOAD_OFFSET + FASTCON_PAYLOAD_LENGTH)
+
+// Encodes a command like generate_frame() (taking the next sequence number),
+// keeping what patching needs. Returns false if the data doesn't fit.
+bool fastcon_make_template(int i, const uint8_t* data, uint8_t length, const uint8_t* key, int forward, FastconFrameTemplate& tmpl);
+// Moves the template's frame to sequence, byte for byte the frame a full
+// encode would give.
+void fastcon_patch_template(FastconFrameTemplate& tmpl, uint8_t sequence);
+// Takes the next sequence number, as generate_frame() would, and patches the
+// template's frame to it.
+const FastconFrame& fastcon_next_frame(FastconFrameTemplate& tmpl);
+
+// Inbound frames.
+//
+// Another controller's command (the BRmesh app, a remote, another bridge) is
+// heard as manufacturer data FASTCON_COMMAND_DATA_LENGTH bytes long: company
+// id F0 FF, then the whitened rf payload generate_frame() would build for it.
+#define FASTCON_COMMAND_DATA_LENGTH (2 + FASTCON_RF_PAYLOAD_LENGTH)
+
+enum FastconDecodeResult : uint8_t {
+  FASTCON_DECODE_OK,
+  FASTCON_DECODE_LENGTH,   // not the size of a FastCon frame
+  FASTCON_DECODE_HEADER,   // company id, rf header or address doesn't match
+  FASTCON_DECODE_CRC,
+  FASTCON_DECODE_KEY,      // encrypted with another key
+  FASTCON_DECODE_CHECKSUM,
+};
+
+// A decoded command: the arguments generate_frame() was called with.
+struct FastconCommand {
+  uint8_t type;     // i: 5 for light control, 2 for re-keying a light
+  uint8_t i2;
+  bool forward;
+  uint8_t sequence;
+  uint8_t data[FASTCON_MAX_DATA_LENGTH]; // zero padded
+};
+
+// The reverse of do_generate_command() and getServiceData(): de-whitens the
+// rf payload and checks its header, address and CRC, then decrypts the
+// payload with key and checks the safe key byte and the checksum. Rejects
+// foreign frames at the first check that fails; nothing touches the heap.
+FastconDecodeResult fastcon_decode_frame(const uint8_t* mData, uint8_t length, const uint8_t* key, FastconCommand& command);
+// just the payload stages (key and checksum), for a FASTCON_PAYLOAD_LENGTH
+// payload as package_ble_fastcon_body() builds it
+FastconDecodeResult fastcon_decode_payload(const uint8_t* payload, const uint8_t* key, FastconCommand& command);
+
+// A light's own advert (FASTCON_ADVERT_DATA_LENGTH bytes of manufacturer
+// data). These aren't whitened and carry no CRC: while a light is on the
+// default key its body holds its MAC, type and that key in the clear; once
+// paired, the body is encrypted with the mesh key and starts with the
+// light's number, followed by its state.
+struct FastconLightAdvert {
+  bool defaultKey;   // not paired yet, mac and type are set
+  uint8_t mac[6];
+  uint8_t type[2];
+  uint8_t number;    // paired: the light's number
+  uint8_t status[12]; // paired: the decrypted body, laid out like a single light command
+};
+
+FastconDecodeResult fastcon_decode_light_advert(const uint8_t* mData, uint8_t length, const uint8_t* key, FastconLightAdvert& advert);
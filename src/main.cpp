@@ -2,6 +2,7 @@
 #include "BLEUtils.h"
 #include "BLEServer.h"
 #include "BLEBeacon.h"
+#include "esp_gap_ble_api.h"
 #include <WiFi.h>
 #include <ESPAsyncWebServer.h>
 #include <ArduinoHA.h>
@@ -9,13 +10,91 @@
 #include <ArduinoJson.h>
 #include <String>
 #include <vector>
+#include <deque>
 #include <cstdio>
+#include <atomic>
+#include "mbedtls/md.h"
+#include "fastcon.h"
+#include "spsc_queue.h"
+#include "mac_table.h"
+#include "pairing_engine.h"
+#include "state_tracker.h"
+#include "binary_log.h"
+#include "metrics.h"
+#include "light_types.h"
+#include "frame_cache.h"
+#include "scene_planner.h"
+#include "transition_engine.h"
+#include "tx_scheduler.h"
+#include "bridge_coordinator.h"
 
 //////////////////////////////////////////////////////
 //CONFIGURATION
 //////////////////////////////////////////////////////
 // UUID 1 128-Bit (may use linux tool uuidgen or random numbers via https://www.uuidgenerator.net/)
 #define BEACON_UUID "d45ad7fa-f3f8-4405-857a-9d485e2ea35c"
+// how long each command frame is advertised for
+#define RADIO_ADVERTISE_MS 250
+// the scan for light status adverts: low duty when it only tracks state, and
+// higher in closed-loop mode ("radio": {"closedLoop": true} in config.json),
+// so a light's confirmation is heard within the command's window
+#define STATUS_SCAN_INTERVAL 320
+#define STATUS_SCAN_WINDOW 32
+#define CLOSED_LOOP_SCAN_INTERVAL 100
+#define CLOSED_LOOP_SCAN_WINDOW 50
+// light states heard in status adverts: a light's changes are published to
+// HA at most once per debounce period. The table is indexed by light number,
+// which is one byte, so it covers every light
+#define STATUS_QUEUE_LENGTH 64
+#define STATUS_DEBOUNCE_MS 1000
+#define TRACKED_LIGHTS 256
+// commands waiting for the radio task, per priority class; further commands
+// are dropped
+#define RADIO_QUEUE_LENGTH 32
+#define RADIO_TASK_STACK 4096
+#define RADIO_TASK_PRIORITY 2
+// encoded command frames kept for repeats, about 50 B each
+#define FRAME_CACHE_ENTRIES 32
+// fades run by the bridge: a step every other advert window, so a fade
+// leaves airtime for other commands
+#define TRANSITION_FRAME_MS 500
+#define TRANSITIONS 32
+// lights one scene message can set, and the MQTT buffer that has to hold it
+// (about 60 B a light)
+#define SCENE_MAX_LIGHTS 128
+#define MQTT_BUFFER_SIZE 4096
+// multiple bridges: how often each publishes its RSSI table, how long one
+// may go unheard before its lights fail over, how long a reading lasts, and
+// how far it must move to be published again, and how long a bridge keeps
+// sending for a light it lost (covering the heartbeat's trip through the
+// broker). A first boot waits this long for the registry before the leader
+// pairs lights with a new key.
+#define BRIDGE_HEARTBEAT_MS 5000
+#define BRIDGE_TIMEOUT_MS 15000
+#define BRIDGE_RSSI_TTL_MS 60000
+#define BRIDGE_RSSI_MARGIN_DB 6
+#define BRIDGE_HANDOVER_MS 2000
+#define MAX_BRIDGES 8
+#define BRIDGE_REGISTRY_WAIT_MS 10000
+// the registry's sealed mesh key (sealMeshKey())
+#define REGISTRY_NONCE_LENGTH 4
+#define REGISTRY_TAG_LENGTH 8
+// run the radio task on the same core as the Bluedroid host
+#ifdef CONFIG_BT_BLUEDROID_PINNED_TO_CORE
+#define RADIO_TASK_CORE CONFIG_BT_BLUEDROID_PINNED_TO_CORE
+#else
+#define RADIO_TASK_CORE 0
+#endif
+// the task that formats log records and writes them to Serial (log levels:
+// build with -DLOG_LEVEL=LOG_LEVEL_DEBUG for the frame dumps)
+#define LOG_TASK_STACK 3072
+#define LOG_TASK_PRIORITY 1
+#define LOG_TASK_CORE 0
+#define LOG_DRAIN_MS 10
+#define LOG_LINE_LENGTH 200
+// how often the optional HA diagnostic sensors ("metrics": {"haSensors": true})
+// are refreshed
+#define METRICS_SENSOR_INTERVAL_MS 60000
 //////////////////////////////////////////////////////
 //END
 //////////////////////////////////////////////////////
@@ -27,29 +106,99 @@ HADevice device;
 HAMqtt* mqtt;
 AsyncWebServer server(80);
 BLEAdvertising* pAdvertising;
-const uint8_t default_key[] = { 0x5e, 0x36, 0x7b, 0xc4 };
-struct LightType {
-  std::string name;
-  uint8_t code[2];
-};
-std::vector<LightType> lightTypes = {
-  {"Smart", {0x39, 0xae}}, // 44601 - AE39 - smart light
-  {"RGBW" , {0xa1, 0xa8}}, // 43169 - A8A1 - RGBW light
-  {"RGB"  , {0xa0, 0xa8}}, // 43168 - A8A0 - RGB light
-};
+// light models are in LIGHT_TYPES (light_types.h), whose features are HALight's
+static_assert((int)LIGHT_BRIGHTNESS == HALight::BrightnessFeature && (int)LIGHT_COLOR_TEMPERATURE == HALight::ColorTemperatureFeature
+              && (int)LIGHT_RGB == HALight::RGBFeature, "light features must match HALight's");
 #define BLESCAN_DURATION 5
+// new lights heard by the pairing scan, waiting for loop() to take them
+#define FOUND_QUEUE_LENGTH 32
+// group lights are assigned to at pairing time unless config.json says otherwise
+#define DEFAULT_GROUP 0x01
+// entities ArduinoHA can hold, the most its uint8_t count takes; it ignores
+// any over the cap, so the bridge keeps room for its own (the pair button,
+// the transition number, the diagnostic sensors) and for a group entity per
+// configured group, and refuses lights beyond what's left
+#define HA_MAX_ENTITIES 255
+#define HA_BRIDGE_ENTITIES 6
+// paired lights and the mesh key, restored at boot instead of re-pairing
+#define REGISTRY_FILE "/lights.json"
+// holding this button (BOOT on most dev boards) pairs any new lights
+#define PAIR_BUTTON_PIN 0
+// re-key frames: how long each is advertised, how long a light gets to
+// confirm before its frame is sent again, and how often it is tried
+#define PAIR_ADVERTISE_MS 150
+#define PAIR_CONFIRM_TIMEOUT_MS 1000
+#define PAIR_MAX_ATTEMPTS 3
+#define PAIR_BATCH_LENGTH 64
+// Wi-Fi: the access point and channel of the last connection are cached, so
+// a reboot can join without a channel scan; if that doesn't connect quickly
+// it falls back to a full scan, then to the config portal
+#define WIFI_CACHE_FILE "/wifi.json"
+#define WIFI_FAST_CONNECT_MS 3000
+#define WIFI_CONNECT_TIMEOUT_MS 10000
+// the config portal's access point, for the first setup
+#define PORTAL_SSID "ESP32-BRmesh"
+#define PORTAL_PASSWORD "assistant123"
+// the login the config pages and /metrics ask for on the LAN: "web" in
+// config.json, with a random password made at the first boot if it's empty
+#define WEB_USERNAME "admin"
+#define WEB_PASSWORD_LENGTH 12
+// HA ids are the last two bytes of the BLE address, as 4 hex digits
+#define LIGHT_ID_LENGTH 8
+#define LIGHT_NAME_LENGTH 16
+// A light found by a scan or restored from the registry. Fixed size and
+// without heap of its own: the advert it was found in isn't kept, so the
+// light's only other memory is its HA entity.
 struct LightDevice {
-  BLEAdvertisedDevice device;
+  HALight* light;
+  uint8_t address[6];         // BLE address, in BLEAddress::getNative() order
+  uint8_t mac[6];             // MAC as sent in the light's advert, used to re-key it
   uint8_t type[2];
+  uint8_t model;              // LIGHT_TYPES index for type, set with the entity
+  uint8_t number;
+  uint8_t group = DEFAULT_GROUP;
   bool isRegistered = false;
-  std::string id;
-  HALight* light;
+  char id[LIGHT_ID_LENGTH];   // HA unique id
+  char name[LIGHT_NAME_LENGTH];
+
+  const LightTraits& traits() const { return light_traits(model); }
+};
+// deques, as HALight keeps pointers to the id and name, which must stay put
+// when lights are added after boot
+std::deque<LightDevice> myLights;
+// a FastCon group, controlled through one HA light entity with a single
+// group-addressed frame
+struct LightGroup {
+  uint8_t id;
   std::string name;
-  uint8_t number;
+  std::string uniqueId;
+  HALight* light;
+  uint8_t features;
+  uint8_t model; // its frames reach every member, so they use one member's layout
+};
+std::deque<LightGroup> myGroups;
+// BLE address -> myLights index, for the scan callbacks
+#define KNOWN_LIGHTS_CAPACITY 512
+MacTable<KNOWN_LIGHTS_CAPACITY> knownLights;
+// lights being re-keyed by addLights()
+PairingEngine<PAIR_BATCH_LENGTH> pairing;
+// which bridge transmits for each light, by light number; on its own, a
+// bridge owns every light
+BridgeCoordinator<MAX_BRIDGES, 256> coordinator(BRIDGE_TIMEOUT_MS, BRIDGE_RSSI_TTL_MS, BRIDGE_RSSI_MARGIN_DB, BRIDGE_HANDOVER_MS);
+// The HA entity for a light or group. It carries a pointer to its registry
+// entry, so command callbacks get from the sender to the light without a
+// lookup (the deques above never move their elements).
+class MeshLight : public HALight {
+public:
+  MeshLight(const char* uniqueId, uint8_t features, LightDevice* device, LightGroup* group)
+    : HALight(uniqueId, features), device(device), group(group) {}
+  LightDevice* const device; // NULL for a group
+  LightGroup* const group;   // NULL for a single light
+
+  // publishes the discovery config and state of an entity created while
+  // MQTT is already connected; HAMqtt announces the others when it connects
+  void announce() { onMqttConnected(); }
 };
-std::vector<LightDevice> myLights;
-#define BUFFER_SIZE 200
-char str_buffer[BUFFER_SIZE];
 BLEScan* pBLEScan;
 const int ledPin = 2;
 
@@ -66,29 +215,68 @@ struct MQTTConfig {
     std::string password;
 };
 
+// a user defined light group, assigned to lights when they're paired
+struct GroupConfig {
+    uint8_t id;
+    std::string name;
+    std::vector<std::string> lights; // light ids, as used for the HA entities
+};
+
+struct RadioConfig {
+    bool closedLoop; // stop a command's advertisement once the light reports its new state
+    bool trackState; // publish state changes heard from the lights (app, remotes, missed commands)
+    uint16_t airtimeBudgetMs; // ms a second the bridge may advertise, on/off aside (1000: no limit)
+    uint16_t maxLatencyMs;    // longest a command waits behind higher priority ones
+};
+
+struct MetricsConfig {
+    bool haSensors; // publish a few of the /metrics values as HA diagnostic sensors
+};
+
+// several bridges sharing one mesh, each transmitting for the lights it
+// hears best
+struct BridgesConfig {
+    bool enabled;
+    std::string meshId; // the same on every bridge: names the shared HA device and MQTT topics
+    std::string secret; // the same on every bridge: seals the mesh key in the registry topics
+};
+
+struct WebConfig {
+    std::string username;
+    std::string password;
+};
+
 struct AppConfig {
     WiFiConfig wifi;
     MQTTConfig mqtt;
+    WebConfig web;
+    RadioConfig radio;
+    MetricsConfig metrics;
+    BridgesConfig bridges;
+    std::vector<GroupConfig> groups;
 };
 
 AppConfig appConfig;  
+// held while appConfig's Wi-Fi and MQTT settings or config.json are read or
+// written, which the web server's task does too
+SemaphoreHandle_t configMutex = NULL;
 
 bool loadConfig(const char *filename, AppConfig &config) {
     if (!LittleFS.begin(true)) {
-        Serial.printf("Failed to mount LittleFS.\n");
+        LOG_ERROR("Failed to mount LittleFS");
         return false;
     }
 
     File file = LittleFS.open(filename, "r");
     if (!file) {
-        Serial.printf("Failed to open config file.\n");
+        LOG_ERROR("Failed to open config file");
         return false;
     }
 
     JsonDocument doc;; // Adjust size as needed
     DeserializationError error = deserializeJson(doc, file);
     if (error) {
-        Serial.printf("Failed to parse config file: %s\n", error.c_str());
+        LOG_ERROR("Failed to parse config file: %s", error.c_str());
         return false;
     }
 
@@ -102,6 +290,39 @@ bool loadConfig(const char *filename, AppConfig &config) {
     config.mqtt.username = doc["mqtt"]["username"] | "";
     config.mqtt.password = doc["mqtt"]["password"] | "";
 
+    // Load the login for the web pages
+    config.web.username = doc["web"]["username"] | WEB_USERNAME;
+    config.web.password = doc["web"]["password"] | "";
+
+    // Load radio options
+    config.radio.closedLoop = doc["radio"]["closedLoop"] | false;
+    config.radio.trackState = doc["radio"]["trackState"] | true;
+    config.radio.airtimeBudgetMs = doc["radio"]["airtimeBudgetMs"] | 800;
+    config.radio.maxLatencyMs = doc["radio"]["maxLatencyMs"] | 2000;
+    config.metrics.haSensors = doc["metrics"]["haSensors"] | false;
+    config.bridges.enabled = doc["bridges"]["enabled"] | false;
+    config.bridges.meshId = doc["bridges"]["meshId"] | "brmesh";
+    config.bridges.secret = doc["bridges"]["secret"] | "";
+
+    // Load light groups
+    config.groups.clear();
+    for (JsonObject groupDoc : doc["groups"].as<JsonArray>()) {
+        GroupConfig group;
+        group.id = groupDoc["id"] | 0;
+        group.name = groupDoc["name"] | "";
+        for (JsonVariant light : groupDoc["lights"].as<JsonArray>()) {
+            // as lightIdFromAddress() writes them, lowercase
+            std::string id = light.as<std::string>();
+            for (char& c : id) c = tolower(c);
+            group.lights.push_back(id);
+        }
+        if (group.id == 0 || group.id == DEFAULT_GROUP) {
+            LOG_WARN("Ignoring group with reserved id %d", group.id);
+            continue;
+        }
+        config.groups.push_back(group);
+    }
+
     file.close();
     return true;
 }
@@ -110,7 +331,7 @@ bool loadConfig(const char *filename, AppConfig &config) {
 bool saveConfig(const char *filename, const AppConfig &config) {
     File file = LittleFS.open(filename, "w");
     if (!file) {
-        Serial.println("Failed to open config file for writing");
+        LOG_ERROR("Failed to open config file for writing");
         return false;
     }
 
@@ -121,9 +342,27 @@ bool saveConfig(const char *filename, const AppConfig &config) {
     doc["mqtt"]["port"] = config.mqtt.port;
     doc["mqtt"]["username"] = config.mqtt.username;
     doc["mqtt"]["password"] = config.mqtt.password;
+    doc["web"]["username"] = config.web.username;
+    doc["web"]["password"] = config.web.password;
+    doc["radio"]["closedLoop"] = config.radio.closedLoop;
+    doc["radio"]["trackState"] = config.radio.trackState;
+    doc["radio"]["airtimeBudgetMs"] = config.radio.airtimeBudgetMs;
+    doc["radio"]["maxLatencyMs"] = config.radio.maxLatencyMs;
+    doc["metrics"]["haSensors"] = config.metrics.haSensors;
+    doc["bridges"]["enabled"] = config.bridges.enabled;
+    doc["bridges"]["meshId"] = config.bridges.meshId;
+    doc["bridges"]["secret"] = config.bridges.secret;
+    JsonArray groups = doc["groups"].to<JsonArray>();
+    for (const GroupConfig& group : config.groups) {
+        JsonObject groupDoc = groups.add<JsonObject>();
+        groupDoc["id"] = group.id;
+        groupDoc["name"] = group.name;
+        JsonArray lights = groupDoc["lights"].to<JsonArray>();
+        for (const std::string& light : group.lights) lights.add(light);
+    }
 
     if (serializeJson(doc, file) == 0) {
-        Serial.println("Failed to write to config file");
+        LOG_ERROR("Failed to write to config file");
         file.close();
         return false;
     }
@@ -132,723 +371,2785 @@ bool saveConfig(const char *filename, const AppConfig &config) {
     return true;
 }
 
-void setupConfigPortal(AppConfig &config) {
-    WiFi.mode(WIFI_AP);
-    WiFi.softAP("ESP32-BRmesh", "assistant123"); // AP name and password
-    Serial.println("Access Point started");
-
-    Serial.printf("Loaded Configuration: Wi-Fi SSID: %s, MQTT Broker: %s\n",
-                  config.wifi.ssid.c_str(), config.mqtt.broker.c_str());
+// set by /save once the new config.json is written; loop() applies it
+std::atomic<bool> configSaved{false};
+
+// On the LAN anyone can reach the web pages, so there they ask for the
+// login in config.json; the portal's own access point already takes its
+// password.
+bool portalAuthenticated(AsyncWebServerRequest *request, bool requireLogin) {
+    if (!requireLogin) return true;
+    xSemaphoreTake(configMutex, portMAX_DELAY);
+    std::string username = appConfig.web.username;
+    std::string password = appConfig.web.password;
+    xSemaphoreGive(configMutex);
+    if (!password.empty() && request->authenticate(username.c_str(), password.c_str())) return true;
+    request->requestAuthentication();
+    return false;
+}
 
+// The config pages. Served by the AP mode portal for the first setup, and
+// next to /metrics once connected, behind a login, where a save is applied
+// without a restart. Passwords are never sent back: an empty password
+// field keeps the current one.
+void addPortalRoutes(AppConfig &config, bool requireLogin) {
     // Serve HTML form
-    server.on("/", HTTP_GET, [](AsyncWebServerRequest *request) {
+    server.on("/", HTTP_GET, [requireLogin](AsyncWebServerRequest *request) {
+        if (!portalAuthenticated(request, requireLogin)) return;
         request->send(LittleFS, "/index.html", "text/html");
     });
 
     // Serve JSON config
-    server.on("/config", HTTP_GET, [&config](AsyncWebServerRequest *request) {
+    server.on("/config", HTTP_GET, [&config, requireLogin](AsyncWebServerRequest *request) {
+        if (!portalAuthenticated(request, requireLogin)) return;
         String response;
         JsonDocument jsonDoc;
     
         // Map AppConfig to JsonDocument
-        jsonDoc["wifi"]["ssid"] = config.wifi.ssid.empty() ? "Unknown" : config.wifi.ssid.c_str();
-        jsonDoc["wifi"]["password"] = config.wifi.password.empty() ? "Unknown" : config.wifi.password.c_str();
-        jsonDoc["mqtt"]["broker"] = config.mqtt.broker.empty() ? "0.0.0.0" : config.mqtt.broker.c_str();
+        xSemaphoreTake(configMutex, portMAX_DELAY);
+        jsonDoc["wifi"]["ssid"] = config.wifi.ssid.c_str();
+        jsonDoc["wifi"]["password"] = "";
+        jsonDoc["mqtt"]["broker"] = config.mqtt.broker.c_str();
         jsonDoc["mqtt"]["port"] = config.mqtt.port;
-        jsonDoc["mqtt"]["username"] = config.mqtt.username.empty() ? "guest" : config.mqtt.username.c_str();
-        jsonDoc["mqtt"]["password"] = config.mqtt.password.empty() ? "guest" : config.mqtt.password.c_str();
+        jsonDoc["mqtt"]["username"] = config.mqtt.username.c_str();
+        jsonDoc["mqtt"]["password"] = "";
+        jsonDoc["web"]["username"] = config.web.username.c_str();
+        jsonDoc["web"]["password"] = "";
+        xSemaphoreGive(configMutex);
 
         serializeJson(jsonDoc, response);
         request->send(200, "application/json", response);
     });
 
-    server.on("/save", HTTP_POST, [&config](AsyncWebServerRequest *request) {
+    // runs on the web server's task, so it works on a copy and leaves
+    // applying it to loop()
+    server.on("/save", HTTP_POST, [&config, requireLogin](AsyncWebServerRequest *request) {
+        if (!portalAuthenticated(request, requireLogin)) return;
+        xSemaphoreTake(configMutex, portMAX_DELAY);
+        AppConfig updated = config;
+        xSemaphoreGive(configMutex);
         // Handle Wi-Fi settings
         if (request->hasParam("wifi_ssid", true)) {
-            config.wifi.ssid = request->getParam("wifi_ssid", true)->value().c_str();
+            updated.wifi.ssid = request->getParam("wifi_ssid", true)->value().c_str();
         }
-        if (request->hasParam("wifi_password", true)) {
-            config.wifi.password = request->getParam("wifi_password", true)->value().c_str();
+        if (request->hasParam("wifi_password", true) && !request->getParam("wifi_password", true)->value().isEmpty()) {
+            updated.wifi.password = request->getParam("wifi_password", true)->value().c_str();
         }
 
         // Handle MQTT settings
         if (request->hasParam("mqtt_broker", true)) {
-            config.mqtt.broker = request->getParam("mqtt_broker", true)->value().c_str();
+            updated.mqtt.broker = request->getParam("mqtt_broker", true)->value().c_str();
         }
         if (request->hasParam("mqtt_port", true)) {
-            config.mqtt.port = request->getParam("mqtt_port", true)->value().toInt();
+            updated.mqtt.port = request->getParam("mqtt_port", true)->value().toInt();
         }
         if (request->hasParam("mqtt_username", true)) {
-            config.mqtt.username = request->getParam("mqtt_username", true)->value().c_str();
+            updated.mqtt.username = request->getParam("mqtt_username", true)->value().c_str();
         }
-        if (request->hasParam("mqtt_password", true)) {
-            config.mqtt.password = request->getParam("mqtt_password", true)->value().c_str();
+        if (request->hasParam("mqtt_password", true) && !request->getParam("mqtt_password", true)->value().isEmpty()) {
+            updated.mqtt.password = request->getParam("mqtt_password", true)->value().c_str();
+        }
+
+        // Handle the web login
+        if (request->hasParam("web_username", true) && !request->getParam("web_username", true)->value().isEmpty()) {
+            updated.web.username = request->getParam("web_username", true)->value().c_str();
+        }
+        if (request->hasParam("web_password", true) && !request->getParam("web_password", true)->value().isEmpty()) {
+            updated.web.password = request->getParam("web_password", true)->value().c_str();
         }
 
         // Save the updated config
-        if (saveConfig("/config.json", config)) {
-            request->send(200, "text/plain", "Configuration Saved. Restarting...");
-            Serial.println("Configuration Saved. Restarting...");
-            delay(1000);
-            ESP.restart(); // Restart to apply new settings
+        xSemaphoreTake(configMutex, portMAX_DELAY);
+        bool saved = saveConfig("/config.json", updated);
+        xSemaphoreGive(configMutex);
+        if (saved) {
+            request->send(200, "text/plain", "Configuration saved, applying it.");
+            LOG_INFO("Configuration saved");
+            configSaved = true;
         } else {
             request->send(500, "text/plain", "Failed to save configuration");
-            Serial.println("Failed to save configuration");
+            LOG_ERROR("Failed to save configuration");
         }
     });
+}
+
+bool portalRoutesAdded = false;
+
+void setupConfigPortal(AppConfig &config) {
+    WiFi.mode(WIFI_AP);
+    WiFi.softAP(PORTAL_SSID, PORTAL_PASSWORD);
+    LOG_INFO("Access Point started");
 
+    LOG_INFO("Loaded Configuration: Wi-Fi SSID: %s, MQTT Broker: %s",
+             config.wifi.ssid.c_str(), config.mqtt.broker.c_str());
 
+    if (!portalRoutesAdded) addPortalRoutes(config, false);
+    portalRoutesAdded = true;
     server.begin();
 }
 
-void connectToWiFi(const WiFiConfig &wifiConfig) {
-    if (wifiConfig.ssid.empty() || wifiConfig.password.empty()) {
-        Serial.println("Wi-Fi configuration is empty. Starting Config Portal.");
-        return;
-    }
+//////////////////////////////////////////////////////
+// Boot
+//
+// Wi-Fi, MQTT and BLE pairing come up side by side: setup() only starts
+// them, and loop() (or pairing, while it waits on the radio) polls each one
+// along. Each phase's time since boot is logged and served on /metrics.
+//////////////////////////////////////////////////////
+
+enum BootPhase {
+  BOOT_CONFIG,      // config.json loaded
+  BOOT_BLE,         // BLE up
+  BOOT_WIFI,        // associated, with an IP address
+  BOOT_MQTT,        // connected to the broker
+  BOOT_LIGHTS,      // lights restored from the registry, or the first boot's pairing done
+  BOOT_FIRST_LIGHT, // a light's entity is announced and takes commands
+  BOOT_PHASES
+};
+const char* const bootPhaseNames[BOOT_PHASES] = { "config", "ble", "wifi", "mqtt", "lights", "first_light" };
+uint32_t bootPhaseAt[BOOT_PHASES]; // millis(), 0 until reached
 
-    Serial.printf("Connecting to Wi-Fi: %s\n", wifiConfig.ssid.c_str());
-    WiFi.begin(wifiConfig.ssid.c_str(), wifiConfig.password.c_str());
+void bootPhase(BootPhase phase)
+{
+  if (bootPhaseAt[phase]) return;
+  bootPhaseAt[phase] = millis() | 1;
+  LOG_INFO("Boot: %s after %u ms", bootPhaseNames[phase], (unsigned)bootPhaseAt[phase]);
+}
 
-    unsigned long startAttemptTime = millis();
-    while (WiFi.status() != WL_CONNECTED) {
-        delay(500);
-        Serial.print(".");
+enum WiFiState {
+  WIFI_IDLE,
+  WIFI_FAST_CONNECTING, // to the cached access point and channel
+  WIFI_CONNECTING,      // with a full scan
+  WIFI_CONNECTED,       // the Wi-Fi driver reconnects by itself from here
+  WIFI_FAILED,
+  WIFI_PORTAL,          // gave up, the config portal is running
+};
 
-        // Timeout after 10 seconds
-        if (millis() - startAttemptTime > 10000) {
-            Serial.println("\nFailed to connect to Wi-Fi within the timeout period.");
-            break;
-        }
-    }
+struct WiFiLink {
+  WiFiState state = WIFI_IDLE;
+  uint32_t startedAt = 0;
+  const WiFiConfig* config = NULL;
+  char ssid[33];       // config->ssid, for the deferred log
+  uint8_t bssid[6];
+  int32_t channel = 0; // 0: nothing cached
+  // the settings a live change replaced, while they're the last that worked
+  WiFiConfig previous;
+  bool hasPrevious = false;
+};
+WiFiLink wifiLink;
 
-    if (WiFi.status() == WL_CONNECTED) {
-        Serial.printf("\nConnected to Wi-Fi! IP Address: %s\n", WiFi.localIP().toString().c_str());
-    }
+// the access point of the last connection to this SSID, if any
+void loadWiFiCache(const WiFiConfig& wifiConfig)
+{
+  File file = LittleFS.open(WIFI_CACHE_FILE, "r");
+  if (!file) return;
+  JsonDocument doc;
+  DeserializationError error = deserializeJson(doc, file);
+  file.close();
+  if (error || wifiConfig.ssid != (doc["ssid"] | "")) return;
+  std::string bssid = doc["bssid"] | "";
+  uint8_t* b = wifiLink.bssid;
+  if (sscanf(bssid.c_str(), "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6) return;
+  wifiLink.channel = doc["channel"] | 0;
 }
 
+// remembers the access point just joined, if it isn't the cached one
+void saveWiFiCache(const WiFiConfig& wifiConfig)
+{
+  const uint8_t* bssid = WiFi.BSSID();
+  int32_t channel = WiFi.channel();
+  if (!bssid || (channel == wifiLink.channel && memcmp(bssid, wifiLink.bssid, 6) == 0)) return;
+  memcpy(wifiLink.bssid, bssid, 6);
+  wifiLink.channel = channel;
+  File file = LittleFS.open(WIFI_CACHE_FILE, "w");
+  if (!file) {
+    LOG_ERROR("Failed to open Wi-Fi cache for writing");
+    return;
+  }
+  char address[18];
+  snprintf(address, sizeof(address), "%02x:%02x:%02x:%02x:%02x:%02x",
+           bssid[0], bssid[1], bssid[2], bssid[3], bssid[4], bssid[5]);
+  JsonDocument doc;
+  doc["ssid"] = wifiConfig.ssid;
+  doc["bssid"] = address;
+  doc["channel"] = channel;
+  serializeJson(doc, file);
+  file.close();
+}
 
+// starts joining the network; pollWiFi() follows it up
+void startWiFi(const WiFiConfig &wifiConfig) {
+    wifiLink.config = &wifiConfig;
+    wifiLink.startedAt = millis();
+    snprintf(wifiLink.ssid, sizeof(wifiLink.ssid), "%s", wifiConfig.ssid.c_str());
+    if (wifiConfig.ssid.empty() || wifiConfig.password.empty()) {
+        LOG_WARN("Wi-Fi configuration is empty. Starting Config Portal.");
+        wifiLink.state = WIFI_FAILED;
+        return;
+    }
 
-bool doesStringMatchBytes(std::string str, const u_int8_t* bytes) {
-  bool result = true;
-  for (int i = 0; i < str.length(); i++) {
-    if (str[i] != bytes[i]) {
-      result = false;
-      break;
+    WiFi.mode(WIFI_STA);
+    loadWiFiCache(wifiConfig);
+    if (wifiLink.channel) {
+        LOG_INFO("Connecting to Wi-Fi: %s (cached channel %d)", wifiLink.ssid, wifiLink.channel);
+        WiFi.begin(wifiConfig.ssid.c_str(), wifiConfig.password.c_str(), wifiLink.channel, wifiLink.bssid);
+        wifiLink.state = WIFI_FAST_CONNECTING;
+    } else {
+        LOG_INFO("Connecting to Wi-Fi: %s", wifiLink.ssid);
+        WiFi.begin(wifiConfig.ssid.c_str(), wifiConfig.password.c_str());
+        wifiLink.state = WIFI_CONNECTING;
     }
-  }
-  return result;
 }
 
-uint8_t SEND_SEQ = 0;
-uint8_t SEND_COUNT = 1;
-const uint8_t DEFAULT_BLE_FASTCON_ADDRESS[] = { 0xC1, 0xC2, 0xC3 };
-const uint8_t addrLength = 3;
-
-void dump(const uint8_t* data, int length)
+// moves the connection along without blocking; if the network can't be
+// joined, goes back to the settings a live change replaced, and failing
+// those (or at boot) to the config portal
+void pollWiFi()
 {
-  for (int i = 0; i < length; i++)
-  {
-    Serial.printf("%2.2X", data[i]);
+  const WiFiConfig& wifiConfig = *wifiLink.config;
+  uint32_t elapsed = millis() - wifiLink.startedAt;
+  switch (wifiLink.state) {
+    case WIFI_FAST_CONNECTING:
+    case WIFI_CONNECTING:
+      if (WiFi.status() == WL_CONNECTED) {
+        wifiLink.state = WIFI_CONNECTED;
+        wifiLink.hasPrevious = false;
+        bootPhase(BOOT_WIFI);
+        IPAddress ip = WiFi.localIP();
+        LOG_INFO("Connected to Wi-Fi! IP Address: %u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+        saveWiFiCache(wifiConfig);
+      } else if (wifiLink.state == WIFI_FAST_CONNECTING && elapsed > WIFI_FAST_CONNECT_MS) {
+        LOG_INFO("Cached access point didn't answer, scanning");
+        WiFi.disconnect();
+        WiFi.begin(wifiConfig.ssid.c_str(), wifiConfig.password.c_str());
+        wifiLink.state = WIFI_CONNECTING;
+      } else if (elapsed > WIFI_CONNECT_TIMEOUT_MS) {
+        LOG_WARN("Failed to connect to Wi-Fi within the timeout period.");
+        wifiLink.state = WIFI_FAILED;
+      }
+      break;
+    case WIFI_FAILED:
+      if (wifiLink.hasPrevious) {
+        LOG_WARN("New Wi-Fi settings failed, going back to the previous ones");
+        wifiLink.hasPrevious = false;
+        xSemaphoreTake(configMutex, portMAX_DELAY);
+        appConfig.wifi = wifiLink.previous;
+        bool saved = saveConfig("/config.json", appConfig);
+        xSemaphoreGive(configMutex);
+        if (!saved) LOG_ERROR("Failed to save the previous Wi-Fi settings");
+        WiFi.disconnect();
+        startWiFi(appConfig.wifi);
+        break;
+      }
+      LOG_WARN("Wi-Fi connection failed. Starting Config Portal.");
+      setupConfigPortal(appConfig); // Fallback to AP mode
+      wifiLink.state = WIFI_PORTAL;
+      break;
+    default:
+      break;
   }
 }
 
-void dump(std::string str)
+//////////////////////////////////////////////////////
+// Logging
+//
+// Log statements (LOG_INFO etc. from binary_log.h) only copy their arguments
+// into a ring buffer; a low priority task formats them and does the slow
+// write to Serial, so the MQTT callbacks, the radio task and the scan
+// callbacks never wait on the UART. Statements above LOG_LEVEL compile to
+// nothing.
+//////////////////////////////////////////////////////
+
+LogRing<LOG_RING_LENGTH> logRing;
+
+uint32_t log_clock()
 {
-  for (int i = 0; i < str.size(); i++)
-  {
-    Serial.printf("%2.2X", str[i]);
-  }
+  return micros();
 }
 
-uint8_t package_ble_fastcon_body(int i, int i2, uint8_t sequence, uint8_t safe_key, int forward, const uint8_t* data, int length, const uint8_t* key, uint8_t*& payload)
+void logTaskLoop(void* parameter)
 {
-  if (length > 12)
-  {
-    Serial.print("data too long");
-    payload = 0;
-    return 0;
-  }
-  uint8_t payloadLength = 4 + 12;
-  payload = (uint8_t*)malloc(payloadLength);
-  payload[0] = (i2 & 0b1111) << 0 | (i & 0b111) << 4 | (forward & 0xff) << 7;
-  payload[1] = sequence & 0xff;
-  payload[2] = safe_key;
-  payload[3] = 0; // checksum
-  // fill payload with zeros
-  for (int j = 4; j < payloadLength; j++) payload[j]=0;
-  memcpy(payload + 4, data, length);
-
-  uint8_t checksum = 0;
-  for (int j = 0; j < length + 4; j++)
-  {
-    if (j == 3) continue;
-    checksum = (checksum + payload[j]) & 0xff;
-  }
-  payload[3] = checksum;
-  for (int j = 0; j < 4; j++) {
-    payload[j] = default_key[j & 3] ^ payload[j];
-  }
-  for (int j = 0; j < 12; j++) {
-    payload[4 + j] = key[j & 3] ^ payload[4 + j];
-  }
-  return payloadLength;
-}
-
-uint8_t get_payload_with_inner_retry(int i, const uint8_t* data, int length, int i2, const uint8_t* key, int forward, uint8_t*& payload) {
-  SEND_COUNT++;
-  SEND_SEQ = SEND_COUNT;
-  Serial.print("data: "); dump(data, length); Serial.print("\n");
-  Serial.print("key: "); dump(key, 4); Serial.print("\n");
-  Serial.printf("sequence: %d\n", SEND_SEQ);
-  uint8_t safe_key = 0xff;
-  bool hasKey = false;
-  for (int i = 0; i < 4; i++) {
-    if (key[i] != 0) {
-      hasKey = true;
-      break;
+  LogRecord record;
+  char line[LOG_LINE_LENGTH];
+  uint32_t dropped = 0;
+  for (;;) {
+    while (logRing.pop(record)) {
+      size_t length = log_format(record, line, sizeof(line) - 1);
+      line[length++] = '\n';
+      Serial.write((const uint8_t*)line, length);
     }
-  }
-  if (hasKey) safe_key = key[3];
-  uint8_t result = package_ble_fastcon_body(i, i2, SEND_SEQ, safe_key, forward, data, length, key, payload);
-  if (!hasKey) {
-    // set the data content to the default key
-    for (int i = 4; i < 16; i++) {
-      payload[i] = default_key[i & 3];
+    if (logRing.dropped() != dropped) {
+      dropped = logRing.dropped();
+      Serial.printf("Log buffer full, %u records dropped so far\n", dropped);
     }
+    vTaskDelay(pdMS_TO_TICKS(LOG_DRAIN_MS));
   }
-  return result;
 }
 
-void whiteningInit(uint8_t val, uint8_t* ctx)
+void startLogTask()
 {
-  ctx[0] = 1;
-  ctx[1] = (val >> 5) & 1;
-  ctx[2] = (val >> 4) & 1;
-  ctx[3] = (val >> 3) & 1;
-  ctx[4] = (val >> 2) & 1;
-  ctx[5] = (val >> 1) & 1;
-  ctx[6] = val & 1;
+  xTaskCreatePinnedToCore(logTaskLoop, "log", LOG_TASK_STACK, NULL, LOG_TASK_PRIORITY, NULL, LOG_TASK_CORE);
 }
 
-void whiteningEncode(const uint8_t* data, int len, uint8_t* ctx, uint8_t* result)
+void dumpFrameStage(const char* label, const uint8_t* data, int length)
 {
-  memcpy(result, data, len);
-  for (int i = 0; i < len; i++) {
-    int ctx3 = ctx[3];
-    int ctx5 = ctx[5];
-    int ctx6 = ctx[6];
-    int ctx4 = ctx[4];
-    int ctx52 = ctx5 ^ ctx[2];
-    int ctx41 = ctx4 ^ ctx[1];
-    int ctx63 = ctx6 ^ ctx3;
-    int ctx630 = ctx63 ^ ctx[0];
+  LOG_DEBUG_HEX(data, length, "%s: ", label);
+}
+
+//////////////////////////////////////////////////////
+// Metrics
+//
+// Histograms and counters (metrics.h) updated with relaxed atomics from the
+// radio task, the loop task and the scan callbacks, and rendered on demand
+// by the web server as a Prometheus page on /metrics.
+//////////////////////////////////////////////////////
 
-    int c = result[i];
-    result[i] = ((c & 0x80) ^ ((ctx52 ^ ctx6) << 7))
-      + ((c & 0x40) ^ (ctx630 << 6))
-      + ((c & 0x20) ^ (ctx41 << 5))
-      + ((c & 0x10) ^ (ctx52 << 4))
-      + ((c & 0x08) ^ (ctx63 << 3))
-      + ((c & 0x04) ^ (ctx4 << 2))
-      + ((c & 0x02) ^ (ctx5 << 1))
-      + ((c & 0x01) ^ (ctx6 << 0));
+const uint32_t commandLatencyBoundsMs[] = { 1, 2, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000 };
+const uint32_t encodeBoundsUs[] = { 25, 50, 100, 200, 400, 800, 1600, 3200 };
+const uint32_t advertiseBoundsMs[] = { 10, 25, 50, 100, 150, 200, 250, 300, 500 };
+const uint32_t sceneBoundsMs[] = { 250, 500, 1000, 2000, 4000, 8000, 16000, 32000 };
 
-    ctx[2] = ctx41;
-    ctx[3] = ctx52;
-    ctx[4] = ctx52 ^ ctx3;
-    ctx[5] = ctx630 ^ ctx4;
-    ctx[6] = ctx41 ^ ctx5;
-    ctx[0] = ctx52 ^ ctx6;
-    ctx[1] = ctx630;
-  }
+// commands for one light or group; id is its HA unique id, set when its
+// entity is created
+struct CommandCounter {
+  const char* id;
+  std::atomic<uint32_t> commands{0};
+};
+
+struct Metrics {
+  Histogram<12> commandLatencyMs{commandLatencyBoundsMs}; // MQTT callback -> on air
+  Histogram<8> encodeUs{encodeBoundsUs};                  // encoding or patching a command frame
+  Histogram<9> advertiseMs{advertiseBoundsMs};            // a command frame's time on air
+  Histogram<8> sceneMs{sceneBoundsMs};                    // scene message -> last frame off air
+  Histogram<12> txWaitMs[TX_CLASSES] = {                  // queued -> taken by the radio task, per class
+    Histogram<12>{commandLatencyBoundsMs}, Histogram<12>{commandLatencyBoundsMs},
+    Histogram<12>{commandLatencyBoundsMs}, Histogram<12>{commandLatencyBoundsMs},
+  };
+  std::atomic<uint32_t> advertsSeen{0};
+  std::atomic<uint32_t> advertsAccepted{0};
+  std::atomic<uint32_t> pairingFrames{0};
+  std::atomic<uint32_t> pairingConfirmed{0};
+  std::atomic<uint32_t> pairingFailed{0};
+  std::atomic<uint32_t> scenes{0};
+  std::atomic<uint32_t> sceneLights{0}; // lights set by scenes
+  std::atomic<uint32_t> sceneFrames{0}; // frames they took
+  std::atomic<uint32_t> fades{0};
+  std::atomic<uint32_t> fadeFrames{0};
+  std::atomic<uint32_t> commandsLeftToOwner{0}; // commands another bridge sends
+  std::atomic<uint32_t> bridgesLive{1};
+  std::atomic<uint32_t> lightsOwned{0};         // lights this bridge transmits for
+  std::atomic<uint32_t> lightsRegistered{0};    // for /metrics, which can't walk myLights
+  CommandCounter lights[256]; // by light number
+  CommandCounter groups[256]; // by group id
+};
+Metrics metrics;
+
+// heap taken by the lights' HA entities, measured as each is created (other
+// tasks allocating meanwhile make it approximate)
+struct LightMemory {
+  uint32_t entities = 0;
+  uint32_t entityBytes = 0;
+};
+LightMemory lightMemory;
+
+// The frame already is the raw advertisement data, so hand it straight to the
+// GAP layer (which copies it) rather than rebuilding it as a std::string in a
+// BLEAdvertisementData.
+void setAdvertisingFrame(const FastconFrame& frame)
+{
+  esp_ble_gap_config_adv_data_raw((uint8_t*)frame.data, frame.length);
 }
 
-uint8_t reverse_8(uint8_t d)
+// the radio task's command frames; a repeated command is patched with the
+// next sequence number rather than encoded again
+FrameCache<FRAME_CACHE_ENTRIES> frameCache;
+
+// starts advertising a command frame, which the caller stops; returns the
+// micros() timestamp at which it went on air, or 0 if it couldn't be encoded
+uint32_t startCommandFrame(const uint8_t* key, const uint8_t* data)
 {
-  uint8_t result = 0;
-  for (uint8_t k = 0; k < 8; k++) {
-    result |= ((d >> k) & 1) << (7 - k);
-  }
-  return result;
+  uint32_t startedAt = micros();
+  const FastconFrame* frame = frameCache.frame(key, data);
+  if (!frame) return 0;
+  metrics.encodeUs.observe(micros() - startedAt);
+  setAdvertisingFrame(*frame);
+  pAdvertising->setMinInterval(50);
+  pAdvertising->setMaxInterval(50);
+  pAdvertising->start();
+  return micros();
+}
+
+// returns the micros() timestamp at which the frame went on air, or 0 if it
+// couldn't be encoded
+uint32_t single_control(const uint8_t* key, const uint8_t* data)
+{
+  uint32_t onAir = startCommandFrame(key, data);
+  if (onAir == 0) return 0;
+  delay(RADIO_ADVERTISE_MS);
+  pAdvertising->stop();
+  metrics.advertiseMs.observe((micros() - onAir) / 1000);
+  return onAir;
 }
 
-uint16_t reverse_16(uint16_t d) {
-  uint16_t result = 0;
-  for (uint8_t k = 0; k < 16; k++) {
-    result |= ((d >> k) & 1) << (15 - k);
+//////////////////////////////////////////////////////
+// Radio task
+//
+// MQTT callbacks run inside mqtt->loop(), so they only build the command
+// data and queue it. A task pinned to the Bluetooth core does the 250 ms
+// advertisement, then hands the command back through a second queue so the
+// loop task can report the new state to Home Assistant (ArduinoHA isn't
+// thread safe, so only the loop task touches it).
+//
+// The commands wait in the transmit scheduler (tx_scheduler.h), which sends
+// on/off before scenes before brightness and colour, bounds how long any of
+// them waits, and keeps advertising within the airtime budget. Pairing
+// transmits on its own, but waits for its turn there too.
+//
+// Brightness and colour commands are latest-wins: they wait in a per-light
+// slot and only a token for the slot goes through the queue, so a newer
+// value for the same light replaces one that hasn't been sent yet. On/off
+// commands always go through the queue in order.
+//////////////////////////////////////////////////////
+
+enum RadioCommandKind : uint8_t {
+  RADIO_STATE,
+  RADIO_BRIGHTNESS,
+  RADIO_COLOR_TEMPERATURE,
+  RADIO_RGB_COLOR,
+  RADIO_SCENE, // a frame of a scene, reported with the whole scene
+};
+
+struct RadioCommand {
+  HALight* sender;
+  RadioCommandKind kind;
+  uint8_t data[8];
+  // the value to report back to Home Assistant once sent
+  bool state;
+  uint8_t brightness;
+  uint16_t temperature;
+  HALight::RGBColor color;
+  uint32_t enqueuedAt; // micros()
+  uint32_t sentAt;     // micros(), 0 if the frame couldn't be encoded
+  uint32_t confirmedAt; // micros() the light reported the new state, 0 if it didn't (closed-loop mode)
+  int8_t slot;         // levelSlots index holding the command, -1 if it's inline
+  bool quiet;          // a step of a fade, not reported to HA
+};
+
+// One slot per light, opcode and kind with an unsent brightness or colour
+// command. A slot is pending from the moment its token is queued until the
+// radio task takes the command out. Every pending slot has a token in the
+// scheduler.
+struct LevelSlot {
+  bool pending;
+  // an on/off command, or a command of another kind for the same light, was
+  // queued behind this slot's token, so a newer value mustn't be merged into
+  // it (that would move it ahead of the later command)
+  bool sealed;
+  RadioCommand command;
+};
+
+struct RadioStats {
+  std::atomic<uint32_t> enqueued{0};
+  std::atomic<uint32_t> dropped{0};
+  std::atomic<uint32_t> sent{0};
+  std::atomic<uint32_t> maxQueueDepth{0};
+  std::atomic<uint32_t> lastLatencyUs{0};
+  std::atomic<uint32_t> maxLatencyUs{0};
+  std::atomic<uint32_t> totalLatencyMs{0};
+  std::atomic<uint32_t> coalesced{0};
+  // closed-loop mode
+  std::atomic<uint32_t> confirmed{0};      // commands stopped early by the light's status
+  std::atomic<uint32_t> unconfirmed{0};    // ran for the full window
+  std::atomic<uint32_t> airtimeMs{0};      // spent advertising commands
+  std::atomic<uint32_t> airtimeSavedMs{0}; // against the fixed window
+  std::atomic<uint32_t> totalConfirmMs{0}; // enqueued -> confirmed, summed
+};
+
+TxScheduler<RadioCommand, RADIO_QUEUE_LENGTH> txScheduler(1000, 2000); // loop -> radio task
+// held around txScheduler: a push walks and moves its queued frames, too
+// much to do with interrupts off
+SemaphoreHandle_t txMutex = NULL;
+SpscQueue<RadioCommand, RADIO_QUEUE_LENGTH> reportQueue; // radio task -> loop
+TaskHandle_t radioTask = NULL;
+// held while the advertiser is set up or sending a command, so pairing and
+// commands don't collide
+SemaphoreHandle_t radioMutex = NULL;
+// commands the radio task has put on the advertiser, so pairing, which
+// leaves it to them in between its own frames, knows to put its frame back
+std::atomic<uint32_t> radioTurns{0};
+RadioStats radioStats;
+LevelSlot levelSlots[RADIO_QUEUE_LENGTH];
+portMUX_TYPE levelSlotsLock = portMUX_INITIALIZER_UNLOCKED;
+
+// The command the radio task is waiting on the light's status for, in
+// closed-loop mode. The status scan callback matches adverts against it and
+// gives ackSemaphore when the light reports the new state.
+struct AckWait {
+  bool armed;
+  RadioCommand command;
+  uint32_t confirmedAt;
+};
+AckWait ackWait;
+portMUX_TYPE ackWaitLock = portMUX_INITIALIZER_UNLOCKED;
+SemaphoreHandle_t ackSemaphore = NULL;
+bool statusScanRunning = false;
+
+// a light's decoded status advert, from the status scan to loop()
+struct StatusReport {
+  uint8_t light;  // light number
+  int8_t rssi;    // what this bridge heard it at, for choosing the bridge that transmits
+  LightState state;
+};
+SpscQueue<StatusReport, STATUS_QUEUE_LENGTH> statusQueue;
+StateTracker<TRACKED_LIGHTS> lightStates;
+struct StatusStats {
+  std::atomic<uint32_t> heard{0};
+  std::atomic<uint32_t> dropped{0}; // statusQueue full
+  uint32_t changes = 0;
+  uint32_t published = 0;
+};
+StatusStats statusStats;
+
+// whether a light's decoded status advert (same layout as a single light
+// command: number, then level and colour) shows a command has been applied
+bool statusReflects(const RadioCommand& command, const uint8_t* status)
+{
+  uint8_t level = status[2] & 127;
+  switch (command.kind) {
+    case RADIO_STATE: return command.state ? level != 0 : level == 0;
+    case RADIO_BRIGHTNESS: return level == command.data[2];
+    case RADIO_COLOR_TEMPERATURE: return status[6] == command.data[6] && status[7] == command.data[7];
+    case RADIO_RGB_COLOR: return memcmp(status + 3, command.data + 3, 3) == 0;
+    case RADIO_SCENE: break;
   }
-  return result;
+  return false;
 }
 
-uint16_t crc16(const uint8_t* addr, const uint8_t* data, uint8_t dataLength)
+// closed-loop version of single_control(): advertises until the light
+// reports the new state or the fixed window runs out. Only single light
+// commands can be confirmed this way; a group has no one light to wait for.
+void sendUntilConfirmed(RadioCommand& command)
 {
-  uint16_t crc = 0xffff;
-  for (int8_t i = addrLength - 1; i >= 0; i--)
-  {
-    crc ^= addr[i] << 8;
-    for (uint8_t ii = 0; ii < 4; ii++) {
-      uint16_t tmp = crc << 1;
-      if ((crc & 0x8000) != 0) tmp ^= 0x1021;
-      crc = tmp << 1;
-      if ((tmp & 0x8000) != 0) crc ^= 0x1021;
-    }
+  portENTER_CRITICAL(&ackWaitLock);
+  ackWait.command = command;
+  ackWait.armed = true;
+  portEXIT_CRITICAL(&ackWaitLock);
+  xSemaphoreTake(ackSemaphore, 0); // drop a give that raced the last disarm
+  command.sentAt = startCommandFrame(my_key, command.data);
+  if (command.sentAt == 0) {
+    portENTER_CRITICAL(&ackWaitLock);
+    ackWait.armed = false;
+    portEXIT_CRITICAL(&ackWaitLock);
+    return;
   }
-  for (uint8_t i = 0; i < dataLength; i++) {
-    crc ^= reverse_8(data[i]) << 8;
-    for (uint8_t ii = 0; ii < 4; ii++) {
-      uint16_t tmp = crc << 1;
-      if ((crc & 0x8000) != 0) tmp ^= 0x1021;
-      crc = tmp << 1;
-      if ((tmp & 0x8000) != 0) crc ^= 0x1021;
-    }
+  bool confirmed = xSemaphoreTake(ackSemaphore, pdMS_TO_TICKS(RADIO_ADVERTISE_MS)) == pdTRUE;
+  pAdvertising->stop();
+  uint32_t airtimeMs = (micros() - command.sentAt) / 1000;
+  portENTER_CRITICAL(&ackWaitLock);
+  ackWait.armed = false;
+  command.confirmedAt = confirmed ? ackWait.confirmedAt : 0;
+  portEXIT_CRITICAL(&ackWaitLock);
+  radioStats.airtimeMs += airtimeMs;
+  metrics.advertiseMs.observe(airtimeMs);
+  if (command.confirmedAt != 0) {
+    radioStats.confirmed++;
+    radioStats.totalConfirmMs += (command.confirmedAt - command.enqueuedAt) / 1000;
+    if (airtimeMs < RADIO_ADVERTISE_MS) radioStats.airtimeSavedMs += RADIO_ADVERTISE_MS - airtimeMs;
+  } else {
+    radioStats.unconfirmed++;
   }
-  crc = ~reverse_16(crc) & 0xffff;
-  return crc;
 }
 
-uint8_t get_rf_payload(const uint8_t* addr, const uint8_t* data, uint8_t dataLength, uint8_t*& rfPayload)
+// takes the latest command out of a slot, freeing it
+void takeLevelSlot(RadioCommand& command)
 {
-  uint8_t data_offset = 0x12;
-  uint8_t inverse_offset = 0x0f;
-  uint8_t result_data_size = data_offset + addrLength + dataLength+2;
-  uint8_t* resultbuf = (uint8_t*)malloc(result_data_size);
-  memset(resultbuf, 0, result_data_size);
-
-  resultbuf[0x0f] = 0x71;
-  resultbuf[0x10] = 0x0f;
-  resultbuf[0x11] = 0x55;
-
-  for (uint8_t j = 0; j < addrLength; j++) {
-    resultbuf[data_offset + addrLength - j - 1] = addr[j];
-  }
+  LevelSlot& slot = levelSlots[command.slot];
+  portENTER_CRITICAL(&levelSlotsLock);
+  command = slot.command;
+  slot.pending = false;
+  slot.sealed = false;
+  portEXIT_CRITICAL(&levelSlotsLock);
+}
 
-  for (int j = 0; j < dataLength; j++) {
-    resultbuf[data_offset + addrLength + j] = data[j];
+// the class a command is scheduled in
+TxClass txClass(const RadioCommand& command)
+{
+  switch (command.kind) {
+    case RADIO_STATE: return TX_ON_OFF;
+    case RADIO_SCENE: return TX_SCENE;
+    default: return TX_LEVEL;
   }
+}
 
-  for (int i = inverse_offset; i < inverse_offset + addrLength + 3; i++) {
-    resultbuf[i] = reverse_8(resultbuf[i]);
-  }
+// the light or group a command addresses, which the scheduler keeps in order
+uint16_t txKey(const RadioCommand& command)
+{
+  return (command.data[0] & 0x0f) << 8 | command.data[1];
+}
 
-  int crc = crc16(addr, data, dataLength);
-  resultbuf[result_data_size-2] = crc & 0xff;
-  resultbuf[result_data_size-1] = (crc >> 8) & 0xff;
-  rfPayload = resultbuf;
-  return result_data_size;
+size_t txQueueDepth()
+{
+  xSemaphoreTake(txMutex, portMAX_DELAY);
+  size_t depth = txScheduler.size();
+  xSemaphoreGive(txMutex);
+  return depth;
 }
 
-uint8_t do_generate_command(int i, const uint8_t* data, uint8_t length, const uint8_t* key, int forward, int use_default_adapter, int i2, uint8_t*& rfPayload)
+void chargeAirtime(TxClass cls, uint32_t airtimeMs)
 {
-  if (i2 < 0) i2 = 0;
-  uint8_t* payload = 0;
-  uint8_t payloadLength = get_payload_with_inner_retry(i, data, length, i2, key, forward, payload);
-  uint8_t* rfPayloadTmp = 0;
-  Serial.print("payload: "); dump(payload, payloadLength); Serial.print("\n");
-  uint8_t rfPayloadLength = get_rf_payload(DEFAULT_BLE_FASTCON_ADDRESS, payload, payloadLength, rfPayloadTmp);
-  free(payload);
-  uint8_t ctx[7];
-  whiteningInit(0x25, &ctx[0]);
-  uint8_t* result = (uint8_t*)malloc(rfPayloadLength);
-  whiteningEncode(rfPayloadTmp, rfPayloadLength, ctx, result);
-  rfPayload = (uint8_t*)malloc(rfPayloadLength-15);
-  memcpy(rfPayload, result + 15, rfPayloadLength - 15);
-  Serial.print("rf payload: "); dump(rfPayload, rfPayloadLength-15); Serial.print("\n");
-  free(result);
-  free(rfPayloadTmp);
-  return rfPayloadLength-15;
+  xSemaphoreTake(txMutex, portMAX_DELAY);
+  txScheduler.charge(cls, millis(), airtimeMs);
+  xSemaphoreGive(txMutex);
 }
 
-std::string getServiceData(uint8_t rfPayloadLength, uint8_t* rfPayload)
+void radioTaskLoop(void* parameter)
 {
-  uint8_t ble_adv_data[] = { 0x02, 0x01, 0x1A, 0x1B, 0xFF, 0xF0, 0xFF };
-  uint8_t* advPacket = (uint8_t*)malloc(rfPayloadLength + sizeof(ble_adv_data));
-  memcpy(advPacket, ble_adv_data, sizeof(ble_adv_data));
-  memcpy(advPacket + sizeof(ble_adv_data), rfPayload, rfPayloadLength);
-  Serial.print("send: "); dump(advPacket, rfPayloadLength + sizeof(ble_adv_data)); Serial.print("\n");
-  uint8_t dataLength = rfPayloadLength + sizeof(ble_adv_data);
-  std::string serviceData = "";
-  serviceData += (char)(dataLength-4);
-  for (int i = 4; i < dataLength; i++) serviceData += (char)advPacket[i];
-  free(advPacket);
-  return serviceData;
+  RadioCommand command;
+  for (;;) {
+    TxClass cls;
+    uint32_t waitedMs, retryMs;
+    xSemaphoreTake(txMutex, portMAX_DELAY);
+    bool ready = txScheduler.pop(millis(), command, cls, waitedMs, retryMs);
+    xSemaphoreGive(txMutex);
+    if (!ready) {
+      // a push notifies; a frame held back by the budget retries in time
+      ulTaskNotifyTake(pdTRUE, retryMs ? pdMS_TO_TICKS(retryMs) : portMAX_DELAY);
+      continue;
+    }
+    metrics.txWaitMs[cls].observe(waitedMs);
+    if (command.slot >= 0) takeLevelSlot(command);
+    xSemaphoreTake(radioMutex, portMAX_DELAY);
+    command.confirmedAt = 0;
+    uint32_t airtimeMs = 0;
+    if (appConfig.radio.closedLoop && statusScanRunning && command.kind != RADIO_SCENE &&
+        (command.data[0] & 0x0f) == FASTCON_SINGLE_CONTROL) {
+      sendUntilConfirmed(command);
+      if (command.sentAt != 0) airtimeMs = (micros() - command.sentAt) / 1000;
+    } else {
+      command.sentAt = single_control(my_key, command.data);
+      if (command.sentAt != 0) {
+        airtimeMs = RADIO_ADVERTISE_MS;
+        radioStats.airtimeMs += RADIO_ADVERTISE_MS;
+      }
+    }
+    radioTurns++;
+    xSemaphoreGive(radioMutex);
+    chargeAirtime(cls, airtimeMs);
+    if (command.sentAt != 0) {
+      uint32_t latency = command.sentAt - command.enqueuedAt;
+      radioStats.sent++;
+      radioStats.lastLatencyUs = latency;
+      radioStats.totalLatencyMs += latency / 1000;
+      metrics.commandLatencyMs.observe(latency / 1000);
+      if (latency > radioStats.maxLatencyUs) radioStats.maxLatencyUs = latency;
+    }
+    if (!reportQueue.push(command)) LOG_WARN("Report queue full, state not reported");
+  }
 }
 
-void single_control(const uint8_t* key, const uint8_t* data)
+void startRadioTask()
 {
-  uint8_t* rfPayload = 0;
-  uint8_t rfPayloadLength = do_generate_command(5, data, 8, key, true /* forward */, true /* use_default_adapter */, 0, rfPayload);
-  std::string serviceData = getServiceData(rfPayloadLength, rfPayload);
-  BLEAdvertisementData oAdvertisementData = BLEAdvertisementData();
-  oAdvertisementData.setFlags(0x04); // BR_EDR_NOT_SUPPORTED 0x04
-  oAdvertisementData.addData(serviceData);
-  pAdvertising->setAdvertisementData(oAdvertisementData);
-  pAdvertising->setMinInterval(50);
-  pAdvertising->setMaxInterval(50);
-  pAdvertising->start();
-  delay(250);
-  pAdvertising->stop();
-  Serial.println("");
+  xTaskCreatePinnedToCore(radioTaskLoop, "radio", RADIO_TASK_STACK, NULL, RADIO_TASK_PRIORITY, &radioTask, RADIO_TASK_CORE);
 }
 
-LightDevice getLight(std::string id)
+// the lights and groups a command's frame reaches: its light and that
+// light's group, or its group and the group's lights
+struct CommandReach {
+  bool lights[256];
+  bool groups[256];
+};
+
+void commandReach(const uint8_t* data, CommandReach& reach)
 {
+  memset(&reach, 0, sizeof(reach));
+  bool group = (data[0] & 0x0f) == FASTCON_GROUP_CONTROL;
+  (group ? reach.groups : reach.lights)[data[1]] = true;
   for (int i = 0; i < myLights.size(); i++) {
-    if (myLights[i].id == id) return myLights[i];
+    const LightDevice& light = myLights[i];
+    if (!light.isRegistered) continue;
+    if (group && light.group == data[1]) reach.lights[light.number] = true;
+    if (!group && light.number == data[1]) reach.groups[light.group] = true;
   }
-  throw std::runtime_error("Light not found");
 }
 
-void onStateCommand(bool state, HALight* sender)
+// what a command does to one queued in a lower class: one it reaches goes
+// first, unless the command is an "off" that makes a brightness or colour
+// change for no more than the off's lights pointless
+TxReach txReach(const RadioCommand& command, const CommandReach& reach, uint16_t key, const RadioCommand& queued)
 {
-  Serial.print("Light: ");
-  Serial.println(sender->getName());
-  Serial.print("ID: ");
-  Serial.println(sender->uniqueId());
-  Serial.print("State: ");
-  Serial.println(state);
-  LightDevice light = getLight(sender->uniqueId());
-  uint8_t data[] = { 0x22, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
-  data[1] = light.number;
-  if (state) data[2] = 0x80;
-  single_control(my_key, data);
-  sender->setState(state); // report state back to the Home Assistant
+  bool group = (key >> 8) == FASTCON_GROUP_CONTROL;
+  if (!(group ? reach.groups : reach.lights)[key & 0xff]) return TX_APART;
+  bool off = command.kind == RADIO_STATE && !command.state;
+  bool level = queued.kind != RADIO_STATE && queued.kind != RADIO_SCENE;
+  return off && level && (!group || key == txKey(command)) ? TX_SUPERSEDED : TX_BEFORE;
 }
 
-void onBrightnessCommand(uint8_t brightness, HALight* sender)
+// queues a command, keeping it behind the earlier frames of every light and
+// group it reaches (a group "off" behind its lights' brightness changes),
+// or dropping those it undoes
+bool pushRadioCommand(const RadioCommand& command)
 {
-  Serial.print("Light: ");
-  Serial.println(sender->getName());
-  Serial.print("ID: ");
-  Serial.println(sender->uniqueId());
-  Serial.print("Brightness: ");
-  Serial.println(brightness);
-  LightDevice light = getLight(sender->uniqueId());
-  uint8_t data[] = { 0x22, 0x00, 0xff, 0x00, 0x00, 0x00, 0x00, 0x00 };
-  data[1] = light.number;
-  data[2] = brightness & 127;
-  single_control(my_key, data);
-  sender->setBrightness(brightness); // report brightness back to the Home Assistant
+  CommandReach reach;
+  commandReach(command.data, reach);
+  // the slots of the brightness and colour commands it drops, given back
+  // once the scheduler is released
+  int8_t released[RADIO_QUEUE_LENGTH];
+  int releasedCount = 0;
+  xSemaphoreTake(txMutex, portMAX_DELAY);
+  bool queued = txScheduler.push(
+      txClass(command), txKey(command), command, millis(),
+      [&](uint16_t key, const RadioCommand& queued) { return txReach(command, reach, key, queued); },
+      [&](const RadioCommand& dropped) {
+        if (dropped.slot >= 0 && releasedCount < RADIO_QUEUE_LENGTH) released[releasedCount++] = dropped.slot;
+      });
+  uint32_t depth = txScheduler.size();
+  xSemaphoreGive(txMutex);
+  portENTER_CRITICAL(&levelSlotsLock);
+  for (int i = 0; i < releasedCount; i++) {
+    levelSlots[released[i]].pending = false;
+    levelSlots[released[i]].sealed = false;
+  }
+  portEXIT_CRITICAL(&levelSlotsLock);
+  if (!queued) {
+    radioStats.dropped++;
+    LOG_WARN("Radio queue full, dropping command");
+    return false;
+  }
+  radioStats.enqueued++;
+  if (depth > radioStats.maxQueueDepth) radioStats.maxQueueDepth = depth;
+  xTaskNotifyGive(radioTask);
+  return true;
 }
 
-void onColorTemperatureCommand(uint16_t temperature, HALight* sender)
+// counts a command against the light or group it addresses
+void countCommand(const RadioCommand& command)
 {
-  Serial.print("Light: ");
-  Serial.println(sender->getName());
-  Serial.print("ID: ");
-  Serial.println(sender->uniqueId());
-  Serial.print("Color temperature: ");
-  Serial.println(temperature);
-  LightDevice light = getLight(sender->uniqueId());
-  uint8_t data[] = { 0x72, 0x00, 0xff, 0x00, 0x00, 0x00, 0x00, 0x00 };
-  data[1] = light.number;
-  data[2] = sender->getCurrentBrightness() & 127;
-  data[6] = temperature & 127;
-  data[7] = (temperature >> 8) & 127;
-  single_control(my_key, data);
-  sender->setColorTemperature(temperature); // report color temperature back to the Home Assistant
+  CommandCounter* counters = (command.data[0] & 0x0f) == FASTCON_GROUP_CONTROL ? metrics.groups : metrics.lights;
+  counters[command.data[1]].commands.fetch_add(1, std::memory_order_relaxed);
 }
 
-void onRGBColorCommand(HALight::RGBColor color, HALight* sender)
+// With several bridges, a command goes out from the bridges that own its
+// light, or for a group from those that own any of its lights (a light that
+// gets a group frame twice just applies the same state again). Around a
+// handover the old owner sends too, for BRIDGE_HANDOVER_MS.
+bool transmitsFor(const uint8_t* data)
 {
-  Serial.print("Light: ");
-  Serial.println(sender->getName());
-  Serial.print("ID: ");
-  Serial.println(sender->uniqueId());
-  Serial.print("Red: ");
-  Serial.println(color.red);
-  Serial.print("Green: ");
-  Serial.println(color.green);
-  Serial.print("Blue: ");
-  Serial.println(color.blue);
-  LightDevice light = getLight(sender->uniqueId());
-  uint8_t data[] = { 0x72, 0x00, 0xff, 0x00, 0x00, 0x00, 0x00, 0x00 };
-  data[1] = light.number;
-  data[2] = sender->getCurrentBrightness() & 127;
-  data[3] = color.blue;
-  data[4] = color.red;
-  data[5] = color.green;
-  single_control(my_key, data);
-  sender->setRGBColor(color); // report color back to the Home Assistant
+  uint32_t now = millis();
+  if ((data[0] & 0x0f) != FASTCON_GROUP_CONTROL) return coordinator.transmits(data[1], now);
+  for (int i = 0; i < myLights.size(); i++) {
+    if (myLights[i].isRegistered && myLights[i].group == data[1] && coordinator.transmits(myLights[i].number, now)) return true;
+  }
+  return false;
 }
 
-class AddDeviceCallback: public BLEAdvertisedDeviceCallbacks
+void leaveToOwner(const RadioCommand& command);
+
+// on/off commands: queued in order, and they seal any pending brightness or
+// colour slot for a light they reach (a group's on/off its lights' slots, a
+// light's on/off its group's slot)
+void enqueueRadioCommand(RadioCommand& command)
 {
-  void onResult(BLEAdvertisedDevice foundDevice)
-  {
-    std::string address = foundDevice.getAddress().toString();
-    std::string name = foundDevice.getName();
-    std::string mData = foundDevice.getManufacturerData();
-    int rssi = foundDevice.getRSSI();
-    Serial.print("BLE Device found -> Address: ");
-    Serial.print(address.c_str());
-    Serial.print(", Name: ");
-    Serial.print(name.c_str());
-    Serial.print(", RSSI: ");
-    Serial.print(rssi);
-    Serial.print(", Manufacturer Data: ");
-    dump(mData);
-    // check the device is a light, and using the default key
-    // check response
-    if (mData.size() == 18) {
-      std::string type = mData.substr(12,2);
-      std::string key = mData.substr(14,4);
-      bool knownType = false;
-      for (int i = 0; i < lightTypes.size(); i++) {
-        if (doesStringMatchBytes(type, lightTypes[i].code)) {
-          Serial.printf(", It's a %s light!", lightTypes[i].name.c_str());
-          knownType = true;
-          break;
-        }
-      }
-      if (knownType && doesStringMatchBytes(key, default_key)) {
-        Serial.print(", Using the default key!");
-        bool alreadyKnown = false;
-        for (int i = 0; i < myLights.size(); i++) {
-          if (myLights[i].device.getAddress().toString() == foundDevice.getAddress().toString()) {
-            // we already know about this device, so ignore it
-            alreadyKnown = true;
-            break;
-          }
-        }
-        if (alreadyKnown == false) {
-          Serial.print(", Stored it!");
-          LightDevice light;
-          light.device = foundDevice;
-          light.type[0] = type[0];
-          light.type[1] = type[1];
-          myLights.push_back(light);
-        }
-      }
-    }
-    Serial.println("");
+  if (!transmitsFor(command.data)) {
+    leaveToOwner(command);
+    return;
   }
-};
+  countCommand(command);
+  command.enqueuedAt = micros();
+  command.slot = -1;
+  CommandReach reach;
+  commandReach(command.data, reach);
+  portENTER_CRITICAL(&levelSlotsLock);
+  for (int i = 0; i < RADIO_QUEUE_LENGTH; i++) {
+    const uint8_t* data = levelSlots[i].command.data;
+    bool group = (data[0] & 0x0f) == FASTCON_GROUP_CONTROL;
+    if (levelSlots[i].pending && (group ? reach.groups : reach.lights)[data[1]]) levelSlots[i].sealed = true;
+  }
+  portEXIT_CRITICAL(&levelSlotsLock);
+  pushRadioCommand(command);
+}
 
-class AddLightCallback: public BLEAdvertisedDeviceCallbacks
+// brightness and colour commands: replace an unsent command of the same kind
+// for the light, or take a free slot and queue a token for it. Brightness,
+// colour temperature and RGB can share an opcode, but each frame sets only
+// its own values and has its own report, so different kinds don't merge.
+void enqueueLevelCommand(RadioCommand& command)
 {
-  void onResult(BLEAdvertisedDevice foundDevice)
-  {
-    std::string address = foundDevice.getAddress().toString();
-    std::string name = foundDevice.getName();
-    std::string mData = foundDevice.getManufacturerData();
-    int rssi = foundDevice.getRSSI();
-    Serial.print("BLE Device found -> Address: ");
-    Serial.print(address.c_str());
-    Serial.print(", Name: ");
-    Serial.print(name.c_str());
-    Serial.print(", RSSI: ");
-    Serial.print(rssi);
-    Serial.print(", Manufacturer Data: ");
-    dump(mData);
-    // check response
-    if (mData.size() == 18) {
-      for (int i = 0; i < myLights.size(); i++) {
-        if (myLights[i].device.getAddress().toString() == foundDevice.getAddress().toString()) {
-          Serial.print(", It's one of our lights!");
-          // check it's not using the default key
-          std::string key = mData.substr(14,4);
-          if (doesStringMatchBytes(key, default_key)) {
-            Serial.print(", still using the default key (ignore)");
-          } else {
-            Serial.print(", with the new key");
-            if (myLights[i].isRegistered) {
-              Serial.print(", but it's already registered!");
-            } else {
-              myLights[i].isRegistered = true;
-              // get the light number from the light itself
-              uint8_t cleanManufacturerData[12];
-              uint8_t* manufacturerData = (uint8_t*)foundDevice.getManufacturerData().substr(2).c_str();
-              // use the key to clean it
-              for (int j = 0; j < 12; j++) {
-                cleanManufacturerData[j] = my_key[j & 3] ^ manufacturerData[4 + j];
-              }
-              Serial.print(", clean manufacturer data: "); dump(cleanManufacturerData, 12);
-              myLights[i].number = cleanManufacturerData[1];
-              myLights[i].id = myLights[i].device.getAddress().toString().substr(3,2) + myLights[i].device.getAddress().toString().substr(0,2);
-              myLights[i].name = "Light_" + myLights[i].id;
-              // enable features based on type
-              std::string typeName = "";
-              for (int j = 0; j < lightTypes.size(); j++) {
-                if (myLights[i].type[0] == lightTypes[j].code[0] && myLights[i].type[1] == lightTypes[j].code[1]) {
-                  typeName = lightTypes[j].name;
-                  break;
-                }
-              }
-              // create the HA object
-              if (typeName == "RGBW") {
-                HALight* light = new HALight(myLights[i].id.c_str(), HALight::BrightnessFeature | HALight::ColorTemperatureFeature | HALight::RGBFeature);
-                light->setName(myLights[i].name.c_str());
-                light->onStateCommand(onStateCommand);
-                light->onBrightnessCommand(onBrightnessCommand);
-                light->onColorTemperatureCommand(onColorTemperatureCommand);
-                light->onRGBColorCommand(onRGBColorCommand);
-                light->setBrightnessScale(127);
-                light->setBrightness(127);
-                myLights[i].light = light;
-              } else if (typeName == "RGB") {
-                HALight* light = new HALight(myLights[i].id.c_str(), HALight::BrightnessFeature | HALight::RGBFeature);
-                light->setName(myLights[i].name.c_str());
-                light->onStateCommand(onStateCommand);
-                light->onBrightnessCommand(onBrightnessCommand);
-                light->onRGBColorCommand(onRGBColorCommand);
-                light->setBrightnessScale(127);
-                light->setBrightness(127);
-                myLights[i].light = light;
-              } else {
-                // "Smart" - no additional features
-                HALight* light = new HALight(myLights[i].id.c_str());
-                light->setName(myLights[i].name.c_str());
-                light->onStateCommand(onStateCommand);
-                myLights[i].light = light;
-              }
-              Serial.printf(", created light ");
-              Serial.printf(myLights[i].light->uniqueId());
-            }
-            Serial.println("");
-          }
-          break;
-        }
+  if (!transmitsFor(command.data)) {
+    leaveToOwner(command);
+    return;
+  }
+  countCommand(command);
+  command.enqueuedAt = micros();
+  command.slot = -1;
+  int freeSlot = -1;
+  bool merged = false;
+  portENTER_CRITICAL(&levelSlotsLock);
+  for (int i = 0; i < RADIO_QUEUE_LENGTH; i++) {
+    LevelSlot& slot = levelSlots[i];
+    if (!slot.pending) {
+      if (freeSlot < 0) freeSlot = i;
+    } else if (!slot.sealed && slot.command.data[0] == command.data[0] && slot.command.data[1] == command.data[1]) {
+      if (slot.command.kind != command.kind) {
+        // this one goes out after it, so later values of its kind can't
+        // jump ahead of this one
+        slot.sealed = true;
+        continue;
       }
+      // keep the original enqueue time, so latency covers the whole wait
+      command.enqueuedAt = slot.command.enqueuedAt;
+      command.slot = i;
+      slot.command = command;
+      merged = true;
+      break;
     }
-    Serial.println("");
   }
-};
+  if (!merged && freeSlot >= 0) {
+    command.slot = freeSlot;
+    levelSlots[freeSlot].pending = true;
+    levelSlots[freeSlot].sealed = false;
+    levelSlots[freeSlot].command = command;
+  }
+  portEXIT_CRITICAL(&levelSlotsLock);
 
-void scan()
+  if (merged) {
+    radioStats.coalesced++;
+    return;
+  }
+  if (command.slot < 0) {
+    radioStats.dropped++;
+    LOG_WARN("No free command slot, dropping command");
+    return;
+  }
+  if (!pushRadioCommand(command)) {
+    portENTER_CRITICAL(&levelSlotsLock);
+    levelSlots[command.slot].pending = false;
+    portEXIT_CRITICAL(&levelSlotsLock);
+  }
+}
+
+LightGroup* getGroup(uint8_t id)
 {
-  Serial.println("Send wake command");
-  uint8_t data[] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
-  const uint8_t key[] = { 0x00, 0x00, 0x00, 0x00 };
-  uint8_t* rfPayload = 0;
-  uint8_t rfPayloadLength = do_generate_command(0, data, 6, key, false, true, 0, rfPayload);
-  std::string serviceData = getServiceData(rfPayloadLength, rfPayload);
-  BLEAdvertisementData oAdvertisementData = BLEAdvertisementData();
-  oAdvertisementData.setFlags(0x04); // BR_EDR_NOT_SUPPORTED 0x04
-  oAdvertisementData.addData(serviceData);
-  pAdvertising->setAdvertisementData(oAdvertisementData);
-  pAdvertising->start();
-  Serial.println("Scan for lights");
-  pBLEScan = BLEDevice::getScan();
-  pBLEScan->setAdvertisedDeviceCallbacks(new AddDeviceCallback());
-  pBLEScan->setInterval(500);
-  pBLEScan->setWindow(500);
-  pBLEScan->setActiveScan(true);
-  pBLEScan->start(BLESCAN_DURATION, false);
-  pAdvertising->stop();
+  for (int i = 0; i < myGroups.size(); i++) {
+    if (myGroups[i].id == id) return &myGroups[i];
+  }
+  return NULL;
 }
 
-void addLight(uint8_t lightNumber, LightDevice light)
+// every HALight we create is a MeshLight
+LightDevice* getLight(HALight* sender)
 {
-  uint8_t data[12];
-  std::string lightMac = light.device.getManufacturerData().substr(6, 6);
-  Serial.printf("Setting key on light %d, MAC: ", lightNumber); dump(lightMac); Serial.print("\n");
-  Serial.print("new key: "); dump(my_key, 4); Serial.print("\n");
-  for (int i = 0; i < 6; i++) data[i] = (uint8_t)lightMac[i]; // mac address
-  data[6] = lightNumber; // light id - we're requesting that it's set to this
-  data[7] = 0x01; // group id
-  data[8] = my_key[0];
-  data[9] = my_key[1];
-  data[10] = my_key[2];
-  data[11] = my_key[3];
-  uint8_t* rfPayload = 0;
-  uint8_t rfPayloadLength = do_generate_command(2, data, 12, default_key, false, true, 0, rfPayload);
-  std::string serviceData = getServiceData(rfPayloadLength, rfPayload);
-  BLEAdvertisementData oAdvertisementData = BLEAdvertisementData();
-  oAdvertisementData.setFlags(0x04);
-  oAdvertisementData.addData(serviceData);
-  pAdvertising->setAdvertisementData(oAdvertisementData);
-  pAdvertising->setMinInterval(50);
-  pAdvertising->setMaxInterval(50);
-  pAdvertising->start();
-  // get light response
-  pBLEScan = BLEDevice::getScan();
-  pBLEScan->setAdvertisedDeviceCallbacks(new AddLightCallback());
-  pBLEScan->setInterval(50);
-  pBLEScan->setWindow(50);
-  pBLEScan->setActiveScan(true);
-  pBLEScan->start(1);
-  pAdvertising->stop();
+  return static_cast<MeshLight*>(sender)->device;
 }
 
-void addLights()
+LightGroup* getGroup(HALight* sender)
 {
-  scan();
-  // wait before adding lights, as they seem to need a brief pause after the scan
-  delay(1000);
-  for (int i = 0; i < myLights.size(); i++) {
-    addLight(i + 1, myLights[i]);
-  }
+  return static_cast<MeshLight*>(sender)->group;
 }
 
-void setup() {
-  pinMode (ledPin, OUTPUT);
-  // turn on to show we're still in setup (and are adding for lights)
-  digitalWrite (ledPin, HIGH);
-  Serial.begin(115200);
+// the layout of the commands for a light or group entity
+const LightCommandLayout& commandLayout(HALight* sender)
+{
+  LightGroup* group = getGroup(sender);
+  return light_traits(group ? group->model : getLight(sender)->model).layout;
+}
 
-  if (!loadConfig("/config.json", appConfig)) {
-      Serial.println("No valid configuration found. Starting Config Portal.");
-      setupConfigPortal(appConfig); // Launch AP mode for configuration
-      return;
+// fills in the addressing of a command whose body is encoded, addressing
+// either the light or, for a group entity, every light in the group
+void addressCommand(HALight* sender, uint8_t* data)
+{
+  LightGroup* group = getGroup(sender);
+  if (group) {
+    data[0] |= FASTCON_GROUP_CONTROL;
+    data[1] = group->id;
   } else {
-      Serial.printf("Loaded Configuration: Wi-Fi SSID: %s, MQTT Broker: %s\n",
-                    appConfig.wifi.ssid.c_str(), appConfig.mqtt.broker.c_str());
+    data[0] |= FASTCON_SINGLE_CONTROL;
+    data[1] = getLight(sender)->number;
+  }
+}
+
+// calls fn for the HA entity and, if it's a group, for each of its lights
+template <typename Fn>
+void forEachTarget(HALight* sender, Fn fn)
+{
+  fn(sender);
+  LightGroup* group = getGroup(sender);
+  if (!group) return;
+  for (int i = 0; i < myLights.size(); i++) {
+    if (myLights[i].isRegistered && myLights[i].group == group->id) fn(myLights[i].light);
+  }
+}
+
+// a command another bridge sends: it reports the new state to HA, so this
+// one only keeps its entities' current values in step
+void leaveToOwner(const RadioCommand& command)
+{
+  metrics.commandsLeftToOwner++;
+  if (command.quiet) return;
+  forEachTarget(command.sender, [&command](HALight* light) {
+    switch (command.kind) {
+      case RADIO_STATE: light->setCurrentState(command.state); break;
+      case RADIO_BRIGHTNESS: light->setCurrentBrightness(command.brightness); break;
+      case RADIO_COLOR_TEMPERATURE: light->setCurrentColorTemperature(command.temperature); break;
+      case RADIO_RGB_COLOR: light->setCurrentRGBColor(command.color); break;
+      case RADIO_SCENE: break;
+    }
+  });
+}
 
-      // Use the existing connectToWiFi function
-      connectToWiFi(appConfig.wifi);
+void reportSceneFrame(const RadioCommand& command);
 
-      if (WiFi.status() == WL_CONNECTED) {
-          Serial.println("Wi-Fi connection successful!");
-          // Initialize other features, such as MQTT
-
-          // create new key
-          uint32_t new_key = esp_random();
-          my_key[0] = new_key & 0xFF;
-          my_key[1] = (new_key >> 8) & 0xFF;
-          my_key[2] = (new_key >> 16) & 0xFF;
-          my_key[3] = (new_key >> 24) & 0xFF;
-          WiFi.macAddress(mac);
-          device.setUniqueId(mac, sizeof(mac));
-          device.setName("BRMesh");
-          device.setManufacturer("BRMesh");
-          device.setModel("BRMesh");
-          mqtt = new HAMqtt(client, device);
-          Serial.printf("ESP32 MAC: %02X:%02X:%02X:%02X:%02X:%02X\n", mac[0],mac[1],mac[2],mac[3],mac[4],mac[5]);
-          // Create the BLE Device
-          BLEDevice::init("ESP32 as iBeacon");
-          pAdvertising = BLEDevice::getAdvertising();
-          BLEDevice::startAdvertising();
-
-
-          // add the lights
-          addLights();
-          // print the added lights with their IDs
-          for (int i = 0; i < myLights.size(); i++) {
-            if (myLights[i].isRegistered) {
-              Serial.printf("Light %d - ", myLights[i].number);
-              Serial.println(myLights[i].light->uniqueId());
-            }
-          }
-          // finished adding lights
-          digitalWrite (ledPin, LOW);
-          Serial.printf("Connecting to MQTT Broker: %s:%d\n", appConfig.mqtt.broker.c_str(), appConfig.mqtt.port);
-
-          mqtt->begin(appConfig.mqtt.broker.c_str(), appConfig.mqtt.port, appConfig.mqtt.username.c_str(), appConfig.mqtt.password.c_str());
-          Serial.println("Ready");    
-  
-      } else {
-          Serial.println("Wi-Fi connection failed. Starting Config Portal.");
-          setupConfigPortal(appConfig); // Fallback to AP mode
-          return;
+// called from loop() to report commands that have gone out
+void reportRadioCommands()
+{
+  RadioCommand command;
+  while (reportQueue.pop(command)) {
+    if (command.kind == RADIO_SCENE) {
+      reportSceneFrame(command);
+      continue;
+    }
+    if (command.sentAt == 0 || command.quiet) continue;
+    forEachTarget(command.sender, [&command](HALight* light) {
+      switch (command.kind) {
+        case RADIO_STATE: light->setState(command.state); break;
+        // the current value was already updated when the command was queued,
+        // so force the publish
+        case RADIO_BRIGHTNESS: light->setBrightness(command.brightness, true); break;
+        case RADIO_COLOR_TEMPERATURE: light->setColorTemperature(command.temperature, true); break;
+        case RADIO_RGB_COLOR: light->setRGBColor(command.color, true); break;
+        case RADIO_SCENE: break;
       }
-  } 
+    });
+    uint32_t sent = radioStats.sent;
+    LOG_INFO("Light %s on air after %u ms (queue depth %u, max %u, avg latency %u ms, %u sent, %u coalesced)",
+             command.sender->uniqueId(), (command.sentAt - command.enqueuedAt) / 1000,
+             (unsigned)txQueueDepth(), (unsigned)radioStats.maxQueueDepth,
+             sent ? (unsigned)(radioStats.totalLatencyMs / sent) : 0,
+             sent, (unsigned)radioStats.coalesced);
+    if (appConfig.radio.closedLoop && statusScanRunning) {
+      uint32_t confirmed = radioStats.confirmed;
+      LOG_INFO("Light %s %s after %u ms (%u confirmed, %u not, avg %u ms to confirm, %u ms airtime, %u ms saved)",
+               command.sender->uniqueId(), command.confirmedAt != 0 ? "confirmed" : "not confirmed",
+               ((command.confirmedAt != 0 ? command.confirmedAt : micros()) - command.enqueuedAt) / 1000,
+               confirmed, (unsigned)radioStats.unconfirmed,
+               confirmed ? (unsigned)(radioStats.totalConfirmMs / confirmed) : 0,
+               (unsigned)radioStats.airtimeMs, (unsigned)radioStats.airtimeSavedMs);
+    }
+  }
+}
+
+//////////////////////////////////////////////////////
+// Transitions
+//
+// HA's MQTT lights have no transition, so the bridge has one for all its
+// lights, set from the "Light transition" number entity. Brightness and
+// colour commands then fade from the light's current values in steps sent
+// from loop() (transition_engine.h). The steps go through the level slots
+// like any brightness command, so a busy radio drops steps rather than
+// falling behind, and only the last one is reported to HA.
+//////////////////////////////////////////////////////
 
+TransitionEngine<TRANSITIONS, HALight*> transitions(TRANSITION_FRAME_MS);
+uint32_t transitionMs = 0;
+
+void onTransitionCommand(HANumeric number, HANumber* sender)
+{
+  transitionMs = number.isSet() ? (uint32_t)(number.toFloat() * 1000) : 0;
+  if (transitionMs > TRANSITION_MAX_MS) transitionMs = TRANSITION_MAX_MS;
+  LOG_INFO("Light transition %u ms", transitionMs);
+  sender->setState(number);
 }
 
-void loop()
+// a step of a fade: the command the entity would send for these values
+void sendFadeStep(HALight* const& sender, uint8_t kind, const uint16_t* values, bool last)
+{
+  RadioCommand command = {};
+  command.sender = sender;
+  command.kind = (RadioCommandKind)kind;
+  command.quiet = !last;
+  uint8_t* data = command.data;
+  const LightCommandLayout& layout = commandLayout(sender);
+  switch (command.kind) {
+    case RADIO_BRIGHTNESS:
+      command.brightness = values[0];
+      light_encode_brightness(layout, command.brightness, data);
+      break;
+    case RADIO_COLOR_TEMPERATURE:
+      command.temperature = values[1];
+      light_encode_temperature(layout, values[0], command.temperature, data);
+      break;
+    case RADIO_RGB_COLOR:
+      command.color = HALight::RGBColor(values[1], values[2], values[3]);
+      light_encode_rgb(layout, values[0], command.color.red, command.color.green, command.color.blue, data);
+      break;
+    default:
+      return;
+  }
+  addressCommand(sender, data);
+  metrics.fadeFrames++;
+  enqueueLevelCommand(command);
+}
+
+// the fades a command for sender overrides besides its own: its lights' if
+// it's a group, and its group's if it's a light
+void cancelOtherFades(HALight* sender)
+{
+  forEachTarget(sender, [sender](HALight* light) {
+    if (light != sender) transitions.cancel(light);
+  });
+  LightDevice* device = getLight(sender);
+  LightGroup* group = device ? getGroup(device->group) : NULL;
+  if (group) transitions.cancel(group->light);
+}
+
+// stops sender's fade, and those its command overrides, where they are
+void cancelFades(HALight* sender)
 {
-  if (WiFi.status() == WL_CONNECTED) {  
-    mqtt->loop();
+  transitions.cancel(sender);
+  cancelOtherFades(sender);
+}
+
+// fades sender's channels to their targets if a transition is set; returns
+// false if the command should go out straight away instead
+bool startFade(HALight* sender, RadioCommandKind kind, const uint16_t* from, const uint16_t* to, uint8_t channels)
+{
+  uint8_t data[8] = {};
+  addressCommand(sender, data);
+  // another bridge's light fades there
+  bool fading = transitionMs > 0 && transmitsFor(data)
+                && transitions.start(sender, kind, from, to, channels, millis(), transitionMs, sendFadeStep);
+  if (!fading) {
+    cancelFades(sender);
+    return false;
+  }
+  cancelOtherFades(sender);
+  metrics.fades++;
+  return true;
+}
+
+void onStateCommand(bool state, HALight* sender)
+{
+  LOG_INFO("Light %s: state %d", sender->uniqueId(), state);
+  cancelFades(sender);
+  RadioCommand command = {};
+  command.sender = sender;
+  command.kind = RADIO_STATE;
+  command.state = state;
+  uint8_t* data = command.data;
+  light_encode_state(commandLayout(sender), state, data);
+  addressCommand(sender, data);
+  enqueueRadioCommand(command); // state is reported back to the Home Assistant once sent
+}
+
+void onBrightnessCommand(uint8_t brightness, HALight* sender)
+{
+  LOG_INFO("Light %s: brightness %u", sender->uniqueId(), brightness);
+  // a light that's off fades up from dark
+  uint16_t level = sender->getCurrentState() ? sender->getCurrentBrightness() : 0;
+  const uint16_t from[] = { level };
+  const uint16_t to[] = { brightness };
+  // colour commands carry the brightness too, so they need to see this one
+  // straight away rather than once it has been reported
+  forEachTarget(sender, [brightness](HALight* light) { light->setCurrentBrightness(brightness); });
+  if (startFade(sender, RADIO_BRIGHTNESS, from, to, 1)) return;
+  RadioCommand command = {};
+  command.sender = sender;
+  command.kind = RADIO_BRIGHTNESS;
+  command.brightness = brightness;
+  uint8_t* data = command.data;
+  light_encode_brightness(commandLayout(sender), brightness, data);
+  addressCommand(sender, data);
+  enqueueLevelCommand(command); // brightness is reported back to the Home Assistant once sent
+}
+
+void onColorTemperatureCommand(uint16_t temperature, HALight* sender)
+{
+  LOG_INFO("Light %s: color temperature %u", sender->uniqueId(), temperature);
+  uint16_t level = sender->getCurrentBrightness();
+  uint16_t current = sender->getCurrentColorTemperature();
+  const uint16_t from[] = { level, current ? current : temperature };
+  const uint16_t to[] = { level, temperature };
+  if (startFade(sender, RADIO_COLOR_TEMPERATURE, from, to, 2)) return;
+  RadioCommand command = {};
+  command.sender = sender;
+  command.kind = RADIO_COLOR_TEMPERATURE;
+  command.temperature = temperature;
+  uint8_t* data = command.data;
+  light_encode_temperature(commandLayout(sender), sender->getCurrentBrightness(), temperature, data);
+  addressCommand(sender, data);
+  enqueueLevelCommand(command); // color temperature is reported back to the Home Assistant once sent
+}
+
+void onRGBColorCommand(HALight::RGBColor color, HALight* sender)
+{
+  LOG_INFO("Light %s: red %u, green %u, blue %u", sender->uniqueId(), color.red, color.green, color.blue);
+  uint16_t level = sender->getCurrentBrightness();
+  HALight::RGBColor current = sender->getCurrentRGBColor().isSet ? sender->getCurrentRGBColor() : color;
+  const uint16_t from[] = { level, current.red, current.green, current.blue };
+  const uint16_t to[] = { level, color.red, color.green, color.blue };
+  if (startFade(sender, RADIO_RGB_COLOR, from, to, 4)) return;
+  RadioCommand command = {};
+  command.sender = sender;
+  command.kind = RADIO_RGB_COLOR;
+  command.color = color;
+  uint8_t* data = command.data;
+  light_encode_rgb(commandLayout(sender), sender->getCurrentBrightness(), color.red, color.green, color.blue, data);
+  addressCommand(sender, data);
+  enqueueLevelCommand(command); // color is reported back to the Home Assistant once sent
+}
+
+//////////////////////////////////////////////////////
+// Scenes
+//
+// A scene sets many lights from one MQTT message, a JSON array of targets in
+// the HA light schema, on aha/<bridge id>/scene/cmd_t:
+//
+//   [{"light": "ab12", "brightness": 100, "color": {"r": 255, "g": 0, "b": 0}},
+//    {"light": "cd34", "state": "OFF"}, {"light": "ef56", "color_temp": 300}]
+//
+// Each target is encoded as the command its entity would send, the planner
+// (scene_planner.h) folds lights with the same target into group frames,
+// and the frames go out back to back. Home Assistant gets the new states
+// once the last one is off air.
+//
+// With several bridges, each sends the frames for the lights it owns. A
+// group frame is only planned for a group whose lights share an owner, as
+// its exceptions must follow it from the same bridge.
+//////////////////////////////////////////////////////
+
+// what to report to HA for a light once its scene is done
+struct SceneReport {
+  LightDevice* device;
+  RadioCommandKind kind; // the command its target was encoded as
+  bool state;
+  bool hasBrightness;
+  uint8_t brightness;
+  uint16_t temperature;
+  HALight::RGBColor color;
+};
+
+struct ActiveScene {
+  bool running;
+  uint32_t startedAt; // micros() the message came in
+  uint16_t lights;
+  uint16_t frames;
+  uint16_t queued;    // frames pushed to the radio queue so far
+  uint16_t done;      // frames the radio task has reported back
+};
+
+ScenePlanner<SCENE_MAX_LIGHTS> scenePlanner;
+SceneReport sceneReports[SCENE_MAX_LIGHTS];
+ActiveScene scene;
+char sceneTopic[64];
+// the registered lights by HA id, rebuilt as each scene is compiled
+MacTable<TRACKED_LIGHTS> sceneLightIds;
+
+// a light's HA id, its 4 hex digits in either case, as a MacTable key
+bool lightIdKey(const char* id, uint64_t& key)
+{
+  if (!id || strlen(id) != 4 || !isxdigit(id[0]) || !isxdigit(id[1]) || !isxdigit(id[2]) || !isxdigit(id[3])) {
+    return false;
+  }
+  key = strtoul(id, NULL, 16);
+  return true;
+}
+
+LightDevice* findSceneLight(const char* id)
+{
+  uint64_t key;
+  uint16_t i;
+  if (!lightIdKey(id, key) || !sceneLightIds.find(key, i)) return NULL;
+  return &myLights[i];
+}
+
+// encodes a light's target as the one command its entity would send for it,
+// leaving out what the light's model can't do
+void encodeSceneTarget(LightDevice& device, JsonObject target, SceneReport& report, uint8_t* data)
+{
+  const LightCommandLayout& layout = device.traits().layout;
+  uint8_t features = device.traits().features;
+  const char* state = target["state"].as<const char*>();
+  report = {};
+  report.device = &device;
+  report.state = true;
+  report.hasBrightness = (features & LIGHT_BRIGHTNESS) && target["brightness"].is<int>();
+  report.brightness = report.hasBrightness ? target["brightness"].as<int>() : device.light->getCurrentBrightness();
+  if (state && strcasecmp(state, "OFF") == 0) {
+    report.kind = RADIO_STATE;
+    report.state = false;
+    light_encode_state(layout, false, data);
+  } else if ((features & LIGHT_RGB) && target["color"].is<JsonObject>()) {
+    JsonObject color = target["color"];
+    report.kind = RADIO_RGB_COLOR;
+    report.color = HALight::RGBColor(color["r"] | 0, color["g"] | 0, color["b"] | 0);
+    light_encode_rgb(layout, report.brightness, report.color.red, report.color.green, report.color.blue, data);
+  } else if ((features & LIGHT_COLOR_TEMPERATURE) && target["color_temp"].is<int>()) {
+    report.kind = RADIO_COLOR_TEMPERATURE;
+    report.temperature = target["color_temp"].as<int>();
+    light_encode_temperature(layout, report.brightness, report.temperature, data);
+  } else if (report.hasBrightness) {
+    report.kind = RADIO_BRIGHTNESS;
+    report.state = report.brightness != 0;
+    light_encode_brightness(layout, report.brightness, data);
+  } else {
+    report.kind = RADIO_STATE;
+    light_encode_state(layout, true, data);
+  }
+}
+
+bool sceneQueueRoom()
+{
+  xSemaphoreTake(txMutex, portMAX_DELAY);
+  bool room = txScheduler.size(TX_SCENE) < RADIO_QUEUE_LENGTH;
+  xSemaphoreGive(txMutex);
+  return room;
+}
+
+// pushes the scene's next frames while its class has room; called again from
+// loop() until all are queued
+void queueSceneFrames()
+{
+  while (scene.running && scene.queued < scene.frames && sceneQueueRoom()) {
+    RadioCommand command = {};
+    command.kind = RADIO_SCENE;
+    memcpy(command.data, scenePlanner.frame(scene.queued), sizeof(command.data));
+    command.enqueuedAt = micros();
+    command.slot = -1;
+    countCommand(command);
+    if (!pushRadioCommand(command)) break;
+    scene.queued++;
+  }
+}
+
+void finishScene();
+
+void onSceneMessage(const uint8_t* payload, uint16_t length)
+{
+  if (scene.running) {
+    LOG_WARN("Scene still going out, ignoring the next one");
+    return;
+  }
+  uint32_t startedAt = micros();
+  JsonDocument doc;
+  DeserializationError error = deserializeJson(doc, payload, length);
+  if (error) {
+    LOG_WARN("Scene isn't valid JSON: %s", error.c_str());
+    return;
+  }
+  uint16_t members[SCENE_GROUPS] = {};
+  const char* groupOwners[SCENE_GROUPS] = {};
+  bool split[SCENE_GROUPS] = {};
+  sceneLightIds.clear();
+  for (int i = 0; i < myLights.size(); i++) {
+    if (!myLights[i].isRegistered) continue;
+    uint64_t key;
+    if (lightIdKey(myLights[i].id, key)) sceneLightIds.insert(key, i);
+    uint8_t group = myLights[i].group;
+    const char* owner = coordinator.owner(myLights[i].number);
+    if (members[group]++ == 0) groupOwners[group] = owner;
+    else if (owner != groupOwners[group]) split[group] = true;
+  }
+  for (int group = 0; group < SCENE_GROUPS; group++) {
+    if (split[group]) members[group] = 0; // no group frame
+  }
+  scenePlanner.clear();
+  uint16_t lights = 0;
+  for (JsonObject target : doc.as<JsonArray>()) {
+    LightDevice* device = findSceneLight(target["light"].as<const char*>());
+    if (!device) {
+      LOG_WARN("Scene names a light that isn't registered, skipping it");
+      continue;
+    }
+    if (lights == SCENE_MAX_LIGHTS) {
+      LOG_WARN("Scene sets more than %d lights, dropping the rest", SCENE_MAX_LIGHTS);
+      break;
+    }
+    cancelFades(device->light);
+    uint8_t data[8] = {};
+    encodeSceneTarget(*device, target, sceneReports[lights], data);
+    scenePlanner.add(device->number, device->group, data);
+    lights++;
+  }
+  if (lights == 0) return;
+  scene = {};
+  scene.running = true;
+  scene.startedAt = startedAt;
+  scene.lights = lights;
+  scenePlanner.plan(members);
+  scene.frames = scenePlanner.keep(transmitsFor);
+  metrics.scenes++;
+  metrics.sceneLights += scenePlanner.targets();
+  metrics.sceneFrames += scene.frames;
+  LOG_INFO("Scene: %u lights in %u frames", (unsigned)scenePlanner.targets(), (unsigned)scene.frames);
+  if (scene.frames == 0) {
+    finishScene(); // all other bridges' lights
+    return;
+  }
+  queueSceneFrames();
+}
+
+// reports the whole scene to HA once its frames are off air; the lights
+// other bridges sent are left for them to report
+void finishScene()
+{
+  uint32_t elapsedMs = (micros() - scene.startedAt) / 1000;
+  metrics.sceneMs.observe(elapsedMs);
+  for (uint16_t i = 0; i < scene.lights; i++) {
+    const SceneReport& report = sceneReports[i];
+    HALight* light = report.device->light;
+    if (!coordinator.owns(report.device->number)) {
+      light->setCurrentState(report.state);
+      if (report.hasBrightness) light->setCurrentBrightness(report.brightness);
+      if (report.kind == RADIO_COLOR_TEMPERATURE) light->setCurrentColorTemperature(report.temperature);
+      if (report.kind == RADIO_RGB_COLOR) light->setCurrentRGBColor(report.color);
+      continue;
+    }
+    light->setState(report.state);
+    if (report.hasBrightness) light->setBrightness(report.brightness, true);
+    if (report.kind == RADIO_COLOR_TEMPERATURE) light->setColorTemperature(report.temperature, true);
+    if (report.kind == RADIO_RGB_COLOR) light->setRGBColor(report.color, true);
+  }
+  LOG_INFO("Scene done in %u ms: %u lights in %u frames (one frame per light would take %u ms on air)",
+           elapsedMs, (unsigned)scenePlanner.targets(), (unsigned)scene.frames,
+           (unsigned)(scenePlanner.targets() * RADIO_ADVERTISE_MS));
+  scene.running = false;
+}
+
+// called from reportRadioCommands() as each frame goes out
+void reportSceneFrame(const RadioCommand& command)
+{
+  if (scene.running && ++scene.done == scene.frames) finishScene();
+}
+
+// the HA id of a light, from its BLE address
+std::string lightIdFromAddress(const uint8_t* address)
+{
+  char id[LIGHT_ID_LENGTH];
+  snprintf(id, sizeof(id), "%02x%02x", address[1], address[0]);
+  return id;
+}
+
+// the group a light should be paired into
+uint8_t configuredGroup(const std::string& lightId)
+{
+  for (const GroupConfig& group : appConfig.groups) {
+    for (const std::string& id : group.lights) {
+      if (strcasecmp(id.c_str(), lightId.c_str()) == 0) return group.id;
+    }
+  }
+  return DEFAULT_GROUP;
+}
+
+// hooks up the command callbacks for the features an entity was created with
+void setupHALight(HALight* light, uint8_t features)
+{
+  light->onStateCommand(onStateCommand);
+  if (features & LIGHT_BRIGHTNESS) {
+    light->onBrightnessCommand(onBrightnessCommand);
+    light->setBrightnessScale(127);
+    light->setBrightness(127);
+  }
+  if (features & LIGHT_COLOR_TEMPERATURE) light->onColorTemperatureCommand(onColorTemperatureCommand);
+  if (features & LIGHT_RGB) light->onRGBColorCommand(onRGBColorCommand);
+}
+
+// creates the HA object for a registered light, with the features of its
+// model (on/off only for a type code LIGHT_TYPES doesn't have)
+void createHALight(LightDevice& device)
+{
+  uint32_t freeBefore = ESP.getFreeHeap();
+  snprintf(device.name, sizeof(device.name), "Light_%s", device.id);
+  device.model = light_type_index(device.type);
+  HALight* light = new MeshLight(device.id, device.traits().features, &device, NULL);
+  light->setName(device.name);
+  setupHALight(light, device.traits().features);
+  device.light = light;
+  metrics.lights[device.number].id = device.id;
+  if (mqtt->isConnected()) static_cast<MeshLight*>(device.light)->announce();
+  lightMemory.entities++;
+  lightMemory.entityBytes += freeBefore - ESP.getFreeHeap();
+  metrics.lightsRegistered++;
+}
+
+// adverts seen by the scan callbacks, reported at the end of each scan
+struct ScanStats {
+  std::atomic<uint32_t> seen{0};
+  std::atomic<uint32_t> rejected{0}; // not shaped like a BRmesh advert
+  std::atomic<uint32_t> accepted{0};
+  uint32_t startedAt = 0;
+};
+ScanStats scanStats;
+
+void beginScanStats()
+{
+  scanStats.seen = 0;
+  scanStats.rejected = 0;
+  scanStats.accepted = 0;
+  scanStats.startedAt = millis();
+}
+
+void reportScanStats(const char* phase)
+{
+  uint32_t elapsed = millis() - scanStats.startedAt;
+  uint32_t seen = scanStats.seen;
+  LOG_INFO("%s: %u adverts in %u ms (%u/s), %u%% dropped early, %u accepted",
+           phase, seen, elapsed, elapsed ? seen * 1000 / elapsed : 0,
+           seen ? (unsigned)(scanStats.rejected * 100 / seen) : 0, (unsigned)scanStats.accepted);
+}
+
+void dumpAdvert(BLEAdvertisedDevice& foundDevice, const uint8_t* mData)
+{
+  BLEAddress address = foundDevice.getAddress();
+  LOG_INFO_HEX(*address.getNative(), 6, "BLE device found, RSSI %d, address ", foundDevice.getRSSI());
+  LOG_DEBUG_HEX(mData, FASTCON_ADVERT_DATA_LENGTH, "Manufacturer data: ");
+}
+
+// Both scan callbacks start with the same cheap checks on the raw advert,
+// so the adverts of phones, beacons etc. are dropped before any of the
+// bridge's own work. The BLE library has already built the
+// BLEAdvertisedDevice (and its strings) by the time onResult() runs.
+// Returns the manufacturer data of a BRmesh shaped advert, or NULL.
+const uint8_t* filterAdvert(BLEAdvertisedDevice& foundDevice)
+{
+  scanStats.seen++;
+  metrics.advertsSeen++;
+  const uint8_t* mData;
+  if (fastcon_manufacturer_data(foundDevice.getPayload(), foundDevice.getPayloadLength(), mData) != FASTCON_ADVERT_DATA_LENGTH) {
+    scanStats.rejected++;
+    return NULL;
+  }
+  return mData;
+}
+
+uint64_t addressKey(BLEAdvertisedDevice& foundDevice)
+{
+  BLEAddress address = foundDevice.getAddress();
+  return MacTable<KNOWN_LIGHTS_CAPACITY>::key(*address.getNative());
+}
+
+// a new light heard by the pairing scan, from its callback to loop(), which
+// owns myLights
+struct FoundLight {
+  uint8_t address[6];
+  uint8_t mac[6];
+  uint8_t type[2];
+};
+SpscQueue<FoundLight, FOUND_QUEUE_LENGTH> foundQueue;
+
+class AddDeviceCallback: public BLEAdvertisedDeviceCallbacks
+{
+  void onResult(BLEAdvertisedDevice foundDevice)
+  {
+    const uint8_t* mData = filterAdvert(foundDevice);
+    if (!mData) return;
+    // we already know about this device, so ignore it
+    uint64_t key = addressKey(foundDevice);
+    if (knownLights.contains(key)) return;
+    dumpAdvert(foundDevice, mData);
+    // check the device is a light, and using the default key
+    FastconLightAdvert advert;
+    fastcon_decode_light_advert(mData, FASTCON_ADVERT_DATA_LENGTH, default_key, advert);
+    if (light_type_index(mData + 12) != LIGHT_TYPE_UNKNOWN) {
+      LOG_INFO("It's a light (type %02x%02x), %s", mData[12], mData[13],
+               advert.defaultKey ? "using the default key, stored it" : "not on the default key");
+      if (advert.defaultKey) {
+        FoundLight light;
+        memcpy(light.address, *foundDevice.getAddress().getNative(), 6);
+        memcpy(light.mac, advert.mac, 6);
+        memcpy(light.type, advert.type, 2);
+        if (!foundQueue.push(light)) {
+          LOG_WARN("Too many new lights at once, left one for the next scan");
+          return;
+        }
+        scanStats.accepted++;
+        metrics.advertsAccepted++;
+      }
+    }
+  }
+};
+
+// Confirmations of the new key. Runs on the Bluetooth task while
+// pairLights() is sending re-key frames, so it only hands the light's
+// number to the pairing engine.
+class AddLightCallback: public BLEAdvertisedDeviceCallbacks
+{
+  void onResult(BLEAdvertisedDevice foundDevice)
+  {
+    const uint8_t* mData = filterAdvert(foundDevice);
+    if (!mData) return;
+    uint16_t i;
+    if (!knownLights.find(addressKey(foundDevice), i)) return;
+    // still using the default key (i.e. hasn't taken the new one yet), or
+    // garbage once decrypted with ours
+    FastconLightAdvert advert;
+    if (fastcon_decode_light_advert(mData, FASTCON_ADVERT_DATA_LENGTH, my_key, advert) != FASTCON_DECODE_OK || advert.defaultKey) return;
+    // the light reports its number itself
+    if (pairing.confirm(i, advert.number)) {
+      scanStats.accepted++;
+      metrics.advertsAccepted++;
+    }
+  }
+};
+
+// Status adverts of paired lights. Runs on the Bluetooth task: passes the
+// state on to loop() for tracking, and confirms the command the radio task is
+// waiting on, if any.
+class StatusCallback: public BLEAdvertisedDeviceCallbacks
+{
+  void onResult(BLEAdvertisedDevice foundDevice)
+  {
+    const uint8_t* mData = filterAdvert(foundDevice);
+    if (!mData) return;
+    uint16_t i;
+    if (!knownLights.find(addressKey(foundDevice), i)) return;
+    FastconLightAdvert advert;
+    if (fastcon_decode_light_advert(mData, FASTCON_ADVERT_DATA_LENGTH, my_key, advert) != FASTCON_DECODE_OK || advert.defaultKey) return;
+    const uint8_t* status = advert.status;
+    // with several bridges, the status adverts are also what each one hears
+    // the lights at
+    bool tracking = appConfig.radio.trackState || appConfig.bridges.enabled;
+    if (tracking && myLights[i].isRegistered && advert.number == myLights[i].number) {
+      StatusReport report;
+      report.light = myLights[i].number;
+      report.rssi = foundDevice.getRSSI();
+      report.state.level = status[2] & 127;
+      memcpy(report.state.color, status + 3, 3);
+      memcpy(report.state.temperature, status + 6, 2);
+      statusStats.heard++;
+      metrics.advertsAccepted++;
+      if (!statusQueue.push(report)) statusStats.dropped++;
+    }
+    bool confirmed = false;
+    portENTER_CRITICAL(&ackWaitLock);
+    // only single light commands are waited on, and the status carries the
+    // light's number where the command has it
+    if (ackWait.armed && (ackWait.command.data[0] & 0x0f) == FASTCON_SINGLE_CONTROL
+        && ackWait.command.data[1] == status[1] && statusReflects(ackWait.command, status)) {
+      ackWait.armed = false;
+      ackWait.confirmedAt = micros();
+      confirmed = true;
+    }
+    portEXIT_CRITICAL(&ackWaitLock);
+    if (confirmed) xSemaphoreGive(ackSemaphore);
+  }
+};
+
+AddDeviceCallback addDeviceCallback;
+AddLightCallback addLightCallback;
+StatusCallback statusCallback;
+
+// the scan that stays on between commands, for state tracking and closed-loop
+// mode
+void startStatusScan()
+{
+  if (!appConfig.radio.closedLoop && !appConfig.radio.trackState && !appConfig.bridges.enabled) return;
+  pBLEScan = BLEDevice::getScan();
+  // duplicates, as every status advert may carry a change
+  pBLEScan->setAdvertisedDeviceCallbacks(&statusCallback, true);
+  pBLEScan->setInterval(appConfig.radio.closedLoop ? CLOSED_LOOP_SCAN_INTERVAL : STATUS_SCAN_INTERVAL);
+  pBLEScan->setWindow(appConfig.radio.closedLoop ? CLOSED_LOOP_SCAN_WINDOW : STATUS_SCAN_WINDOW);
+  pBLEScan->setActiveScan(false);
+  pBLEScan->start(0, NULL, false); // until stop()
+  statusScanRunning = true;
+}
+
+void stopStatusScan()
+{
+  if (!statusScanRunning) return;
+  statusScanRunning = false;
+  pBLEScan->stop();
+  pBLEScan->clearResults();
+}
+
+// the registered light with this number, if any
+LightDevice* registeredLight(uint8_t number)
+{
+  for (int i = 0; i < myLights.size(); i++) {
+    if (myLights[i].isRegistered && myLights[i].number == number) return &myLights[i];
+  }
+  return NULL;
+}
+
+// publishes a state heard from a light, only the fields its entity has;
+// ArduinoHA skips the MQTT message for any field that hasn't changed
+void publishLightState(LightDevice& light, const LightState& state)
+{
+  HALight* entity = light.light;
+  uint8_t features = light.traits().features;
+  entity->setState(state.level != 0);
+  if (!(features & LIGHT_BRIGHTNESS)) return; // on/off only - no brightness or colour
+  if (state.level != 0) entity->setBrightness(state.level);
+  if (features & LIGHT_RGB) entity->setRGBColor(HALight::RGBColor(state.color[1], state.color[2], state.color[0]));
+  if (features & LIGHT_COLOR_TEMPERATURE) entity->setColorTemperature(state.temperature[0] | state.temperature[1] << 8);
+}
+
+// called from loop(): folds the status adverts heard since the last call into
+// the state table, then publishes lights whose debounce period has passed
+void trackLightStates()
+{
+  StatusReport report;
+  while (statusQueue.pop(report)) {
+    coordinator.hear(report.light, report.rssi, millis());
+    if (lightStates.update(report.light, report.state)) statusStats.changes++;
+  }
+  LightState state;
+  int number;
+  while ((number = lightStates.takeChanged(millis(), STATUS_DEBOUNCE_MS, state)) >= 0) {
+    if (!appConfig.radio.trackState || !coordinator.owns(number)) continue; // its owner publishes it
+    LightDevice* light = registeredLight(number);
+    if (!light) continue;
+    statusStats.published++;
+    LOG_INFO("Light %s reported level %d (%u heard, %u changes, %u published, %u dropped)",
+             light->light->uniqueId(), state.level, (unsigned)statusStats.heard,
+             statusStats.changes, statusStats.published, (unsigned)statusStats.dropped);
+    publishLightState(*light, state);
+  }
+}
+
+void serviceBridges();
+
+// Keeps Wi-Fi, MQTT and the command reports going; called by loop() and by
+// pairing while it waits, so lights are announced, and can be controlled, as
+// soon as they're paired rather than once the whole batch is done.
+void serviceConnections()
+{
+  pollWiFi();
+  if (WiFi.status() == WL_CONNECTED) mqtt->loop();
+  serviceBridges();
+  reportRadioCommands();
+  queueSceneFrames();
+  transitions.tick(millis(), sendFadeStep);
+  if (!bootPhaseAt[BOOT_FIRST_LIGHT] && mqtt->isConnected()) {
+    for (int i = 0; i < myLights.size(); i++) {
+      if (myLights[i].isRegistered) {
+        bootPhase(BOOT_FIRST_LIGHT);
+        break;
+      }
+    }
+  }
+}
+
+// delay() for pairing, servicing the connections meanwhile
+void serviceFor(uint32_t ms)
+{
+  uint32_t startedAt = millis();
+  do {
+    serviceConnections();
+    delay(5);
+  } while (millis() - startedAt < ms);
+}
+
+// Pairing's frames are background work: they wait until no command is
+// queued and the airtime budget has room, or until they've waited as long as
+// a command may. Returns when it's their turn.
+void awaitBackgroundTurn()
+{
+  uint32_t startedAt = millis();
+  for (;;) {
+    xSemaphoreTake(txMutex, portMAX_DELAY);
+    bool turn = txScheduler.admit(TX_BACKGROUND, millis());
+    xSemaphoreGive(txMutex);
+    if (turn || millis() - startedAt >= appConfig.radio.maxLatencyMs) break;
+    serviceFor(10);
+  }
+  metrics.txWaitMs[TX_BACKGROUND].observe(millis() - startedAt);
+}
+
+// adds the lights the pairing scan found to myLights
+void takeFoundLights()
+{
+  FoundLight found;
+  while (foundQueue.pop(found)) {
+    LightDevice light;
+    memcpy(light.address, found.address, 6);
+    memcpy(light.mac, found.mac, 6);
+    memcpy(light.type, found.type, 2);
+    light.group = configuredGroup(lightIdFromAddress(light.address));
+    myLights.push_back(light);
+  }
+}
+
+// Advertises pairing's frame for ms, servicing the connections meanwhile.
+// The radio is only held while the advertiser is set up, so commands go out
+// in between; the radio task stops the advertiser after each, and the frame
+// is put back. between() is called every 10 ms.
+template <typename Fn>
+void advertiseFor(const FastconFrame& frame, uint32_t ms, Fn between)
+{
+  uint32_t startedAt = millis();
+  uint32_t turns = radioTurns - 1; // sets the frame up the first time round
+  do {
+    xSemaphoreTake(radioMutex, portMAX_DELAY);
+    if (radioTurns != turns) {
+      setAdvertisingFrame(frame);
+      pAdvertising->start();
+      turns = radioTurns;
+    }
+    xSemaphoreGive(radioMutex);
+    serviceFor(10);
+    between();
+  } while (millis() - startedAt < ms);
+  xSemaphoreTake(radioMutex, portMAX_DELAY);
+  if (radioTurns == turns) pAdvertising->stop();
+  xSemaphoreGive(radioMutex);
+}
+
+// advertises the wake frame while scanning for lights, BLESCAN_DURATION
+// seconds
+void scan()
+{
+  awaitBackgroundTurn();
+  uint32_t startedAt = millis();
+  LOG_INFO("Send wake command");
+  uint8_t data[] = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+  const uint8_t key[] = { 0x00, 0x00, 0x00, 0x00 };
+  FastconFrame frame;
+  generate_frame(0, data, 6, key, false, frame);
+  LOG_INFO("Scan for lights");
+  pBLEScan = BLEDevice::getScan();
+  pBLEScan->setAdvertisedDeviceCallbacks(&addDeviceCallback);
+  pBLEScan->setInterval(500);
+  pBLEScan->setWindow(500);
+  pBLEScan->setActiveScan(true);
+  beginScanStats();
+  int firstFound = myLights.size();
+  pBLEScan->start(BLESCAN_DURATION, NULL, false);
+  advertiseFor(frame, BLESCAN_DURATION * 1000, takeFoundLights);
+  pBLEScan->stop();
+  pBLEScan->clearResults();
+  takeFoundLights();
+  // the callback reads knownLights, so the new lights only go in once it's
+  // stopped; the BLE library reports each address once a scan
+  for (int i = firstFound; i < myLights.size(); i++) {
+    if (!myLights[i].isRegistered) knownLights.insert(MacTable<KNOWN_LIGHTS_CAPACITY>::key(myLights[i].address), i);
+  }
+  chargeAirtime(TX_BACKGROUND, millis() - startedAt);
+  reportScanStats("Scan");
+}
+
+// advertises the frame asking a light to take our key, its number and group;
+// commands go out in between, and during it
+void sendRekeyFrame(const LightDevice& light)
+{
+  uint8_t data[12];
+  LOG_INFO_HEX(light.mac, 6, "Setting key on light %d, MAC: ", light.number);
+  for (int i = 0; i < 6; i++) data[i] = light.mac[i]; // mac address
+  data[6] = light.number; // light id - we're requesting that it's set to this
+  data[7] = light.group; // group id
+  data[8] = my_key[0];
+  data[9] = my_key[1];
+  data[10] = my_key[2];
+  data[11] = my_key[3];
+  FastconFrame frame;
+  generate_frame(2, data, 12, default_key, false, frame);
+  awaitBackgroundTurn();
+  advertiseFor(frame, PAIR_ADVERTISE_MS, [] {});
+  chargeAirtime(TX_BACKGROUND, PAIR_ADVERTISE_MS);
+}
+
+// a light has confirmed the new key, so give it its HA entity
+void registerPairedLight(LightDevice& light, uint8_t number)
+{
+  light.isRegistered = true;
+  light.number = number;
+  snprintf(light.id, sizeof(light.id), "%s", lightIdFromAddress(light.address).c_str());
+  createHALight(light);
+  LOG_INFO("Light %d confirmed the new key, created light %s", number, light.light->uniqueId());
+}
+
+// Re-keys the lights added to the pairing engine: their frames go out back
+// to back, round robin, while one scan collects the confirmations.
+void pairLights()
+{
+  LOG_INFO_HEX(my_key, 4, "New key: ");
+  pBLEScan = BLEDevice::getScan();
+  // duplicates, as each light has already been reported with the default key
+  pBLEScan->setAdvertisedDeviceCallbacks(&addLightCallback, true);
+  pBLEScan->setInterval(50);
+  pBLEScan->setWindow(50);
+  pBLEScan->setActiveScan(true);
+  beginScanStats();
+  pBLEScan->start(0, NULL, false); // until stop()
+  pAdvertising->setMinInterval(50);
+  pAdvertising->setMaxInterval(50);
+  while (!pairing.done()) {
+    int i;
+    while ((i = pairing.takeConfirmed(millis())) >= 0) registerPairedLight(myLights[pairing[i].id], pairing[i].number);
+    i = pairing.next(millis());
+    if (i < 0) {
+      serviceFor(10);
+      continue;
+    }
+    sendRekeyFrame(myLights[pairing[i].id]);
+    pairing.sent(i, millis());
+    metrics.pairingFrames++;
+  }
+  pBLEScan->stop();
+  pBLEScan->clearResults();
+  int i;
+  while ((i = pairing.takeConfirmed(millis())) >= 0) registerPairedLight(myLights[pairing[i].id], pairing[i].number);
+  reportScanStats("Key confirmation");
+  metrics.pairingConfirmed += pairing.count(PAIRING_CONFIRMED);
+  metrics.pairingFailed += pairing.count(PAIRING_FAILED);
+
+  LOG_INFO("Key exchange: %u of %u lights paired in %u ms, %u frames sent",
+           (unsigned)pairing.count(PAIRING_CONFIRMED), (unsigned)pairing.size(),
+           (unsigned)(millis() - pairing.startedAt()), (unsigned)pairing.frames());
+  for (size_t j = 0; j < pairing.size(); j++) {
+    const LightDevice& light = myLights[pairing[j].id];
+    LOG_INFO_HEX(light.address, 6, "  %s after %d attempts, %u ms: ",
+                 pairing[j].state == PAIRING_CONFIRMED ? "paired" : "failed", pairing[j].attempts,
+                 (unsigned)(pairing[j].finishedAt - pairing.startedAt()));
+  }
+}
+
+void createGroupHALight(LightGroup& group)
+{
+  HALight* light = new MeshLight(group.uniqueId.c_str(), group.features, NULL, &group);
+  light->setName(group.name.c_str());
+  setupHALight(light, group.features);
+  group.light = light;
+  metrics.groups[group.id].id = group.uniqueId.c_str();
+  if (mqtt->isConnected()) static_cast<MeshLight*>(light)->announce();
+  LOG_INFO("Group %d (%s) - %s", group.id, group.name.c_str(), group.uniqueId.c_str());
+}
+
+// creates an HA light for each group with at least one registered light,
+// offering only the features every light in the group has
+void addGroups()
+{
+  std::vector<LightGroup> groups;
+  // the default group only holds the lights not paired into another
+  groups.push_back({ DEFAULT_GROUP, appConfig.groups.empty() ? "All lights" : "Ungrouped lights" });
+  for (const GroupConfig& group : appConfig.groups) groups.push_back({ group.id, group.name });
+
+  for (LightGroup& group : groups) {
+    if (getGroup(group.id)) continue; // already has its entity
+    uint8_t features = LIGHT_BRIGHTNESS | LIGHT_COLOR_TEMPERATURE | LIGHT_RGB;
+    int members = 0;
+    for (int i = 0; i < myLights.size(); i++) {
+      if (!myLights[i].isRegistered || myLights[i].group != group.id) continue;
+      if (members++ == 0) group.model = myLights[i].model;
+      features &= myLights[i].traits().features;
+    }
+    if (members == 0) continue;
+    char uniqueId[24];
+    snprintf(uniqueId, sizeof(uniqueId), "brmesh_group_%d", group.id);
+    group.uniqueId = uniqueId;
+    if (group.name.empty()) group.name = "Group " + std::to_string(group.id);
+    group.features = features;
+    myGroups.push_back(group);
+    createGroupHALight(myGroups.back());
+  }
+}
+
+int registeredLightCount()
+{
+  int count = 0;
+  for (int i = 0; i < myLights.size(); i++) {
+    if (myLights[i].isRegistered) count++;
+  }
+  return count;
+}
+
+// the lights that can still get an HA entity
+int lightEntityRoom()
+{
+  int groups = appConfig.groups.size() + 1;
+  return HA_MAX_ENTITIES - HA_BRIDGE_ENTITIES - groups - registeredLightCount();
+}
+
+// pairs every light found on the default key, numbering them after the
+// lights already registered
+void addLights()
+{
+  uint32_t startedAt = millis();
+  scan();
+  // wait before adding lights, as they seem to need a brief pause after the scan
+  serviceFor(1000);
+  uint8_t nextNumber = 1;
+  for (int i = 0; i < myLights.size(); i++) {
+    if (myLights[i].isRegistered && myLights[i].number >= nextNumber) nextNumber = myLights[i].number + 1;
+  }
+  // in batches, if more lights turned up than the engine holds, and only
+  // as many as have room for an HA entity
+  int room = lightEntityRoom();
+  int i = 0;
+  while (i < myLights.size() && room > 0) {
+    pairing.begin(PAIR_MAX_ATTEMPTS, PAIR_CONFIRM_TIMEOUT_MS, millis());
+    for (; i < myLights.size() && pairing.size() < pairing.capacity() && room > 0; i++) {
+      if (myLights[i].isRegistered) continue;
+      myLights[i].number = nextNumber++;
+      pairing.add(i);
+      room--;
+    }
+    if (pairing.size() > 0) pairLights();
+  }
+  for (; i < myLights.size(); i++) {
+    if (!myLights[i].isRegistered) {
+      LOG_ERROR("No room for more HA entities (%d at most), not pairing the other new lights", HA_MAX_ENTITIES);
+      break;
+    }
+  }
+  LOG_INFO("Pairing took %u ms", (unsigned)(millis() - startedAt));
+}
+
+std::string toHex(const uint8_t* data, int length)
+{
+  std::string hex;
+  char byte[3];
+  for (int i = 0; i < length; i++) {
+    snprintf(byte, sizeof(byte), "%02x", data[i]);
+    hex += byte;
+  }
+  return hex;
+}
+
+bool fromHex(const std::string& hex, uint8_t* data, int length)
+{
+  if (hex.size() != length * 2) return false;
+  for (int i = 0; i < length; i++) {
+    char* end;
+    std::string byte = hex.substr(i * 2, 2);
+    data[i] = strtoul(byte.c_str(), &end, 16);
+    if (*end != 0) return false;
+  }
+  return true;
+}
+
+// BLE addresses as the registry stores them, "aa:bb:cc:dd:ee:ff"
+std::string formatAddress(const uint8_t* address)
+{
+  char text[18];
+  snprintf(text, sizeof(text), "%02x:%02x:%02x:%02x:%02x:%02x",
+           address[0], address[1], address[2], address[3], address[4], address[5]);
+  return text;
+}
+
+bool parseAddress(const std::string& text, uint8_t* address)
+{
+  return sscanf(text.c_str(), "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx",
+                &address[0], &address[1], &address[2], &address[3], &address[4], &address[5]) == 6;
+}
+
+// A light's registry entry, as stored in the registry file and shared with
+// other bridges.
+void writeLight(const LightDevice& light, JsonObject lightDoc)
+{
+  lightDoc["number"] = light.number;
+  lightDoc["address"] = formatAddress(light.address);
+  lightDoc["mac"] = toHex(light.mac, 6);
+  lightDoc["type"] = toHex(light.type, 2);
+  lightDoc["group"] = light.group;
+  lightDoc["id"] = light.id;
+}
+
+// Fills light from its registry entry, touching nothing shared; returns
+// false if the entry isn't valid.
+bool parseLight(JsonObject lightDoc, LightDevice& light)
+{
+  light.number = lightDoc["number"] | 0;
+  light.group = lightDoc["group"] | DEFAULT_GROUP;
+  std::string id = lightDoc["id"] | "";
+  if (light.number == 0 || id.empty() || id.size() >= sizeof(light.id)
+      || !fromHex(lightDoc["mac"] | "", light.mac, 6)
+      || !fromHex(lightDoc["type"] | "", light.type, 2)) {
+    return false;
+  }
+  snprintf(light.id, sizeof(light.id), "%s", id.c_str());
+  if (!parseAddress(lightDoc["address"] | "", light.address)) memset(light.address, 0, sizeof(light.address));
+  light.isRegistered = true;
+  return true;
+}
+
+// Registers a parsed light and creates its HA entity; returns false if
+// there's no room for it. The scan callbacks read myLights and knownLights,
+// so no scan may be running.
+bool addRegisteredLight(const LightDevice& parsed)
+{
+  if (lightEntityRoom() <= 0) {
+    LOG_ERROR("No room for another light's HA entity (%d entities at most), skipping light %d",
+              HA_MAX_ENTITIES, parsed.number);
+    return false;
+  }
+  myLights.push_back(parsed);
+  LightDevice& light = myLights.back();
+  static const uint8_t noAddress[6] = {};
+  if (memcmp(light.address, noAddress, sizeof(noAddress)) != 0) {
+    knownLights.insert(MacTable<KNOWN_LIGHTS_CAPACITY>::key(light.address), myLights.size() - 1);
+  }
+  createHALight(light);
+  return true;
+}
+
+// Registers a light from its registry entry and creates its HA entity;
+// returns false if the entry isn't valid or there's no room for it.
+bool readLight(JsonObject lightDoc)
+{
+  LightDevice light;
+  return parseLight(lightDoc, light) && addRegisteredLight(light);
+}
+
+// Restores the mesh key and the paired lights, creating their HA entities.
+bool loadRegistry(const char *filename) {
+    File file = LittleFS.open(filename, "r");
+    if (!file) {
+        LOG_INFO("No light registry found");
+        return false;
+    }
+
+    JsonDocument doc;
+    DeserializationError error = deserializeJson(doc, file);
+    file.close();
+    if (error) {
+        LOG_ERROR("Failed to parse light registry: %s", error.c_str());
+        return false;
+    }
+    if (!fromHex(doc["key"] | "", my_key, 4)) {
+        LOG_ERROR("Light registry has no valid key");
+        return false;
+    }
+
+    for (JsonObject lightDoc : doc["lights"].as<JsonArray>()) {
+        if (!readLight(lightDoc)) LOG_WARN("Skipping invalid light in registry");
+    }
+    return true;
+}
+
+bool saveRegistry(const char *filename) {
+    File file = LittleFS.open(filename, "w");
+    if (!file) {
+        LOG_ERROR("Failed to open light registry for writing");
+        return false;
+    }
+
+    JsonDocument doc;
+    doc["key"] = toHex(my_key, 4);
+    JsonArray lights = doc["lights"].to<JsonArray>();
+    for (int i = 0; i < myLights.size(); i++) {
+        if (myLights[i].isRegistered) writeLight(myLights[i], lights.add<JsonObject>());
+    }
+
+    if (serializeJson(doc, file) == 0) {
+        LOG_ERROR("Failed to write light registry");
+        file.close();
+        return false;
+    }
+
+    file.close();
+    return true;
+}
+
+// a new random key for the mesh, for lights paired from now on
+void createMeshKey()
+{
+  uint32_t new_key = esp_random();
+  my_key[0] = new_key & 0xFF;
+  my_key[1] = (new_key >> 8) & 0xFF;
+  my_key[2] = (new_key >> 16) & 0xFF;
+  my_key[3] = (new_key >> 24) & 0xFF;
+}
+
+// heap each registered light takes: its record and its HA entity
+uint32_t lightEntityBytes()
+{
+  return lightMemory.entities ? lightMemory.entityBytes / lightMemory.entities : 0;
+}
+
+// the tables sized for the most lights a bridge can have, paid up front
+uint32_t lightTableBytes()
+{
+  return sizeof(knownLights) + sizeof(lightStates) + sizeof(metrics.lights) + sizeof(sceneLightIds);
+}
+
+// logged at boot and after pairing, to size deployments: what a light costs,
+// and how many more would fit in the free heap
+void reportLightMemory()
+{
+  int lights = registeredLightCount();
+  uint32_t perLight = sizeof(LightDevice) + lightEntityBytes();
+  uint32_t freeHeap = ESP.getFreeHeap();
+  LOG_INFO("Memory: %d lights at %u B each (record %u B, HA entity %u B), %u B in all",
+           lights, (unsigned)perLight, (unsigned)sizeof(LightDevice), (unsigned)lightEntityBytes(),
+           (unsigned)(perLight * lights));
+  LOG_INFO("Memory: fixed light tables %u B, free heap %u B (low water %u B), room for about %u more lights",
+           (unsigned)lightTableBytes(), (unsigned)freeHeap, (unsigned)ESP.getMinFreeHeap(),
+           (unsigned)(perLight ? freeHeap / perLight : 0));
+}
+
+volatile bool pairingRequested = false;
+
+void onPairCommand(HAButton* sender)
+{
+  pairingRequested = true;
+}
+
+void publishRegistry();
+
+// Pairs lights that are advertising the default key (i.e. new or just power
+// cycled lights the registry doesn't know), while the registered lights stay
+// usable. Runs from loop(), on the first boot or when asked to; commands go
+// out during the scan and the re-key frames (advertiseFor()), and new
+// entities are announced as their lights confirm.
+void pairNewLights()
+{
+  LOG_INFO("Pairing new lights");
+  digitalWrite (ledPin, HIGH);
+  int registered = registeredLightCount();
+  stopStatusScan();
+  addLights();
+  startStatusScan();
+  addGroups();
+  int added = registeredLightCount() - registered;
+  LOG_INFO("Paired %d new lights", added);
+  if (added > 0) {
+    saveRegistry(REGISTRY_FILE);
+    publishRegistry();
+  }
+  bootPhase(BOOT_LIGHTS);
+  reportLightMemory();
+  digitalWrite (ledPin, LOW);
+}
+
+//////////////////////////////////////////////////////
+// Bridges
+//
+// With "bridges": {"enabled": true, "meshId": "..."} in config.json,
+// several bridges share one mesh, each transmitting for the lights it hears
+// best (bridge_coordinator.h). They take the same HA device id from the
+// mesh id, so Home Assistant sees one set of entities and every bridge gets
+// every command, and they talk over MQTT under brmesh/<mesh id>/:
+//
+//   bridge/<bridge id>  each bridge's heartbeat, its MAC as the id, with the
+//                       RSSI it hears each light at:
+//                       {"rssi": [[<light number>, <dBm>], ...]}
+//   light/<number>      the registry: a retained message per light, its
+//                       registry entry and the mesh key, sealed with the
+//                       bridges' secret: {..., "nonce", "key", "tag"}
+//
+// The leader, the live bridge with the lowest id, is the only one that
+// pairs, and it publishes the registry. The others take the key and the
+// lights from there; a bridge with lights under another key keeps its own.
+// Without a secret the registry isn't shared, and each bridge needs a copy
+// of the leader's registry file.
+//////////////////////////////////////////////////////
+
+char bridgeId[BRIDGE_ID_LENGTH];
+char heartbeatTopic[64];
+char bridgesTopic[64];  // brmesh/<mesh id>/bridge/+
+char registryTopic[64]; // brmesh/<mesh id>/light/+
+bool meshKeySet = false; // restored, created or taken from the registry topics
+uint32_t heartbeatAt = 0;
+uint32_t registryWaitFrom = 0; // millis() the broker connected, while there's no key
+bool registryDue = false;      // the registry is to be published once the bridges are known
+bool registryChanged = false;  // lights taken from the registry topics, not saved yet
+// lights from the registry topics, waiting for loop() to merge them
+std::vector<LightDevice> registryLights;
+size_t liveBridges = 1;
+
+void setBridgeTopics(const char* meshId)
+{
+  snprintf(heartbeatTopic, sizeof(heartbeatTopic), "brmesh/%s/bridge/%s", meshId, bridgeId);
+  snprintf(bridgesTopic, sizeof(bridgesTopic), "brmesh/%s/bridge/+", meshId);
+  snprintf(registryTopic, sizeof(registryTopic), "brmesh/%s/light/+", meshId);
+}
+
+// called on every broker connect
+void subscribeBridgeTopics()
+{
+  if (!appConfig.bridges.enabled) return;
+  mqtt->subscribe(bridgesTopic);
+  mqtt->subscribe(registryTopic);
+  registryWaitFrom = millis();
+  // a heartbeat first, and the registry once the others' heartbeats have
+  // shown who leads
+  heartbeatAt = millis() - BRIDGE_HEARTBEAT_MS;
+  registryDue = true;
+}
+
+// the part of a topic after the wildcard's prefix, or NULL if it doesn't match
+const char* topicSuffix(const char* topic, const char* wildcard)
+{
+  size_t prefix = strlen(wildcard) - 1;
+  return strncmp(topic, wildcard, prefix) == 0 ? topic + prefix : NULL;
+}
+
+void publishHeartbeat()
+{
+  uint8_t lights[256];
+  int8_t rssi[256];
+  size_t n = coordinator.snapshot(millis(), lights, rssi, 256);
+  JsonDocument doc;
+  JsonArray table = doc["rssi"].to<JsonArray>();
+  for (size_t i = 0; i < n; i++) {
+    JsonArray entry = table.add<JsonArray>();
+    entry.add((int)lights[i]);
+    entry.add((int)rssi[i]);
+  }
+  std::string payload;
+  serializeJson(doc, payload);
+  mqtt->publish(heartbeatTopic, payload.c_str());
+}
+
+void onHeartbeat(const char* id, const uint8_t* payload, uint16_t length)
+{
+  JsonDocument doc;
+  if (deserializeJson(doc, payload, length)) return;
+  uint8_t lights[256];
+  int8_t rssi[256];
+  size_t n = 0;
+  for (JsonVariant entry : doc["rssi"].as<JsonArray>()) {
+    if (n == 256) break;
+    lights[n] = entry[0] | 0;
+    rssi[n] = entry[1] | BRIDGE_RSSI_NONE;
+    n++;
+  }
+  if (!coordinator.receive(id, lights, rssi, n, millis())) LOG_WARN("More than %d bridges, ignoring one", MAX_BRIDGES);
+}
+
+// HMAC-SHA256 keyed with the bridges' secret
+void registryHmac(const uint8_t* input, size_t length, uint8_t* hmac)
+{
+  const std::string& secret = appConfig.bridges.secret;
+  mbedtls_md_hmac(mbedtls_md_info_from_type(MBEDTLS_MD_SHA256), (const uint8_t*)secret.data(), secret.size(),
+                  input, length, hmac);
+}
+
+// The mesh key as the registry topics carry it: XORed with an HMAC of a
+// random nonce, so readers of the broker don't learn it, and tagged with an
+// HMAC of the nonce, the key and the light, so writers can't plant a key or
+// a light. Both ends need the same secret.
+void sealMeshKey(const LightDevice& light, JsonObject doc)
+{
+  uint32_t random = esp_random();
+  uint8_t input[1 + REGISTRY_NONCE_LENGTH + 4 + 1 + 6];
+  uint8_t hmac[32];
+  uint8_t sealed[4];
+  input[0] = 'k';
+  memcpy(input + 1, &random, REGISTRY_NONCE_LENGTH);
+  registryHmac(input, 1 + REGISTRY_NONCE_LENGTH, hmac);
+  for (int i = 0; i < 4; i++) sealed[i] = my_key[i] ^ hmac[i];
+  input[0] = 't';
+  memcpy(input + 1 + REGISTRY_NONCE_LENGTH, my_key, 4);
+  input[1 + REGISTRY_NONCE_LENGTH + 4] = light.number;
+  memcpy(input + 1 + REGISTRY_NONCE_LENGTH + 4 + 1, light.mac, 6);
+  doc["nonce"] = toHex(input + 1, REGISTRY_NONCE_LENGTH);
+  doc["key"] = toHex(sealed, 4);
+  registryHmac(input, sizeof(input), hmac);
+  doc["tag"] = toHex(hmac, REGISTRY_TAG_LENGTH);
+}
+
+// the other way: false if the message isn't sealed with our secret
+bool openMeshKey(const LightDevice& light, JsonObject doc, uint8_t* key)
+{
+  uint8_t input[1 + REGISTRY_NONCE_LENGTH + 4 + 1 + 6];
+  uint8_t hmac[32];
+  uint8_t sealed[4];
+  uint8_t tag[REGISTRY_TAG_LENGTH];
+  if (!fromHex(doc["nonce"] | "", input + 1, REGISTRY_NONCE_LENGTH) || !fromHex(doc["key"] | "", sealed, 4)
+      || !fromHex(doc["tag"] | "", tag, REGISTRY_TAG_LENGTH)) return false;
+  input[0] = 'k';
+  registryHmac(input, 1 + REGISTRY_NONCE_LENGTH, hmac);
+  for (int i = 0; i < 4; i++) key[i] = sealed[i] ^ hmac[i];
+  input[0] = 't';
+  memcpy(input + 1 + REGISTRY_NONCE_LENGTH, key, 4);
+  input[1 + REGISTRY_NONCE_LENGTH + 4] = light.number;
+  memcpy(input + 1 + REGISTRY_NONCE_LENGTH + 4 + 1, light.mac, 6);
+  registryHmac(input, sizeof(input), hmac);
+  uint8_t diff = 0;
+  for (int i = 0; i < REGISTRY_TAG_LENGTH; i++) diff |= hmac[i] ^ tag[i];
+  return diff == 0;
+}
+
+// a light from the registry topics: the first one sets the key of a bridge
+// without one
+void onRegistryLight(const uint8_t* payload, uint16_t length)
+{
+  JsonDocument doc;
+  LightDevice light;
+  uint8_t key[4];
+  if (appConfig.bridges.secret.empty()) return;
+  if (deserializeJson(doc, payload, length) || !parseLight(doc.as<JsonObject>(), light)) {
+    LOG_WARN("Registry light on MQTT isn't valid, ignoring it");
+    return;
+  }
+  if (!openMeshKey(light, doc.as<JsonObject>(), key)) {
+    LOG_ERROR("Registry light on MQTT isn't sealed with our secret, ignoring it");
+    return;
+  }
+  if (!meshKeySet) {
+    memcpy(my_key, key, sizeof(my_key));
+    meshKeySet = true;
+    registryChanged = true;
+    LOG_INFO_HEX(my_key, 4, "Took the mesh key from the registry: ");
+  } else if (memcmp(key, my_key, sizeof(my_key)) != 0) {
+    LOG_ERROR("Registry light on MQTT has another mesh key, ignoring it (another mesh with this mesh id?)");
+    return;
+  }
+  for (int i = 0; i < myLights.size(); i++) {
+    if (myLights[i].isRegistered && myLights[i].number == light.number) return;
+  }
+  for (const LightDevice& waiting : registryLights) {
+    if (waiting.number == light.number) return;
+  }
+  registryLights.push_back(light);
+}
+
+// called from loop(), never while pairing: adds the lights from the registry
+// topics with the status scan paused, as its callback reads the tables they
+// go into
+void mergeRegistryLights()
+{
+  if (registryLights.empty()) return;
+  bool scanning = statusScanRunning;
+  stopStatusScan();
+  for (const LightDevice& light : registryLights) {
+    if (!addRegisteredLight(light)) continue;
+    registryChanged = true;
+    LOG_INFO("Light %d (group %d) - %s, from the registry", light.number, light.group, myLights.back().id);
+  }
+  registryLights.clear();
+  if (scanning) startStatusScan();
+}
+
+// publishes every registered light as a retained registry message
+void publishRegistry()
+{
+  if (!appConfig.bridges.enabled || appConfig.bridges.secret.empty() || !mqtt->isConnected()) return;
+  char topic[64];
+  for (int i = 0; i < myLights.size(); i++) {
+    if (!myLights[i].isRegistered) continue;
+    JsonDocument doc;
+    writeLight(myLights[i], doc.to<JsonObject>());
+    sealMeshKey(myLights[i], doc.as<JsonObject>());
+    std::string payload;
+    serializeJson(doc, payload);
+    snprintf(topic, sizeof(topic), "brmesh/%s/light/%d", appConfig.bridges.meshId.c_str(), myLights[i].number);
+    mqtt->publish(topic, payload.c_str(), true);
+  }
+  LOG_INFO("Published the registry, %d lights", registeredLightCount());
+}
+
+void onMqttMessage(const char* topic, const uint8_t* payload, uint16_t length)
+{
+  const char* suffix;
+  if (strcmp(topic, sceneTopic) == 0) {
+    onSceneMessage(payload, length);
+  } else if (!appConfig.bridges.enabled) {
+    return;
+  } else if ((suffix = topicSuffix(topic, bridgesTopic))) {
+    onHeartbeat(suffix, payload, length);
+  } else if (topicSuffix(topic, registryTopic)) {
+    onRegistryLight(payload, length);
+  }
+}
+
+// whether this bridge may pair: with several, only the leader does, and
+// only once it has the mesh key
+bool mayPair()
+{
+  if (!appConfig.bridges.enabled) return true;
+  if (!coordinator.isLeader()) {
+    LOG_INFO("Pairing is left to the leader bridge");
+    return false;
+  }
+  if (!meshKeySet) {
+    LOG_INFO("No mesh key yet, not pairing");
+    return false;
+  }
+  return true;
+}
+
+// called from serviceConnections(): heartbeats, failover, and the registry
+void serviceBridges()
+{
+  if (!appConfig.bridges.enabled || !mqtt->isConnected()) return;
+  uint32_t now = millis();
+  coordinator.expire(now);
+  if (now - heartbeatAt >= BRIDGE_HEARTBEAT_MS) {
+    heartbeatAt = now;
+    publishHeartbeat();
+    uint32_t owned = 0;
+    for (int i = 0; i < myLights.size(); i++) owned += myLights[i].isRegistered && coordinator.owns(myLights[i].number);
+    metrics.lightsOwned = owned;
+  }
+  if (coordinator.bridges() != liveBridges) {
+    liveBridges = coordinator.bridges();
+    metrics.bridgesLive = liveBridges;
+    LOG_INFO("Bridges: %u live, this one %s", (unsigned)liveBridges, coordinator.isLeader() ? "leads" : "doesn't lead");
+  }
+  if (registryChanged) {
+    registryChanged = false;
+    addGroups();
+    saveRegistry(REGISTRY_FILE);
+  }
+  // the leader publishes once the other bridges have had a heartbeat to
+  // show up in
+  if (registryDue && now - registryWaitFrom >= 2 * BRIDGE_HEARTBEAT_MS) {
+    registryDue = false;
+    if (meshKeySet && coordinator.isLeader()) publishRegistry();
+  }
+  // no registry from anyone: the leader starts the mesh with a new key
+  if (!meshKeySet && now - registryWaitFrom >= BRIDGE_REGISTRY_WAIT_MS && coordinator.isLeader()) {
+    LOG_INFO("No registry from the other bridges, pairing with a new key");
+    createMeshKey();
+    meshKeySet = true;
+    saveRegistry(REGISTRY_FILE);
+    pairingRequested = true;
+  }
+}
+
+//////////////////////////////////////////////////////
+// Metrics page and diagnostic sensors
+//////////////////////////////////////////////////////
+
+const char* const txClassNames[TX_CLASSES] = { "on_off", "scene", "level", "background" };
+
+// the transmit scheduler's classes and budget, for tuning them
+void renderTxMetrics(MetricsWriter& out)
+{
+  xSemaphoreTake(txMutex, portMAX_DELAY);
+  TxStats stats = txScheduler.stats();
+  int32_t budgetLeftMs = txScheduler.budgetLeftMs();
+  xSemaphoreGive(txMutex);
+  out.header("brmesh_tx_wait_ms", "histogram", "Time a frame waited in the transmit scheduler");
+  for (int c = 0; c < TX_CLASSES; c++) out.series("brmesh_tx_wait_ms", "class", txClassNames[c], metrics.txWaitMs[c]);
+  out.header("brmesh_tx_sent_total", "counter", "Frames sent, by class");
+  for (int c = 0; c < TX_CLASSES; c++) out.sample("brmesh_tx_sent_total", "class", txClassNames[c], stats.sent[c]);
+  out.header("brmesh_tx_dropped_total", "counter", "Frames dropped with their class queue full");
+  for (int c = 0; c < TX_CLASSES; c++) out.sample("brmesh_tx_dropped_total", "class", txClassNames[c], stats.dropped[c]);
+  out.counter("brmesh_tx_overdue_total", "Frames sent ahead of their class for waiting too long", stats.overdue);
+  out.counter("brmesh_tx_superseded_total", "Brightness and colour frames dropped for an off that undoes them", stats.superseded);
+  out.counter("brmesh_tx_budget_waits_total", "Times the airtime budget held a frame back", stats.budgetWaits);
+  out.counter("brmesh_tx_airtime_ms_total", "Time on air, pairing included", stats.airtimeMs);
+  out.gauge("brmesh_tx_budget_ms", "Airtime budget per second", appConfig.radio.airtimeBudgetMs);
+  out.gauge("brmesh_tx_budget_left_ms", "Airtime left in the budget", budgetLeftMs > 0 ? budgetLeftMs : 0);
+}
+
+// the Prometheus text page served on /metrics
+std::string renderMetrics()
+{
+  std::string page;
+  page.reserve(4096);
+  MetricsWriter out(page);
+  out.histogram("brmesh_command_latency_ms", "MQTT command to first frame on air", metrics.commandLatencyMs);
+  out.histogram("brmesh_encode_us", "Time to encode a command frame", metrics.encodeUs);
+  out.counter("brmesh_frame_cache_hits_total", "Command frames patched from the frame cache", frameCache.hits());
+  out.counter("brmesh_frame_cache_misses_total", "Command frames encoded in full", frameCache.misses());
+  out.histogram("brmesh_advertise_ms", "Time a command frame spent on air", metrics.advertiseMs);
+  out.histogram("brmesh_scene_ms", "Scene message to its last frame off air", metrics.sceneMs);
+  out.counter("brmesh_scenes_total", "Scene messages sent", metrics.scenes);
+  out.counter("brmesh_scene_lights_total", "Lights set by scenes", metrics.sceneLights);
+  out.counter("brmesh_scene_frames_total", "Frames scenes took", metrics.sceneFrames);
+  renderTxMetrics(out);
+  out.counter("brmesh_fades_total", "Brightness and colour commands faded", metrics.fades);
+  out.counter("brmesh_fade_frames_total", "Fade steps queued", metrics.fadeFrames);
+  out.gauge("brmesh_bridges_live", "Bridges on the mesh, this one included", metrics.bridgesLive);
+  out.gauge("brmesh_lights_owned", "Lights this bridge transmits for", metrics.lightsOwned);
+  out.counter("brmesh_commands_left_to_owner_total", "Commands left to the bridge that owns their light", metrics.commandsLeftToOwner);
+  out.counter("brmesh_commands_enqueued_total", "Commands queued for the radio", radioStats.enqueued);
+  out.counter("brmesh_commands_sent_total", "Commands advertised", radioStats.sent);
+  out.counter("brmesh_commands_dropped_total", "Commands dropped with the radio queue full", radioStats.dropped);
+  out.counter("brmesh_commands_coalesced_total", "Brightness and color commands replaced by a newer one", radioStats.coalesced);
+  out.counter("brmesh_commands_confirmed_total", "Commands stopped early by the light's status", radioStats.confirmed);
+  out.counter("brmesh_airtime_ms_total", "Time spent advertising commands", radioStats.airtimeMs);
+  out.gauge("brmesh_radio_queue_max_depth", "Deepest the radio queue has been", radioStats.maxQueueDepth);
+  out.counter("brmesh_adverts_seen_total", "Adverts delivered to the scan callbacks", metrics.advertsSeen);
+  out.counter("brmesh_adverts_accepted_total", "FastCon adverts the scan callbacks acted on", metrics.advertsAccepted);
+  out.counter("brmesh_status_published_total", "Light state changes published from status adverts", statusStats.published);
+  out.counter("brmesh_pairing_frames_total", "Re-key frames advertised while pairing", metrics.pairingFrames);
+  out.counter("brmesh_pairing_confirmed_total", "Lights that confirmed their new key", metrics.pairingConfirmed);
+  out.counter("brmesh_pairing_failed_total", "Lights given up on while pairing", metrics.pairingFailed);
+  out.counter("brmesh_log_dropped_total", "Log records dropped with the log ring full", logRing.dropped());
+  out.gauge("brmesh_heap_free_bytes", "Free heap", ESP.getFreeHeap());
+  out.gauge("brmesh_heap_min_free_bytes", "Lowest free heap since boot", ESP.getMinFreeHeap());
+  out.gauge("brmesh_uptime_seconds", "Time since boot", millis() / 1000);
+  out.gauge("brmesh_lights_registered", "Paired lights", metrics.lightsRegistered);
+  out.gauge("brmesh_light_record_bytes", "Size of a light's record", sizeof(LightDevice));
+  out.gauge("brmesh_light_entity_bytes", "Heap taken by a light's HA entity, on average", lightEntityBytes());
+  out.gauge("brmesh_light_tables_bytes", "Fixed tables sized for the most lights", lightTableBytes());
+  out.header("brmesh_boot_phase_ms", "gauge", "Time from boot to each startup phase");
+  for (int i = 0; i < BOOT_PHASES; i++) {
+    if (bootPhaseAt[i]) out.sample("brmesh_boot_phase_ms", "phase", bootPhaseNames[i], bootPhaseAt[i]);
+  }
+  out.header("brmesh_light_commands_total", "counter", "Commands sent to each light");
+  for (const CommandCounter& light : metrics.lights) {
+    if (light.id) out.sample("brmesh_light_commands_total", "light", light.id, light.commands);
+  }
+  out.header("brmesh_group_commands_total", "counter", "Commands sent to each group");
+  for (const CommandCounter& group : metrics.groups) {
+    if (group.id) out.sample("brmesh_group_commands_total", "group", group.id, group.commands);
+  }
+  return page;
+}
+
+void startMetricsServer()
+{
+  // per light and group command counts: behind the same login
+  server.on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if (!portalAuthenticated(request, true)) return;
+    request->send(200, "text/plain; version=0.0.4", renderMetrics().c_str());
+  });
+  server.begin();
+}
+
+// a few of the metrics as HA diagnostic sensors, with "metrics": {"haSensors": true}
+HASensorNumber* latencySensor = NULL;
+HASensorNumber* commandsSensor = NULL;
+HASensorNumber* advertsSensor = NULL;
+HASensorNumber* heapSensor = NULL;
+unsigned long diagnosticsUpdatedAt = 0;
+
+HASensorNumber* createDiagnosticSensor(const char* id, const char* name, const char* unit, const char* icon)
+{
+  HASensorNumber* sensor = new HASensorNumber(id);
+  sensor->setName(name);
+  sensor->setEntityCategory("diagnostic");
+  if (unit) sensor->setUnitOfMeasurement(unit);
+  sensor->setIcon(icon);
+  return sensor;
+}
+
+void createDiagnosticSensors()
+{
+  latencySensor = createDiagnosticSensor("brmesh_latency_p95", "Command latency p95", "ms", "mdi:timer-outline");
+  commandsSensor = createDiagnosticSensor("brmesh_commands_sent", "Commands sent", NULL, "mdi:send");
+  advertsSensor = createDiagnosticSensor("brmesh_adverts_seen", "Adverts seen", NULL, "mdi:radar");
+  heapSensor = createDiagnosticSensor("brmesh_heap_low_water", "Heap low water", "B", "mdi:memory");
+}
+
+// called from loop()
+void updateDiagnosticSensors()
+{
+  if (!latencySensor || millis() - diagnosticsUpdatedAt < METRICS_SENSOR_INTERVAL_MS) return;
+  diagnosticsUpdatedAt = millis();
+  latencySensor->setValue(metrics.commandLatencyMs.quantile(0.95f));
+  commandsSensor->setValue((uint32_t)radioStats.sent);
+  advertsSensor->setValue((uint32_t)metrics.advertsSeen);
+  heapSensor->setValue(ESP.getMinFreeHeap());
+}
+
+//////////////////////////////////////////////////////
+// Live reconfiguration
+//
+// A config saved from the portal is applied in place: a Wi-Fi change rejoins
+// the network and an MQTT change reconnects to the broker, while BLE, the
+// mesh key and the paired lights carry on untouched.
+//////////////////////////////////////////////////////
+
+// HAMqtt keeps the pointers passed to begin(), and its client reads the broker
+// and credentials through them on every connect, so they live here, where a
+// change can rewrite them in place
+char mqttBroker[64];
+char mqttUsername[64];
+char mqttPassword[64];
+
+void setMqttSettings(const MQTTConfig& mqttConfig)
+{
+  snprintf(mqttBroker, sizeof(mqttBroker), "%s", mqttConfig.broker.c_str());
+  snprintf(mqttUsername, sizeof(mqttUsername), "%s", mqttConfig.username.c_str());
+  snprintf(mqttPassword, sizeof(mqttPassword), "%s", mqttConfig.password.c_str());
+}
+
+// The first boot's password for the web pages: random, saved to
+// config.json and logged once, so each bridge has its own.
+void createWebPassword()
+{
+  static const char alphabet[] = "abcdefghijkmnpqrstuvwxyz23456789"; // no look-alikes
+  static char username[33];
+  static char password[WEB_PASSWORD_LENGTH + 1];
+  for (int i = 0; i < WEB_PASSWORD_LENGTH; i++) password[i] = alphabet[esp_random() % (sizeof(alphabet) - 1)];
+  password[WEB_PASSWORD_LENGTH] = 0;
+  appConfig.web.password = password;
+  if (!saveConfig("/config.json", appConfig)) LOG_ERROR("Failed to save the web password");
+  snprintf(username, sizeof(username), "%s", appConfig.web.username.c_str()); // the log is deferred
+  LOG_WARN("Web pages login: %s / %s (\"web\" in config.json)", username, password);
+}
+
+// called from loop() with the config /save just wrote
+void applyConfig(const AppConfig& updated)
+{
+  bool wifiChanged = updated.wifi.ssid != appConfig.wifi.ssid || updated.wifi.password != appConfig.wifi.password;
+  bool mqttChanged = updated.mqtt.broker != appConfig.mqtt.broker || updated.mqtt.username != appConfig.mqtt.username
+                     || updated.mqtt.password != appConfig.mqtt.password;
+  if (updated.mqtt.port != appConfig.mqtt.port) {
+    // HAMqtt takes the port by value, once
+    LOG_INFO("MQTT port changed. Restarting...");
+    delay(1000); // let the response go out
+    ESP.restart();
+  }
+  if (wifiChanged && wifiLink.state == WIFI_CONNECTED) {
+    // kept until the new settings connect, in case they don't
+    wifiLink.previous = appConfig.wifi;
+    wifiLink.hasPrevious = true;
+  }
+  xSemaphoreTake(configMutex, portMAX_DELAY);
+  appConfig.wifi = updated.wifi;
+  appConfig.mqtt = updated.mqtt;
+  appConfig.web = updated.web;
+  xSemaphoreGive(configMutex);
+  if (wifiChanged) {
+    LOG_INFO("Wi-Fi settings changed, rejoining");
+    WiFi.disconnect();
+    startWiFi(appConfig.wifi);
+  }
+  if (mqttChanged) {
+    LOG_INFO("MQTT settings changed, reconnecting");
+    setMqttSettings(appConfig.mqtt);
+    // HAMqtt reconnects from loop(), with the new settings
+    mqtt->disconnect();
+  }
+}
+
+void onBrokerConnected()
+{
+  bootPhase(BOOT_MQTT);
+  mqtt->subscribe(sceneTopic);
+  subscribeBridgeTopics();
+}
+
+// Starts everything and returns: Wi-Fi and MQTT connect, and the first
+// boot's pairing runs, from loop().
+void setup() {
+  pinMode (ledPin, OUTPUT);
+  pinMode (PAIR_BUTTON_PIN, INPUT_PULLUP);
+  // turn on to show we're still in setup (and are adding for lights)
+  digitalWrite (ledPin, HIGH);
+  Serial.begin(115200);
+  configMutex = xSemaphoreCreateMutex();
+  startLogTask();
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+  fastcon_set_trace(dumpFrameStage);
+#endif
+
+  if (!loadConfig("/config.json", appConfig)) {
+      LOG_WARN("No valid configuration found. Starting Config Portal.");
+      setupConfigPortal(appConfig); // Launch AP mode for configuration
+      return;
+  }
+  bootPhase(BOOT_CONFIG);
+  if (appConfig.web.password.empty()) createWebPassword();
+  LOG_INFO("Loaded Configuration: Wi-Fi SSID: %s, MQTT Broker: %s",
+           appConfig.wifi.ssid.c_str(), appConfig.mqtt.broker.c_str());
+
+  // associates in the background while BLE comes up
+  startWiFi(appConfig.wifi);
+
+  WiFi.macAddress(mac);
+  snprintf(bridgeId, sizeof(bridgeId), "%s", toHex(mac, 6).c_str());
+  coordinator.begin(bridgeId);
+  if (appConfig.bridges.enabled) {
+    // every bridge on the mesh is the same HA device, its id the mesh id's
+    // bytes in hex
+    const std::string& meshId = appConfig.bridges.meshId;
+    device.setUniqueId((const uint8_t*)meshId.c_str(), meshId.size());
+    setBridgeTopics(meshId.c_str());
+    if (appConfig.bridges.secret.empty()) LOG_WARN("No \"secret\" under \"bridges\" in config.json, the registry isn't shared");
+  } else {
+    device.setUniqueId(mac, sizeof(mac));
+  }
+  device.setName("BRMesh");
+  device.setManufacturer("BRMesh");
+  device.setModel("BRMesh");
+  mqtt = new HAMqtt(client, device, HA_MAX_ENTITIES);
+  mqtt->setBufferSize(MQTT_BUFFER_SIZE);
+  mqtt->onConnected(onBrokerConnected);
+  mqtt->onMessage(onMqttMessage);
+  snprintf(sceneTopic, sizeof(sceneTopic), "aha/%s/scene/cmd_t", device.getUniqueId());
+  LOG_INFO_HEX(mac, 6, "ESP32 MAC: ");
+  // Create the BLE Device
+  BLEDevice::init("ESP32 as iBeacon");
+  pAdvertising = BLEDevice::getAdvertising();
+  // mark the advertisement data as custom, so start() doesn't replace
+  // the raw frames set by setAdvertisingFrame()
+  pAdvertising->setAdvertisementData(BLEAdvertisementData());
+  BLEDevice::startAdvertising();
+  radioMutex = xSemaphoreCreateMutex();
+  txMutex = xSemaphoreCreateMutex();
+  ackSemaphore = xSemaphoreCreateBinary();
+  bootPhase(BOOT_BLE);
+
+  bool restored = loadRegistry(REGISTRY_FILE);
+  meshKeySet = restored;
+  if (restored) {
+    LOG_INFO("Restored %d lights from the registry", registeredLightCount());
+  } else if (appConfig.bridges.enabled) {
+    // the key and lights may come from the other bridges
+    LOG_INFO("No registry, waiting for one from the other bridges");
+  } else {
+    createMeshKey();
+    meshKeySet = true;
+    saveRegistry(REGISTRY_FILE);
+    // add the lights from loop(), alongside the Wi-Fi and MQTT connection
+    pairingRequested = true;
+  }
+  HAButton* pairButton = new HAButton("brmesh_pair");
+  pairButton->setName("Pair new lights");
+  pairButton->setIcon("mdi:lightbulb-auto");
+  pairButton->onCommand(onPairCommand);
+  HANumber* transitionNumber = new HANumber("brmesh_transition", HANumber::PrecisionP1);
+  transitionNumber->setName("Light transition");
+  transitionNumber->setIcon("mdi:transition");
+  transitionNumber->setUnitOfMeasurement("s");
+  transitionNumber->setMin(0);
+  transitionNumber->setMax(TRANSITION_MAX_MS / 1000);
+  transitionNumber->setStep(0.5f);
+  transitionNumber->setMode(HANumber::ModeBox);
+  // HA sends the retained value back on every connect
+  transitionNumber->setRetain(true);
+  transitionNumber->onCommand(onTransitionCommand);
+  // print the added lights with their IDs
+  for (int i = 0; i < myLights.size(); i++) {
+    if (myLights[i].isRegistered) {
+      LOG_INFO("Light %d (group %d) - %s", myLights[i].number, myLights[i].group, myLights[i].light->uniqueId());
+    }
+  }
+  addGroups();
+  if (appConfig.metrics.haSensors) createDiagnosticSensors();
+  startStatusScan();
+  txScheduler.configure(appConfig.radio.airtimeBudgetMs, appConfig.radio.maxLatencyMs);
+  startRadioTask();
+  addPortalRoutes(appConfig, true);
+  portalRoutesAdded = true;
+  startMetricsServer();
+  LOG_INFO("Connecting to MQTT Broker: %s:%d", appConfig.mqtt.broker.c_str(), appConfig.mqtt.port);
+  // connects from loop(), once Wi-Fi is up
+  setMqttSettings(appConfig.mqtt);
+  mqtt->begin(mqttBroker, appConfig.mqtt.port, mqttUsername, mqttPassword);
+  if (restored) {
+    bootPhase(BOOT_LIGHTS);
+    reportLightMemory();
+    // finished adding lights
+    digitalWrite (ledPin, LOW);
+  }
+  LOG_INFO("Ready");
+}
+
+void loop()
+{
+  if (configSaved) {
+    configSaved = false;
+    AppConfig updated;
+    xSemaphoreTake(configMutex, portMAX_DELAY);
+    bool loaded = mqtt && loadConfig("/config.json", updated);
+    xSemaphoreGive(configMutex);
+    if (loaded) {
+      applyConfig(updated);
+    } else {
+      // nothing running yet on the first setup, so start over with it
+      LOG_INFO("Configuration Saved. Restarting...");
+      delay(1000); // let the response go out
+      ESP.restart();
+    }
+  }
+  if (!mqtt) return; // config portal only
+  serviceConnections();
+  mergeRegistryLights();
+  if (WiFi.status() == WL_CONNECTED) {
+    trackLightStates();
+    updateDiagnosticSensors();
+  }
+  if (digitalRead(PAIR_BUTTON_PIN) == LOW) pairingRequested = true;
+  if (pairingRequested) {
+    pairingRequested = false;
+    if (mayPair()) pairNewLights();
   }
 }